@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "chip8.h"
+#include <stdint.h>
+
+/* Guest memory lives in an mmap'd arena instead of inside chip8_t.
+   Every access masks the address with chip8->memoryMask, and the arena has padding after the
+   address space so the longest run from a masked address (FX55/FX65 and DXYN read up to 15 bytes
+   past I) still lands in mapped memory. No access needs a bounds check.
+   Accesses that run past the end hit the padding, they don't wrap around to 0x000.
+   The display is part of the same mapping, on its own pages after the padding.
+*/
+
+// Classic CHIP-8 has 4 KB, XO-CHIP programs can address 64 KB
+#define CHIP8_ARENA_XOCHIP_SIZE 65536
+// Bytes of slack after the address space for multi-byte accesses from a masked address (up to 15
+// for FX55/FX65/DXYN, 1 for an opcode's second byte). It's ordinary read/write memory, not a guard
+// page; only the mapping as a whole is rounded up to whole pages.
+#define CHIP8_ARENA_PADDING 16
+
+// A read-only memory image (fontset + ROM) that several machines can map copy-on-write,
+// pages are only copied for the instances that write to them
+typedef struct {
+    int fd;
+    uint32_t size;
+} memoryImage_t;
+
+int allocateMemoryArena(chip8_t *chip8, uint32_t size); // Sets memory and display, size is CHIP8_MEMORY_SIZE or CHIP8_ARENA_XOCHIP_SIZE
+void freeMemoryArena(chip8_t *chip8);
+// Builds an image from a machine's current memory, normally right after initializeCPU() and loadROM()
+int createMemoryImage(memoryImage_t *image, const chip8_t *chip8);
+// Replaces the machine's memory with a private copy-on-write mapping of the image, sizes must match
+int mapMemoryImage(chip8_t *chip8, const memoryImage_t *image);
+void destroyMemoryImage(memoryImage_t *image);
+
+#endif // ARENA_H
@@ -0,0 +1,42 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include "chip8.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Speed calibration: finds how many instructions per frame a ROM needs, headless, no SDL.
+
+   Most games pace themselves with the delay timer: FX15 sets it, the game does one frame's work,
+   then spins on FX07 until the timer runs out. With enough instructions per frame the work is done
+   while the timer is still running, so each wait starts with FX07 reading a non-zero value. With
+   too few the timer has already run out and the game slows down. Every instruction past what it
+   needs is spent spinning.
+
+   The ROM runs once per candidate rate (see runFrame()), lowest first, and the first one where
+     - at least 95% of the delay timer waits start with the timer still running, and
+     - the game draws (DXYN) at least 95% as often as at CALIBRATION_MAX_IPF
+   wins. Games that never wait on the delay timer are paced by their drawing instead, against the
+   draw rate they have under COSMAC VIP timing, where every DXYN waits for the next frame.
+*/
+
+#define CALIBRATION_WARMUP_FRAMES 60 // Run before measuring, past the game's setup
+#define CALIBRATION_FRAMES 600       // Measured, 10 seconds of game time
+#define CALIBRATION_TOTAL_FRAMES (CALIBRATION_WARMUP_FRAMES + CALIBRATION_FRAMES)
+#define CALIBRATION_MAX_IPF 2000
+
+typedef struct {
+    int instructionsPerFrame;     // The chosen rate
+    bool timerPaced;              // Paced by delay timer waits rather than by drawing
+    uint64_t waits;               // Delay timer waits measured at the chosen rate
+    uint64_t lateWaits;           // Of which the timer had already run out
+    double drawsPerFrame;         // At the chosen rate
+    double referenceDrawsPerFrame;
+} calibration_t;
+
+// `loaded` is a machine with the ROM loaded, it isn't changed. keys has one mask per frame for
+// CALIBRATION_TOTAL_FRAMES frames, NULL taps each key in turn so title screens waiting on FX0A
+// get passed. Returns -1 if the ROM faults during warm-up or never waits or draws at all.
+int calibrateSpeed(const chip8_t *loaded, const uint16_t *keys, calibration_t *result);
+
+#endif // CALIBRATE_H
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Hardware Constants
 // 4Kb memory (0x000-0xFFF , 0x000-0x1FF is reserved for the interpreter, 0x200-0xFFF is for programs)
@@ -23,49 +24,128 @@
 #define CHIP8_START_ADDRESS 0x200 
 #define CHIP8_FONTSET_START_ADDRESS 0x50
 #define CHIP8_FONTSET_SIZE 80
+// Memory is tracked in 16 pages for dirty-state restores, 256 bytes each with 4 KB of memory
+#define CHIP8_DIRTY_PAGES 16
 
+// Why a machine stopped, faults replace the old "print and exit(1)"
+typedef enum {
+    CHIP8_FAULT_NONE = 0,
+    CHIP8_FAULT_UNKNOWN_OPCODE,
+    CHIP8_FAULT_STACK_OVERFLOW,   // 2NNN with all 16 stack levels in use
+    CHIP8_FAULT_STACK_UNDERFLOW,  // 00EE with an empty stack
+    CHIP8_FAULT_MEMORY_RANGE      // Raised by checkers (fuzzer, debugger), the core itself doesn't check I
+} chip8Fault_t;
 
+// Behaviours that differ between interpreters, a ROM only runs right with the ones it was written for.
+// All clear is this emulator's long-standing behaviour, a set bit picks the alternative.
+typedef enum {
+    CHIP8_QUIRK_SHIFT_VY     = 1 << 0, // 8XY6/8XYE shift VY into VX instead of shifting VX in place
+    CHIP8_QUIRK_LOAD_STORE_I = 1 << 1, // FX55/FX65 leave I at I + X + 1 instead of unchanged
+    CHIP8_QUIRK_VF_RESET     = 1 << 2, // 8XY1/8XY2/8XY3 clear VF
+    CHIP8_QUIRK_CLIP         = 1 << 3, // Sprites are cut off at the screen edges instead of wrapping around
+    CHIP8_QUIRK_JUMP_VX      = 1 << 4  // BXNN jumps to XNN + VX instead of NNN + V0
+} chip8Quirk_t;
+#define CHIP8_QUIRK_COUNT 5
+#define CHIP8_QUIRK_COMBINATIONS (1 << CHIP8_QUIRK_COUNT)
+
+// What the well known interpreters do
+#define CHIP8_QUIRKS_VIP (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I | CHIP8_QUIRK_VF_RESET | CHIP8_QUIRK_CLIP)
+#define CHIP8_QUIRKS_SCHIP (CHIP8_QUIRK_CLIP | CHIP8_QUIRK_JUMP_VX)
+#define CHIP8_QUIRKS_XOCHIP (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I)
+
+
+/* Machine layout, 128 bytes in two cache lines:
+     line 1, the hot block: registers, stack, timers and the rest of what instructions read and write
+     line 2: where memory and the display live, dirty tracking, keypad
+   Memory and the display are separate regions from the memory arena (see arena.h), so a chip8_t
+   stays small: runners can keep many machines packed in an array, and copying the registers is a
+   64-byte copy (copyMachineRegisters()) independent of the big regions.
+*/
 typedef struct {
     // CPU Registers
-    uint8_t V[CHIP8_REGISTER_COUNT]; 
+    _Alignas(64) uint8_t V[CHIP8_REGISTER_COUNT];
     uint16_t I; // Index register
     uint16_t PC; // Program counter
-
-    uint8_t memory[CHIP8_MEMORY_SIZE]; // Memory
-
-    
     uint16_t stack[CHIP8_STACK_SIZE]; // Stack
     uint8_t SP; // Stack pointer
-    
+
     // Timers
     uint8_t delay_timer;        // Delay timer (decrements at 60Hz)
-    uint8_t sound_timer;        // Sound timer (decrements at 60Hz, sounds a beep when it reaches 0)
+    uint8_t sound_timer;        // Sound timer (decrements at 60Hz, the buzzer sounds while it is above 0)
 
-    // Display
-    uint8_t display[CHIP8_DISPLAY_SIZE]; 
-
-    // Keypad State 
-    bool keypad[CHIP8_KEYPAD_SIZE];         // (false = not pressed, true = pressed)
+    uint8_t fault;             // chip8Fault_t, CHIP8_FAULT_NONE while the machine is healthy
 
     // Current opcode
     uint16_t opcode;
 
     // State Flags
     bool drawFlag;             // Set to true when the display needs to be updated
+
+    // Random number generator state for CXNN, kept per machine so a cloned machine produces the same numbers
+    uint32_t rngState;
+
+    // ---- End of the hot block ----
+
+    uint8_t *memory;     // Guest memory arena, see arena.h. Always index it with an address & memoryMask
+    uint8_t *display;    // CHIP8_DISPLAY_SIZE bytes, one per pixel, allocated with the memory arena
+    uint16_t memoryMask; // Size of memory - 1
+
+    // Dirty tracking, lets restoreDirtyState() undo a run without copying all of memory and display
+    uint16_t dirtyPages;       // Bit N = memory page N (1/16th of memory) was written
+    uint32_t dirtyRows;        // Bit N = display row N changed
+
+    int32_t cycleBalance;      // VIP timing only: machine cycles carried into the next frame, see viptiming.h
+
+    // Keypad State
+    bool keypad[CHIP8_KEYPAD_SIZE];         // (false = not pressed, true = pressed)
+
+    uint8_t quirks;            // chip8Quirk_t bits, cleared by initializeCPU()
 } chip8_t;
 
+// Size of the hot block, everything before the region pointers
+#define CHIP8_HOT_SIZE offsetof(chip8_t, memory)
+_Static_assert(offsetof(chip8_t, memory) <= 64, "chip8_t hot block must fit one cache line");
+_Static_assert(sizeof(chip8_t) <= 128, "chip8_t must fit two cache lines");
+
+// Memory and pixel accessors for code outside the core, they mask addresses and keep dirty tracking right
+static inline uint8_t readMemory(const chip8_t *chip8, uint16_t address) {
+    return chip8->memory[address & chip8->memoryMask];
+}
+void writeMemory(chip8_t *chip8, uint16_t address, uint8_t value);
+static inline uint8_t getPixel(const chip8_t *chip8, uint8_t x, uint8_t y) {
+    return chip8->display[(y % CHIP8_DISPLAY_HEIGHT) * CHIP8_DISPLAY_WIDTH + (x % CHIP8_DISPLAY_WIDTH)];
+}
+
 // Function Prototypes
 
-void initializeCPU(chip8_t *chip8);
-void executeCycle(chip8_t *chip8); //(fetch, decode, execute)
+void initializeCPU(chip8_t *chip8); // The machine needs its memory arena first, see allocateMemoryArena()
+void cloneMachine(chip8_t *dst, const chip8_t *src); // Full copy of the machine into dst's own arena, both arenas must be the same size
+void copyMachineRegisters(chip8_t *dst, const chip8_t *src); // Everything but memory, display and dirty bits
+void restoreDirtyState(chip8_t *chip8, const chip8_t *snapshot); // Reset to snapshot, copying only dirty pages and rows
+void markMemoryDirty(chip8_t *chip8, uint16_t address, uint16_t length);
+void raiseFault(chip8_t *chip8, chip8Fault_t fault);
+const char *faultName(chip8Fault_t fault);
+const char *quirkName(chip8Quirk_t quirk);
+// Quirk bits as names separated by commas, "none" if there are none. Returns the length like snprintf()
+int formatQuirks(char *buffer, size_t size, uint8_t quirks);
+// Comma separated quirk names, or one of the profiles vip, schip, xochip, none. Returns -1 if something is unknown
+int parseQuirks(const char *text);
+int executeCycle(chip8_t *chip8); //(fetch, decode, execute), returns number of instructions retired
+int stepInstruction(chip8_t *chip8); // Like executeCycle() but never fuses, always retires exactly one instruction
+// executeCycle() until exactly count instructions retired (fewer if it faults), fused or not. Returns instructions retired
+int executeCycles(chip8_t *chip8, int count);
+// One 60 Hz frame at a fixed rate: instructionsPerFrame instructions, then the timers tick once. Returns instructions retired
+int runFrame(chip8_t *chip8, int instructionsPerFrame);
+// Range of memory an opcode reads or writes through I, returns false if it doesn't touch memory
+bool getMemoryAccess(const chip8_t *chip8, uint16_t opcode, uint16_t *address, uint8_t *length, bool *isWrite);
+void setFusionEnabled(bool enabled); // Superinstruction fusion, on by default
+bool isFusionEnabled(void);
+void logFusionStats(void);
 uint16_t fetchOpcode(chip8_t *chip8);
 void decodeAndExecute(chip8_t *chip8, uint16_t opcode);
 void clearDisplay(chip8_t *chip8);
 bool drawSprite(chip8_t *chip8, uint8_t x, uint8_t y, const uint8_t *sprite, uint8_t height);
-bool isKeyPressed(chip8_t *chip8, uint8_t key);
-void clearDisplay(chip8_t *chip8); 
-bool isKeyPressed(chip8_t *chip8, uint8_t key);
-uint8_t waitForKeyPress(chip8_t *chip8);
+void setKeypadState(chip8_t *chip8, uint16_t keys); // Bit N set = key N pressed
 
 /* The function drawSprite XORs each bit of the sprite with the pixel on the display it corresponds to.
     If a pixel is turned off as a result of the XOR operation, the function returns true (e.g. collision), otherwise it returns false.
@@ -0,0 +1,44 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include "chip8.h"
+#include <stdbool.h>
+
+/*
+ Debugger
+
+ Breakpoints and read/write watchpoints are kept as one bit per address of the 4 KB address space,
+ so checking an instruction costs a single bit test on fetch and one per byte it loads or stores.
+ While nothing is set (and no halt is pending) the emulator runs its normal loop with no checks at all,
+ see isDebuggerArmed().
+
+ The same controls are served over a local Unix-domain socket speaking the GDB remote serial protocol
+ (packets $...#xx, supports ? g G p P m M c s Z0-Z4 z0-z4 D k and Ctrl-C). The register block for
+ g/G is, in order: V0-VF (1 byte each), I (2 bytes, little endian), PC (2 bytes, little endian),
+ SP, delay timer, sound timer (1 byte each).
+*/
+
+typedef enum {
+    WATCH_WRITE = 1,
+    WATCH_READ = 2,
+    WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+} watchType_t;
+
+int startDebugServer(chip8_t *chip8, const char *socketPath);
+void stopDebugServer(); // Clears everything and lets a halted emulator go, call before stopEmulator()
+
+void setBreakpoint(uint16_t address, bool enabled);
+void setWatchpoint(uint16_t address, uint16_t length, watchType_t type, bool enabled);
+void clearAllBreakpoints();
+
+void debugHalt();     // Stop before the next instruction
+void debugContinue(); // Resume a halted machine
+void debugStep();     // Run one instruction, then halt again
+bool isDebugHalted();
+
+// True when the emulator has to use debugRunInstructions() instead of its check-free loop
+bool isDebuggerArmed();
+// Checked interpreter loop, same contract as the emulator's runInstructions()
+uint64_t debugRunInstructions(chip8_t *chip8, uint64_t count);
+
+#endif // DEBUGGER_H
@@ -0,0 +1,36 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include "chip8.h"
+#include "framebuffer.h"
+#include "video.h"
+#include <stdbool.h>
+
+// Runs the CHIP-8 core on its own thread and publishes finished frames into a triple buffer.
+// The main thread only handles input and presents frames, so a slow present never stalls emulation.
+
+int startEmulator(chip8_t *chip8, framebuffer_t *frames);
+void stopEmulator();
+bool isEmulatorRunning();
+void setRunAhead(int frames); // Show the machine state this many frames ahead (0 = off), set before startEmulator()
+void setVipTiming(bool enabled); // Schedule the machine like a COSMAC VIP (see viptiming.h) instead of a fixed rate, set before startEmulator()
+// Run whole 60 Hz frames of this many instructions with 60 Hz timers (see runFrame()) instead of the default rate,
+// 0 = default. VIP timing takes precedence. Set before startEmulator()
+void setInstructionsPerFrame(int instructionsPerFrame);
+// Turbo: run as fast as the host can, muted, presenting only every Nth frame (N adapts so presents keep up).
+// Can be switched at any time from any thread.
+void setTurbo(bool enabled);
+void toggleTurbo();
+bool isTurbo();
+// Playlist: the emulation thread swaps `next` in at the start of its next frame, with its own instructions per frame
+// (0 = the default rate). The machine it replaced comes back from takeRetiredMachine() once the swap has happened.
+void swapMachine(chip8_t *next, int instructionsPerFrame);
+chip8_t *takeRetiredMachine(); // NULL until the next swap has happened
+void setStopOnFault(bool stop); // true (default): a fault ends the emulation thread, false: the thread waits for a swap. Set before startEmulator()
+bool hasMachineFaulted(); // The current machine faulted, cleared by a swap
+void setVideoSink(videoSink_t *sink); // Also write every emulated frame to a video file (NULL = off), set before startEmulator()
+
+// Upper limit for setRunAhead(), speculation costs this many extra frames of emulation per frame
+#define MAX_RUN_AHEAD_FRAMES 8
+
+#endif // EMULATOR_H
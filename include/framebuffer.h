@@ -0,0 +1,23 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "chip8.h"
+#include <stdatomic.h>
+
+/*
+ Lock-free triple buffer for handing finished frames from the emulation thread to the renderer.
+ The emulator always has a buffer to write into and the renderer always has one to read from,
+ so neither side ever waits on the other. The third (middle) buffer holds the latest published frame.
+*/
+typedef struct {
+    uint8_t buffers[3][CHIP8_DISPLAY_SIZE];
+    atomic_int middle;  // Index of the middle buffer, plus FRAMEBUFFER_FRESH if it hasn't been read yet
+    int writeIndex;     // Only touched by the producer
+    int readIndex;      // Only touched by the consumer
+} framebuffer_t;
+
+void initializeFramebuffer(framebuffer_t *frames);
+void publishFrame(framebuffer_t *frames, const uint8_t *display); // Producer: copy display and make it the latest frame
+const uint8_t *acquireFrame(framebuffer_t *frames); // Consumer: latest frame if a new one was published, NULL otherwise
+
+#endif // FRAMEBUFFER_H
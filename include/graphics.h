@@ -2,9 +2,31 @@
 #define GRAPHICS_H
 
 #include "chip8.h"
+#include "video.h"
+#include <stdbool.h>
 
+// Present timing statistics, intervals are between consecutive presents in milliseconds
+typedef struct {
+	uint64_t presents;        // Frames presented so far
+	uint64_t missedRefreshes; // Presents that came more than 1.5 refresh intervals after the previous one
+	double minIntervalMs;
+	double maxIntervalMs;
+	double avgIntervalMs;
+	int refreshRate;          // Display refresh rate in Hz
+	bool vsync;               // true if the renderer paces presents to the display
+} frameStats_t;
+
+// Present through the window surface with SIMD integer scaling instead of a GPU renderer, set before
+// initializeGraphics(). It's also used automatically when no accelerated renderer is available.
+void setSoftwareRendering(bool enabled, scaleEffect_t effect);
 int initializeGraphics();
 void destroyGraphics();
 void renderGraphics(chip8_t *chip8);
+void renderFrame(const uint8_t *display); // Convert and present one CHIP8_DISPLAY_SIZE frame
+void waitForNextRefresh(); // Sleep until the next display refresh when there is nothing new to present
+void setAntiFlicker(bool enabled); // Present the OR of the last two frames
+void getFrameStats(frameStats_t *stats);
+void setMetricsOverlay(bool enabled); // On-screen speed/present/audio counters, see metrics.h
+void toggleMetricsOverlay();
 
 #endif // GRAPHICS_H
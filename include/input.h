@@ -6,7 +6,9 @@
 
 // Prototype input handling function
 
-
-void handleInput(chip8_t *chip8, bool *running);
+// Drains the SDL event queue, call once per frame from the main thread.
+// Key state goes into an atomic bitmask (bit N = key N) that the emulation thread picks up.
+void handleInput(bool *running);
+uint16_t getKeypadState();
 
 #endif // INPUT_H
@@ -0,0 +1,19 @@
+#ifndef KEYSCRIPT_H
+#define KEYSCRIPT_H
+
+#include <stdint.h>
+
+/* Scripted keypad input for headless runs.
+   A key script is a text file with one hex key mask per frame (bit N = key N held),
+   the same format chip8_fuzz writes next to its findings.
+*/
+
+// Returns `frames` masks (free() them), frames past the end of the script have no keys held.
+// A NULL path gives a script with no input at all. Returns NULL if the file can't be read.
+uint16_t *loadKeyScript(const char *path, int frames);
+
+// Input for headless runs that have no script: each key is tapped in turn, so title screens waiting
+// on FX0A get passed and games see some input. Returns the key mask for one frame.
+uint16_t keyTapMask(int frame);
+
+#endif // KEYSCRIPT_H
@@ -0,0 +1,16 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+// Input-to-photon latency: time from a key event to the first presented frame that changed after it.
+// Everything here runs on the main (input + render) thread.
+
+#define LATENCY_BUCKET_COUNT 10 // Power of two buckets in ms: <1, <2, <4, ... <256, 256+
+
+void recordKeyEvent(uint64_t eventCounter); // eventCounter is in SDL_GetPerformanceCounter() units
+void recordPresentedFrame(const uint8_t *display);
+void getLatencyHistogram(uint64_t buckets[LATENCY_BUCKET_COUNT]);
+void logLatencyHistogram();
+
+#endif // LATENCY_H
@@ -2,9 +2,12 @@
 #define MEMORY_H
 
 #include "chip8.h"
+#include <stddef.h>
 
 int initializeMemory(chip8_t *chip8);
 int loadROM(chip8_t *chip8, const char *romPath);
+int readROMFile(const char *romPath, uint8_t **data, size_t *size); // Whole file into a malloc'd buffer, free() it
+int loadROMData(chip8_t *chip8, const uint8_t *data, size_t size); // Copies a ROM image to 0x200, fails if it doesn't fit
 
 
 #endif //MEMORY_H
@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Live performance counters for units in the field. Every counter is a relaxed atomic, so the
+// emulation thread, the main thread, the audio callback and the logger can all bump them without
+// locks, and they're cheap enough to stay on all the time.
+//
+// startMetricsDump() writes them as JSON once per second, either to a file (rewritten in place,
+// readers never see half a dump) or, for a path starting with "unix:", to every client that
+// connects to that Unix socket. Rates and percentiles in the dump cover the last second only, so a
+// unit falling behind shows up right away instead of being averaged out since startup.
+
+// Histograms are in microseconds, 8 linear buckets per power of two (within 12.5%) up to about 4 s
+#define METRICS_BUCKET_COUNT 160
+#define METRICS_DUMP_INTERVAL_MS 1000
+
+typedef struct {
+    uint64_t timeNs;              // metricsClock() when the snapshot was taken
+    uint64_t instructions;        // Retired by the real machine (never the run-ahead clone)
+    uint64_t framesEmulated;      // 60 Hz frames the emulation thread went through
+    uint64_t framesPresented;
+    uint64_t frameWork[METRICS_BUCKET_COUNT];      // Emulation thread busy time per frame
+    uint64_t presentInterval[METRICS_BUCKET_COUNT]; // Time between presents
+    uint64_t renderNs;            // Time in renderFrame() before the present, summed
+    uint64_t renderMaxNs;
+    uint64_t oversleepNs;         // Time SDL_Delay() slept past what was asked, summed
+    uint64_t oversleepMaxNs;
+    uint64_t lateWakes;           // Sleeps that overslept by more than 2 ms
+    uint64_t droppedNs;           // Emulated time given up on because the emulator was too far behind
+    uint64_t audioCallbacks;
+    uint64_t audioUnderruns;      // Callbacks that came more than 1.5 buffers after the previous one
+    uint64_t logMessages;
+    uint64_t logBlockedNs;        // Time callers spent blocked in the logger, summed
+    uint64_t logBlockedMaxNs;
+} metrics_t;
+
+uint64_t metricsClock(); // Monotonic nanoseconds
+
+void countInstructions(uint64_t count);
+void countEmulatedFrame(uint64_t workNs);
+void countDroppedTime(uint64_t ns);
+void countOversleep(uint64_t requestedNs, uint64_t sleptNs);
+void countPresent(uint64_t intervalNs, uint64_t renderNs); // intervalNs is 0 for the first present
+void countAudioCallback(uint64_t gapNs, uint64_t bufferNs);
+void countLogMessage(uint64_t blockedNs);
+
+void getMetrics(metrics_t *metrics);
+// Upper bound of the bucket holding the given percentile (0-100) of what was recorded between two snapshots
+uint64_t metricsPercentileUs(const uint64_t *now, const uint64_t *before, double percentile);
+// JSON for the interval between two snapshots (before may be all zeroes), returns its length
+int formatMetricsJSON(char *buffer, size_t size, const metrics_t *now, const metrics_t *before);
+
+int startMetricsDump(const char *path); // A file path, or unix:<socket path>
+void stopMetricsDump();
+
+#endif // METRICS_H
@@ -0,0 +1,43 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include "chip8.h"
+#include <stdbool.h>
+
+/* Playlist (attract) mode: cycles through ROMs without restarting anything.
+
+   A playlist is a text file, one ROM per line with how long it plays and an optional snapshot
+   to start it from, '#' starts a comment:
+
+     roms/PONG.ch8    60   snaps/pong.snap
+     roms/BRIX.ch8    90
+
+   A background thread keeps the next PLAYLIST_PRELOAD games ready: ROM read and loaded, settings
+   from the ROM info file applied (see rominfo.h), snapshot restored, then PLAYLIST_CHECK_FRAMES
+   run on a scratch copy to make sure it doesn't fault right away. Entries that fail any of that
+   are skipped. When a game's time is up (or it faults), the ready machine is handed to the
+   emulation thread, which swaps it in between two frames (see swapMachine()). The old game's
+   last frame stays on screen until the new game's first one replaces it.
+*/
+
+#define PLAYLIST_MAX_ENTRIES 256
+#define PLAYLIST_PRELOAD 2          // Games kept ready behind the one playing
+#define PLAYLIST_DEFAULT_SECONDS 60
+#define PLAYLIST_CHECK_FRAMES 60
+
+typedef struct {
+    const char *romInfoPath;
+    int instructionsPerFrame;       // 0 = the ROM's calibrated rate, or the default rate if it has none
+    bool useStoredRate;             // false = ignore calibrated rates
+    bool calibrate;                 // Calibrate ROMs that have no rate yet, in the background
+    int quirks;                     // -1 = the ROM's detected quirks
+} playlistOptions_t;
+
+int loadPlaylist(const char *path);
+// Starts the preloader and waits until the first game is ready. *first and its rate go to startEmulator()
+int startPlaylist(const playlistOptions_t *options, chip8_t **first, int *instructionsPerFrame);
+// Called once per refresh from the main thread, switches games when it's time
+void updatePlaylist();
+void stopPlaylist(); // After stopEmulator(), frees every machine
+
+#endif // PLAYLIST_H
@@ -0,0 +1,34 @@
+#ifndef ROMINFO_H
+#define ROMINFO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Per-ROM settings, kept in one text file keyed by a hash of the ROM image, so a renamed or copied
+   ROM is still recognised. One line per ROM:
+
+     <16 hex digit hash> ipf=<n> quirks=<names> # <file name>
+
+   Keys this build doesn't know are skipped when reading. The name after '#' is only for people
+   reading the file.
+*/
+
+#define ROMINFO_DEFAULT_PATH "rominfo.txt"
+#define ROMINFO_NAME_LENGTH 64
+
+typedef struct {
+    uint64_t hash;            // hashROM() of the image
+    int instructionsPerFrame; // 0 = not calibrated, see calibrate.h
+    bool quirksKnown;         // quirks were detected (see chip8_quirks), "none" is a result too
+    uint8_t quirks;           // chip8Quirk_t bits
+    char name[ROMINFO_NAME_LENGTH];
+} romInfo_t;
+
+uint64_t hashROM(const uint8_t *data, size_t size); // 64-bit FNV-1a
+// Looks the ROM up, false if it isn't in the file or there is no file yet
+bool findRomInfo(const char *path, uint64_t hash, romInfo_t *info);
+// Replaces the ROM's line, or appends one. The file is rewritten through a temporary, readers never see half of it
+int saveRomInfo(const char *path, const romInfo_t *info);
+
+#endif // ROMINFO_H
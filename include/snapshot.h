@@ -0,0 +1,22 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "chip8.h"
+
+/*
+ Machine snapshot file
+
+   header   "C8SNAP01" | u32 memory size
+   cpu      V0-VF | u16 I | u16 PC | 16 x u16 stack | SP | delay timer | sound timer
+            | u16 keypad mask | u32 rng state | fault | quirks | i32 VIP cycle balance
+   display  one byte per pixel, CHIP8_DISPLAY_SIZE bytes
+   memory   the whole address space
+
+ All integers are little endian.
+*/
+
+int saveSnapshot(const chip8_t *chip8, const char *path);
+// The machine needs an arena of the same size as the snapshot's memory
+int loadSnapshot(chip8_t *chip8, const char *path);
+
+#endif // SNAPSHOT_H
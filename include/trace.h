@@ -0,0 +1,17 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "chip8.h"
+#include <stdbool.h>
+
+// Instruction trace recorder. Each thread that runs traceCycle() fills its own ring buffer,
+// full buffers are compressed and appended to the trace file as one block (see tracefile.h).
+// Superinstruction fusion is switched off while tracing so every instruction gets a record.
+
+int startTrace(const char *path);
+int traceCycle(chip8_t *chip8); // executeCycle() plus a trace record, returns instructions retired
+void flushTrace();  // Write out the calling thread's buffer, call before a tracing thread exits
+void stopTrace();   // Once no other thread traces any more, frees every thread's buffer
+bool isTracing();
+
+#endif // TRACE_H
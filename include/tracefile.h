@@ -0,0 +1,70 @@
+#ifndef TRACEFILE_H
+#define TRACEFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ Binary instruction trace format
+
+ A trace file is a header, a sequence of independently decodable blocks and an index at the end:
+
+   header  "C8TRACE1"
+   block   "BLK1" | u32 record count | u64 index of first record | u32 payload size | payload
+   ...
+   index   u64 first record index, u64 file offset    (one pair per block)
+   footer  u64 block count | u64 index offset | "C8TRIDX1"
+
+ All integers are little endian. The index makes the file seekable: a reader can jump straight to
+ the block holding instruction N without decoding anything before it.
+
+ Payloads are compressed with a compact per-record encoding (see tracefile.c): the PC is omitted when
+ it is the predicted one (the next instruction, or the target of a 1NNN/2NNN, or the return address
+ of a 00EE matching a call in the same block), the opcode is omitted when it matches the last one
+ seen at that PC in the block, and only the registers that changed are stored. Loops, which make up
+ most of a trace, shrink to one or two bytes per instruction.
+*/
+
+#define TRACE_BLOCK_RECORDS 65536
+
+typedef struct {
+    uint64_t index;      // Instruction number since the trace started
+    uint16_t pc;         // Address the instruction was fetched from
+    uint16_t opcode;
+    uint16_t regMask;    // Bit N set = VN was changed by this instruction
+    uint16_t I;          // I after the instruction, meaningful if iChanged
+    uint16_t memAddr;    // First byte written to memory, meaningful if memLength > 0
+    uint8_t memLength;   // Number of bytes written (FX33 = 3, FX55 = X + 1), 0 if none
+    uint8_t iChanged;
+    uint8_t V[16];       // Register values after the instruction, only those in regMask are meaningful
+} traceRecord_t;
+
+typedef struct {
+    FILE *file;
+    uint8_t *payload;        // Encode buffer, big enough for a worst case block
+    uint64_t *blockFirst;    // First record index of every block written so far
+    uint64_t *blockOffset;   // File offset of every block written so far
+    uint64_t blockCount;
+    uint64_t blockCapacity;
+    uint64_t recordCount;
+} traceWriter_t;
+
+typedef struct {
+    FILE *file;
+    uint64_t *blockFirst;
+    uint64_t *blockOffset;
+    uint64_t blockCount;
+    uint64_t recordCount;
+} traceReader_t;
+
+int openTraceWriter(traceWriter_t *writer, const char *path);
+int writeTraceBlock(traceWriter_t *writer, const traceRecord_t *records, uint32_t count); // Records get consecutive indices
+int closeTraceWriter(traceWriter_t *writer); // Writes the index, the trace is unreadable without it
+
+int openTraceReader(traceReader_t *reader, const char *path);
+uint64_t findTraceBlock(const traceReader_t *reader, uint64_t index); // Block holding record `index`
+// records must hold TRACE_BLOCK_RECORDS entries, returns the number decoded or -1 on a corrupt block
+int readTraceBlock(traceReader_t *reader, uint64_t block, traceRecord_t *records);
+void closeTraceReader(traceReader_t *reader);
+
+#endif // TRACEFILE_H
@@ -0,0 +1,62 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "chip8.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Headless video output, no SDL involved.
+   Frames go out at a fixed 60 fps, one frame per emulated frame:
+     VIDEO_Y4M   YUV4MPEG2, 4:2:0, 64x32, lit pixels are white, readable by ffmpeg/mpv directly
+     VIDEO_RGBA  raw 64x32 frames, 4 bytes per pixel in R G B A order
+   A frame with the same hash as the previous one is written again from the last conversion.
+*/
+
+typedef enum {
+    VIDEO_Y4M,
+    VIDEO_RGBA
+} videoFormat_t;
+
+typedef struct {
+    FILE *file;
+    bool ownsFile;         // false for stdout
+    videoFormat_t format;
+    uint8_t *frame;        // Last converted frame, written again for repeats
+    size_t frameSize;
+    uint64_t lastHash;
+    bool haveFrame;
+    uint64_t frames;       // Frames written
+    uint64_t repeats;      // Of which were repeats of the previous frame
+} videoSink_t;
+
+// path "-" writes to stdout, so the output can be piped straight into an encoder
+int openVideoSink(videoSink_t *sink, const char *path, videoFormat_t format);
+int writeVideoFrame(videoSink_t *sink, const uint8_t *display);
+void closeVideoSink(videoSink_t *sink);
+
+// 1 byte per pixel display -> 0xAARRGGBB pixels (white or opaque black), SIMD where available
+void convertFrameToRGBA(const uint8_t *display, uint32_t *pixels);
+
+// Integer upscaling for software presentation
+typedef enum {
+    SCALE_PLAIN,
+    SCALE_SCANLINES, // Last line of every pixel row is dimmed
+    SCALE_GRID       // Last line and last column of every pixel are dimmed
+} scaleEffect_t;
+
+// Colours for scaleFrameRows(), already in the target surface's pixel format
+typedef struct {
+    uint32_t off, on;
+    uint32_t dimOff, dimOn; // Used by the effects
+} scalePalette_t;
+
+// Expands display rows [firstRow, firstRow + rowCount) into 32-bit pixels at scale x scale per display
+// pixel. pixels points at the top left of display row 0, pitch is in pixels. SSE2, or AVX2 when the CPU has it.
+void scaleFrameRows(const uint8_t *display, int firstRow, int rowCount, uint32_t *pixels, int pitch,
+                    int scale, const scalePalette_t *palette, scaleEffect_t effect);
+
+// 64-bit hash of a CHIP8_DISPLAY_SIZE display
+uint64_t hashFrame(const uint8_t *display);
+
+#endif // VIDEO_H
@@ -0,0 +1,27 @@
+#ifndef VIPTIMING_H
+#define VIPTIMING_H
+
+#include "chip8.h"
+
+/* COSMAC VIP timing, an alternative scheduler for the core.
+
+   The default scheduler runs a fixed number of instructions per second and ticks the timers after
+   every instruction. This one runs the machine one 60 Hz frame at a time the way the VIP did:
+     - every instruction costs the machine cycles the original interpreter spends on it
+     - each frame has a budget of the cycles left after the display interrupt and DMA
+     - DXYN waits for the next vertical blank, so it ends the frame
+     - the timers tick once per frame, from the 60 Hz interrupt
+   Cycles left over (or overrun) carry into the next frame through chip8->cycleBalance.
+   Opcode semantics are untouched, only when and how many instructions run changes.
+*/
+
+// 1802 at 1.7609 MHz, 8 clocks per machine cycle, about 4.54 us per cycle
+#define VIP_CYCLES_PER_FRAME 3668
+// 128 lines of 8 DMA bytes plus the interrupt routine, taken out of every frame
+#define VIP_DISPLAY_CYCLES 1100
+#define VIP_INTERPRETER_CYCLES_PER_FRAME (VIP_CYCLES_PER_FRAME - VIP_DISPLAY_CYCLES)
+
+int vipInstructionCycles(uint16_t opcode, bool skipped); // Machine cycles for one instruction, skipped = it skipped the next one
+int runVipFrame(chip8_t *chip8); // Runs one 60 Hz frame, returns the number of instructions retired
+
+#endif // VIPTIMING_H
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE // memfd_create
+#include "arena.h"
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static size_t roundToPages(size_t length) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) {
+        page = 4096;
+    }
+    return (length + page - 1) / page * page;
+}
+
+// Memory and padding, then the display on its own pages so memory images never map over it
+static size_t memoryLength(uint32_t size) {
+    return roundToPages((size_t)size + CHIP8_ARENA_PADDING);
+}
+
+static size_t arenaLength(uint32_t size) {
+    return memoryLength(size) + roundToPages(CHIP8_DISPLAY_SIZE);
+}
+
+int allocateMemoryArena(chip8_t *chip8, uint32_t size) {
+    if (size != CHIP8_MEMORY_SIZE && size != CHIP8_ARENA_XOCHIP_SIZE) {
+        logError("Unsupported memory size: %u bytes", size);
+        return -1;
+    }
+
+    // Anonymous mappings start zeroed
+    void *arena = mmap(NULL, arenaLength(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        logError("Failed to map %u bytes of guest memory: %s", size, strerror(errno));
+        return -1;
+    }
+    chip8->memory = arena;
+    chip8->display = (uint8_t *)arena + memoryLength(size);
+    chip8->memoryMask = (uint16_t)(size - 1);
+    return 0;
+}
+
+void freeMemoryArena(chip8_t *chip8) {
+    if (chip8->memory) {
+        munmap(chip8->memory, arenaLength(chip8->memoryMask + 1u));
+        chip8->memory = NULL;
+        chip8->display = NULL;
+    }
+}
+
+static int createImageFile(void) {
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("chip8_image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    // No memfd, an unlinked temporary file works the same way
+    FILE *file = tmpfile();
+    if (!file) {
+        return -1;
+    }
+    int copy = dup(fileno(file)); // Keeps the file alive after the FILE is closed
+    fclose(file);
+    return copy;
+}
+
+int createMemoryImage(memoryImage_t *image, const chip8_t *chip8) {
+    uint32_t size = chip8->memoryMask + 1u;
+    int fd = createImageFile();
+    if (fd < 0) {
+        logError("Failed to create memory image: %s", strerror(errno));
+        return -1;
+    }
+
+    // Only the address space goes into the image, the padding stays private to each machine
+    uint32_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, chip8->memory + written, size - written);
+        if (n <= 0) {
+            logError("Failed to write memory image: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+#ifdef F_ADD_SEALS
+    // Nobody can change the image behind the machines mapping it
+    fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+    image->fd = fd;
+    image->size = size;
+    return 0;
+}
+
+int mapMemoryImage(chip8_t *chip8, const memoryImage_t *image) {
+    if (!chip8->memory || image->size != chip8->memoryMask + 1u) {
+        logError("Memory image size doesn't match the machine");
+        return -1;
+    }
+
+    // Mapped over the start of the arena, the padding after it stays as it was
+    void *mapped = mmap(chip8->memory, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0);
+    if (mapped == MAP_FAILED) {
+        logError("Failed to map memory image: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void destroyMemoryImage(memoryImage_t *image) {
+    if (image->fd >= 0) {
+        close(image->fd);
+        image->fd = -1;
+    }
+}
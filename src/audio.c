@@ -2,6 +2,7 @@
 
 #include "audio.h"
 #include "logger.h"
+#include "metrics.h"
 #include <SDL2/SDL.h>
 #include <stdbool.h>
 #include <math.h>
@@ -23,12 +24,19 @@
 static SDL_AudioDeviceID audioDevice = 0;
 static bool isPlaying = false;
 static float phase = 0.0f; // Phase accumulator
+static uint64_t lastCallback = 0; // metricsClock() of the previous callback, 0 after the device was paused
 			   
 void audioCallback(void *userdata, uint8_t *stream, int len) {
 	(void)userdata;
 	int16_t *buffer = (int16_t *)stream;
 	int samples = len / sizeof(int16_t);
 
+	uint64_t now = metricsClock();
+	if (lastCallback != 0) {
+		countAudioCallback(now - lastCallback, (uint64_t)samples * 1000000000ull / SAMPLE_RATE);
+	}
+	lastCallback = now;
+
 	double phaseIncrement = (2.0 * M_PI * FREQUENCY) / SAMPLE_RATE;
 	for (int i = 0; i < samples; i++) {
 		//Generate a square wave using the sign of sine function
@@ -90,8 +98,9 @@ void stopSound() {
 		return;
 	}
 	if (isPlaying) {
-		SDL_PauseAudioDevice(audioDevice, 1);
+		SDL_PauseAudioDevice(audioDevice, 1); // Also waits for a running callback, lastCallback is safe to touch after it
 		isPlaying = false;
+		lastCallback = 0; // The gap while paused isn't an underrun
 		logDebug("Sound stopped!");
 	}
 }
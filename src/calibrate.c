@@ -0,0 +1,134 @@
+#include "calibrate.h"
+#include "arena.h"
+#include "timer.h"
+#include "viptiming.h"
+#include "keyscript.h"
+#include "logger.h"
+
+// Candidate rates, lowest first. 7-8 is what COSMAC VIP games expect, the top end is for SCHIP-era games.
+static const int candidates[] = {
+    7, 8, 9, 10, 11, 12, 14, 16, 18, 20, 25, 30, 35, 40, 50, 60, 70, 80, 100, 120,
+    150, 200, 250, 300, 400, 500, 700, 1000, 1500, CALIBRATION_MAX_IPF
+};
+
+// Fewer waits than this at the maximum rate and the game isn't considered timer paced
+#define MIN_TIMER_WAITS 10
+
+typedef struct {
+    uint64_t waits;
+    uint64_t lateWaits;
+    uint64_t draws;
+    int frames;      // Measured frames, fewer than CALIBRATION_FRAMES if the machine faulted
+} calibrationRun_t;
+
+// One frame at a fixed rate, instruction by instruction so every FX07 and DXYN is seen.
+// A wait is a run of FX07 reads, it ends with the read that finds the timer at 0.
+static void runMeasuredFrame(chip8_t *chip8, int instructionsPerFrame, bool *inWait, calibrationRun_t *run) {
+    for (int i = 0; i < instructionsPerFrame && !chip8->fault; i++) {
+        uint16_t opcode = fetchOpcode(chip8);
+        if ((opcode & 0xF0FF) == 0xF007) {
+            if (!*inWait) {
+                run->waits++;
+                run->lateWaits += chip8->delay_timer == 0;
+            }
+            *inWait = chip8->delay_timer != 0;
+        } else if ((opcode & 0xF000) == 0xD000) {
+            run->draws++;
+        }
+        chip8->opcode = opcode;
+        decodeAndExecute(chip8, opcode);
+    }
+    if (!chip8->fault) {
+        updateTimers(chip8);
+    }
+}
+
+// Runs the ROM from its loaded state, instructionsPerFrame 0 = COSMAC VIP timing. Returns -1 if it faulted during warm-up.
+static int measure(chip8_t *chip8, const chip8_t *loaded, int instructionsPerFrame, const uint16_t *keys, calibrationRun_t *run) {
+    cloneMachine(chip8, loaded);
+    *run = (calibrationRun_t){ 0 };
+    calibrationRun_t warmup = { 0 };
+    bool inWait = false;
+
+    for (int frame = 0; frame < CALIBRATION_TOTAL_FRAMES && !chip8->fault; frame++) {
+        calibrationRun_t *counters = frame < CALIBRATION_WARMUP_FRAMES ? &warmup : run;
+        setKeypadState(chip8, keys ? keys[frame] : keyTapMask(frame));
+        if (instructionsPerFrame == 0) {
+            runVipFrame(chip8);
+            counters->draws += (chip8->opcode & 0xF000) == 0xD000; // A draw always ends a VIP frame
+        } else {
+            runMeasuredFrame(chip8, instructionsPerFrame, &inWait, counters);
+        }
+        if (!chip8->fault) {
+            counters->frames++;
+        }
+    }
+    return run->frames > 0 ? 0 : -1;
+}
+
+static double drawsPerFrame(const calibrationRun_t *run) {
+    return run->frames > 0 ? (double)run->draws / run->frames : 0.0;
+}
+
+static bool isSaturated(const calibrationRun_t *run, bool timerPaced, double referenceDraws) {
+    if (timerPaced && (run->waits == 0 || run->lateWaits * 20 > run->waits)) {
+        return false;
+    }
+    return drawsPerFrame(run) >= referenceDraws * 0.95;
+}
+
+int calibrateSpeed(const chip8_t *loaded, const uint16_t *keys, calibration_t *result) {
+    chip8_t machine;
+    if (allocateMemoryArena(&machine, loaded->memoryMask + 1u) != 0) {
+        return -1;
+    }
+
+    // As fast as it will ever run, tells whether the game waits on the timer and how often it draws when it isn't held back
+    calibrationRun_t reference;
+    if (measure(&machine, loaded, CALIBRATION_MAX_IPF, keys, &reference) != 0) {
+        logError("Calibration: the ROM faults during warm-up (%s)", faultName(machine.fault));
+        freeMemoryArena(&machine);
+        return -1;
+    }
+    bool timerPaced = reference.waits >= MIN_TIMER_WAITS && reference.lateWaits * 20 <= reference.waits;
+    double referenceDraws = drawsPerFrame(&reference);
+    if (!timerPaced) {
+        calibrationRun_t vip;
+        if (measure(&machine, loaded, 0, keys, &vip) == 0) {
+            referenceDraws = drawsPerFrame(&vip);
+        }
+    }
+    if (!timerPaced && referenceDraws == 0.0) {
+        logError("Calibration: the ROM neither waits on the delay timer nor draws, nothing to measure");
+        freeMemoryArena(&machine);
+        return -1;
+    }
+
+    // Lowest rate that keeps up, the reference itself does if nothing below it does
+    int count = (int)(sizeof(candidates) / sizeof(candidates[0]));
+    calibrationRun_t run = reference;
+    int chosen = CALIBRATION_MAX_IPF;
+    for (int i = 0; i < count - 1; i++) {
+        calibrationRun_t candidate;
+        if (measure(&machine, loaded, candidates[i], keys, &candidate) == 0 &&
+            isSaturated(&candidate, timerPaced, referenceDraws)) {
+            run = candidate;
+            chosen = candidates[i];
+            break;
+        }
+    }
+    freeMemoryArena(&machine);
+
+    *result = (calibration_t){
+        .instructionsPerFrame = chosen,
+        .timerPaced = timerPaced,
+        .waits = run.waits,
+        .lateWaits = run.lateWaits,
+        .drawsPerFrame = drawsPerFrame(&run),
+        .referenceDrawsPerFrame = referenceDraws,
+    };
+    logInfo("Calibration: %d instructions per frame (%s, %llu/%llu waits late, %.2f draws per frame vs %.2f)",
+            chosen, timerPaced ? "delay timer paced" : "draw paced", (unsigned long long)run.lateWaits,
+            (unsigned long long)run.waits, result->drawsPerFrame, referenceDraws);
+    return 0;
+}
@@ -1,14 +1,11 @@
 #include "chip8.h"
-#include "audio.h"
-#include "memory.h"
+#include "arena.h"
 #include "logger.h"
 #include "timer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <SDL2/SDL.h>
-//SDL2/SDL.h for SDL_Event in waitForKeyPress function
 
 // CHIP-8 fontset (contains hexadecimal digits 0-F, stored at memory locations 0x050 to 0x09F)
 #define CHIP8_FONTSET_START_ADDRESS 0x50 
@@ -49,6 +46,21 @@ static const uint8_t chip8_fontset[CHIP8_FONTSET_SIZE] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+// Kinds of fused superinstructions, see executeFused()
+enum {
+    FUSED_LOAD_PAIR,
+    FUSED_COUNTED_LOOP,
+    FUSED_SPRITE_DRAW,
+    FUSED_TIMER_WAIT,
+    FUSED_TABLE_LOAD,
+    FUSED_KIND_COUNT
+};
+
+static bool fusionEnabled = true;
+static uint64_t fusionCounts[FUSED_KIND_COUNT]; // How often each fused form was dispatched
+
+static int executeFused(chip8_t *chip8, uint16_t opcode, int maxRetired);
+
 void initializeCPU(chip8_t *chip8) {
     chip8->PC = CHIP8_START_ADDRESS; // Program counter starts at 0x200
     chip8->I = 0; // Reset index register
@@ -58,7 +70,7 @@ void initializeCPU(chip8_t *chip8) {
     clearDisplay(chip8);
     memset(chip8->V, 0, sizeof(chip8->V));
     memset(chip8->stack, 0, sizeof(chip8->stack));
-    memset(chip8->memory, 0, sizeof(chip8->memory));
+    memset(chip8->memory, 0, chip8->memoryMask + 1u);
     memset(chip8->keypad, 0, sizeof(chip8->keypad));
 
     // Load fontset
@@ -70,18 +82,373 @@ void initializeCPU(chip8_t *chip8) {
     chip8->sound_timer = 0;
     chip8->drawFlag = false;
 
-    srand((unsigned int)time(NULL));
+    chip8->rngState = (uint32_t)time(NULL) | 1; // xorshift state must never be 0
+    chip8->fault = CHIP8_FAULT_NONE;
+    chip8->dirtyPages = 0;
+    chip8->dirtyRows = 0;
+    chip8->cycleBalance = 0;
+    chip8->quirks = 0;
+}
+
+void cloneMachine(chip8_t *dst, const chip8_t *src) {
+    copyMachineRegisters(dst, src);
+    dst->dirtyPages = src->dirtyPages;
+    dst->dirtyRows = src->dirtyRows;
+    memcpy(dst->memory, src->memory, src->memoryMask + 1u + CHIP8_ARENA_PADDING);
+    memcpy(dst->display, src->display, CHIP8_DISPLAY_SIZE);
+}
+
+void copyMachineRegisters(chip8_t *dst, const chip8_t *src) {
+    memcpy(dst, src, CHIP8_HOT_SIZE);
+    dst->cycleBalance = src->cycleBalance;
+    memcpy(dst->keypad, src->keypad, sizeof(dst->keypad));
+    dst->quirks = src->quirks;
+}
+
+void writeMemory(chip8_t *chip8, uint16_t address, uint8_t value) {
+    chip8->memory[address & chip8->memoryMask] = value;
+    markMemoryDirty(chip8, address, 1);
+}
+
+void raiseFault(chip8_t *chip8, chip8Fault_t fault) {
+    // The PC stays on the faulting instruction, whoever runs the machine decides what happens next
+    if (chip8->fault == CHIP8_FAULT_NONE) {
+        chip8->fault = fault;
+    }
+}
+
+const char *faultName(chip8Fault_t fault) {
+    switch (fault) {
+        case CHIP8_FAULT_NONE: return "none";
+        case CHIP8_FAULT_UNKNOWN_OPCODE: return "unknown opcode";
+        case CHIP8_FAULT_STACK_OVERFLOW: return "stack overflow";
+        case CHIP8_FAULT_STACK_UNDERFLOW: return "stack underflow";
+        case CHIP8_FAULT_MEMORY_RANGE: return "memory access out of range";
+        default: return "unknown fault";
+    }
+}
+
+static const struct {
+    const char *name;
+    int quirks;
+} quirkProfiles[] = {
+    { "none", 0 },
+    { "vip", CHIP8_QUIRKS_VIP },
+    { "schip", CHIP8_QUIRKS_SCHIP },
+    { "xochip", CHIP8_QUIRKS_XOCHIP },
+};
+
+const char *quirkName(chip8Quirk_t quirk) {
+    switch (quirk) {
+        case CHIP8_QUIRK_SHIFT_VY: return "shift-vy";
+        case CHIP8_QUIRK_LOAD_STORE_I: return "load-store-i";
+        case CHIP8_QUIRK_VF_RESET: return "vf-reset";
+        case CHIP8_QUIRK_CLIP: return "clip";
+        case CHIP8_QUIRK_JUMP_VX: return "jump-vx";
+        default: return "unknown quirk";
+    }
+}
+
+int formatQuirks(char *buffer, size_t size, uint8_t quirks) {
+    if (size > 0) {
+        buffer[0] = '\0';
+    }
+    if (quirks == 0) {
+        return snprintf(buffer, size, "none");
+    }
+    size_t length = 0;
+    for (int bit = 0; bit < CHIP8_QUIRK_COUNT; bit++) {
+        if (quirks & (1 << bit)) {
+            length += snprintf(buffer + (length < size ? length : size), length < size ? size - length : 0,
+                               "%s%s", length ? "," : "", quirkName(1 << bit));
+        }
+    }
+    return (int)length;
+}
+
+int parseQuirks(const char *text) {
+    for (size_t i = 0; i < sizeof(quirkProfiles) / sizeof(quirkProfiles[0]); i++) {
+        if (strcmp(text, quirkProfiles[i].name) == 0) {
+            return quirkProfiles[i].quirks;
+        }
+    }
+    int quirks = 0;
+    while (*text) {
+        size_t length = strcspn(text, ",");
+        int bit = 0;
+        while (bit < CHIP8_QUIRK_COUNT && (strlen(quirkName(1 << bit)) != length || strncmp(text, quirkName(1 << bit), length) != 0)) {
+            bit++;
+        }
+        if (bit == CHIP8_QUIRK_COUNT) {
+            return -1;
+        }
+        quirks |= 1 << bit;
+        text += length + (text[length] == ',');
+    }
+    return quirks;
+}
+
+void markMemoryDirty(chip8_t *chip8, uint16_t address, uint16_t length) {
+    // Writes never wrap, anything past the end of memory went into the padding after the last page
+    uint32_t pageSize = (chip8->memoryMask + 1u) / CHIP8_DIRTY_PAGES;
+    uint32_t start = address & chip8->memoryMask;
+    uint32_t first = start / pageSize;
+    uint32_t last = (start + length - 1) / pageSize;
+    if (last >= CHIP8_DIRTY_PAGES) {
+        last = CHIP8_DIRTY_PAGES - 1;
+    }
+    for (uint32_t page = first; page <= last; page++) {
+        chip8->dirtyPages |= 1u << page;
+    }
+}
+
+void restoreDirtyState(chip8_t *chip8, const chip8_t *snapshot) {
+    uint32_t pageSize = (chip8->memoryMask + 1u) / CHIP8_DIRTY_PAGES;
+    for (int page = 0; chip8->dirtyPages; page++, chip8->dirtyPages >>= 1) {
+        if (chip8->dirtyPages & 1) {
+            // The last page takes the arena padding with it
+            uint32_t length = page == CHIP8_DIRTY_PAGES - 1 ? pageSize + CHIP8_ARENA_PADDING : pageSize;
+            memcpy(&chip8->memory[page * pageSize], &snapshot->memory[page * pageSize], length);
+        }
+    }
+    for (int row = 0; chip8->dirtyRows; row++, chip8->dirtyRows >>= 1) {
+        if (chip8->dirtyRows & 1) {
+            memcpy(&chip8->display[row * CHIP8_DISPLAY_WIDTH], &snapshot->display[row * CHIP8_DISPLAY_WIDTH], CHIP8_DISPLAY_WIDTH);
+        }
+    }
+
+    // Everything outside memory and display is one cache line and a few fields
+    copyMachineRegisters(chip8, snapshot);
+    chip8->dirtyPages = snapshot->dirtyPages;
+    chip8->dirtyRows = snapshot->dirtyRows;
+}
+
+// xorshift32, small and fast, and its state lives in the machine so clones stay deterministic
+static uint8_t nextRandomByte(chip8_t *chip8) {
+    uint32_t x = chip8->rngState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rngState = x;
+    return (uint8_t)(x >> 24);
 }
 
 
 uint16_t fetchOpcode(chip8_t *chip8) {
-    return (chip8->memory[chip8->PC] << 8) | chip8->memory[chip8->PC + 1];
+    const uint8_t *code = &chip8->memory[chip8->PC & chip8->memoryMask]; // The second byte may be padding
+    return (code[0] << 8) | code[1];
+}
+
+int executeCycle(chip8_t *chip8) {
+    chip8->opcode = fetchOpcode(chip8);
+
+    int retired = fusionEnabled ? executeFused(chip8, chip8->opcode, 3) : 0;
+    if (retired == 0) {
+        decodeAndExecute(chip8, chip8->opcode);
+        retired = 1;
+    }
+
+    // Timers still tick once per retired instruction, fused or not
+    for (int i = 0; i < retired; i++) {
+        updateTimers(chip8);
+    }
+    return retired;
 }
 
-void executeCycle(chip8_t *chip8) {
+int executeCycles(chip8_t *chip8, int count) {
+    int retired = 0;
+    while (retired < count && !chip8->fault) {
+        chip8->opcode = fetchOpcode(chip8);
+        // A sequence that doesn't fit what's left runs unfused, so the count is never overshot
+        int fused = fusionEnabled ? executeFused(chip8, chip8->opcode, count - retired) : 0;
+        if (fused == 0) {
+            decodeAndExecute(chip8, chip8->opcode);
+            fused = 1;
+        }
+        for (int i = 0; i < fused; i++) {
+            updateTimers(chip8);
+        }
+        retired += fused;
+    }
+    return retired;
+}
+
+int stepInstruction(chip8_t *chip8) {
     chip8->opcode = fetchOpcode(chip8);
     decodeAndExecute(chip8, chip8->opcode);
     updateTimers(chip8);
+    return 1;
+}
+
+int runFrame(chip8_t *chip8, int instructionsPerFrame) {
+    int retired = 0;
+    while (retired < instructionsPerFrame && !chip8->fault) {
+        chip8->opcode = fetchOpcode(chip8);
+        int fused = fusionEnabled ? executeFused(chip8, chip8->opcode, instructionsPerFrame - retired) : 0;
+        if (fused == 0) {
+            decodeAndExecute(chip8, chip8->opcode);
+            fused = 1;
+        }
+        retired += fused;
+    }
+
+    // The timers are 60 Hz here, once per frame however many instructions ran
+    if (!chip8->fault) {
+        updateTimers(chip8);
+    }
+    return retired;
+}
+
+bool getMemoryAccess(const chip8_t *chip8, uint16_t opcode, uint16_t *address, uint8_t *length, bool *isWrite) {
+    *address = chip8->I;
+    switch (opcode & 0xF000) {
+        case 0xD000: // DXYN reads N sprite bytes
+            *length = opcode & 0x000F;
+            *isWrite = false;
+            return *length > 0;
+
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x0033: // FX33 writes 3 BCD digits
+                    *length = 3;
+                    *isWrite = true;
+                    return true;
+                case 0x0055: // FX55 writes V0 through VX
+                    *length = ((opcode & 0x0F00) >> 8) + 1;
+                    *isWrite = true;
+                    return true;
+                case 0x0065: // FX65 reads V0 through VX
+                    *length = ((opcode & 0x0F00) >> 8) + 1;
+                    *isWrite = false;
+                    return true;
+                default:
+                    return false;
+            }
+
+        default:
+            return false;
+    }
+}
+
+/*
+ Superinstruction fusion
+
+ The loop-heavy ROMs spend most of their time in a handful of instruction pairs/triples.
+ executeFused() peeks at the instructions following the current opcode and, if they form
+ one of the sequences below, runs the whole sequence as a single dispatch:
+
+   6XNN 6YNN        two register loads
+   7XNN 3XKK 1NNN   counted loop (add, test, jump back)
+   ANNN DXYN        point I at a sprite and draw it
+   FX07 3XKK 1NNN   delay timer wait loop
+   ANNN FX65        point I at a table and load registers from it
+
+ Detection reads live memory every time, so self-modifying code is never an issue.
+ None of the fused sequences write memory or read a timer after the first instruction, so
+ they behave exactly like running the instructions one by one. When a 3XKK test skips the
+ jump only two instructions retire, the count has to say so because the timers tick per
+ retired instruction. A sequence longer than maxRetired isn't fused, so frame budgets end on
+ the same instruction either way. chip8_regress checks fused against unfused execution.
+ Returns the number of instructions retired, or 0 if nothing was fused.
+*/
+static int executeFused(chip8_t *chip8, uint16_t opcode, int maxRetired) {
+    uint32_t pc = chip8->PC & chip8->memoryMask;
+    if (pc + 5 > chip8->memoryMask || maxRetired < 2) {
+        return 0; // Not enough room left to peek at a full sequence, or only one instruction to go
+    }
+
+    const uint8_t *code = &chip8->memory[pc];
+    uint16_t next = (code[2] << 8) | code[3];
+    uint16_t third = (code[4] << 8) | code[5];
+    uint8_t x = (opcode & 0x0F00) >> 8;
+
+    switch (opcode & 0xF000) {
+        case 0x6000:
+            if ((next & 0xF000) == 0x6000) { // 6XNN 6YNN
+                chip8->V[x] = opcode & 0x00FF;
+                chip8->V[(next & 0x0F00) >> 8] = next & 0x00FF;
+                chip8->PC += 4;
+                fusionCounts[FUSED_LOAD_PAIR]++;
+                return 2;
+            }
+            break;
+
+        case 0x7000:
+            // 7XNN 3XKK 1NNN, the test has to be on the register just added to
+            if (maxRetired >= 3 && (next & 0xFF00) == (0x3000 | (x << 8)) && (third & 0xF000) == 0x1000) {
+                chip8->V[x] += opcode & 0x00FF;
+                fusionCounts[FUSED_COUNTED_LOOP]++;
+                if (chip8->V[x] == (next & 0x00FF)) {
+                    chip8->PC += 6; // Test skipped the jump, fall out of the loop
+                    return 2;       // The skipped jump never retires
+                }
+                chip8->PC = third & 0x0FFF; // Loop again
+                return 3;
+            }
+            break;
+
+        case 0xA000:
+            if ((next & 0xF000) == 0xD000) { // ANNN DXYN
+                chip8->I = opcode & 0x0FFF;
+                uint8_t spriteX = chip8->V[(next & 0x0F00) >> 8];
+                uint8_t spriteY = chip8->V[(next & 0x00F0) >> 4];
+                chip8->V[0xF] = drawSprite(chip8, spriteX, spriteY, &chip8->memory[chip8->I & chip8->memoryMask], next & 0x000F) ? 1 : 0;
+                chip8->drawFlag = true;
+                chip8->PC += 4;
+                fusionCounts[FUSED_SPRITE_DRAW]++;
+                return 2;
+            }
+            if ((next & 0xF0FF) == 0xF065) { // ANNN FX65
+                chip8->I = opcode & 0x0FFF;
+                const uint8_t *table = &chip8->memory[chip8->I & chip8->memoryMask];
+                for (int i = 0; i <= ((next & 0x0F00) >> 8); i++) {
+                    chip8->V[i] = table[i];
+                }
+                if (chip8->quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+                    chip8->I += ((next & 0x0F00) >> 8) + 1;
+                }
+                chip8->PC += 4;
+                fusionCounts[FUSED_TABLE_LOAD]++;
+                return 2;
+            }
+            break;
+
+        case 0xF000:
+            // FX07 3XKK 1NNN, same register for the read and the test
+            if (maxRetired >= 3 && (opcode & 0x00FF) == 0x0007 && (next & 0xFF00) == (0x3000 | (x << 8)) && (third & 0xF000) == 0x1000) {
+                chip8->V[x] = chip8->delay_timer;
+                fusionCounts[FUSED_TIMER_WAIT]++;
+                if (chip8->V[x] == (next & 0x00FF)) {
+                    chip8->PC += 6; // Timer reached the value, stop waiting
+                    return 2;
+                }
+                chip8->PC = third & 0x0FFF; // Keep waiting
+                return 3;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+void setFusionEnabled(bool enabled) {
+    fusionEnabled = enabled;
+}
+
+bool isFusionEnabled(void) {
+    return fusionEnabled;
+}
+
+void logFusionStats(void) {
+    static const char *names[FUSED_KIND_COUNT] = {
+        "6XNN 6YNN", "7XNN 3XKK 1NNN", "ANNN DXYN", "FX07 3XKK 1NNN", "ANNN FX65"
+    };
+    for (int i = 0; i < FUSED_KIND_COUNT; i++) {
+        logInfo("Fused %s: %llu dispatches", names[i], (unsigned long long)fusionCounts[i]);
+    }
 }
 
 void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
@@ -100,7 +467,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
     switch (opcode & 0xF000) {
 
         case 0x0000:  /// 00E0 - Clear the display and 0x00EE through Return from a subroutine
-            switch (opcode & 0x00FF) {
+            switch (opcode) { // Whole opcode, so 0NNN machine code calls like 08EE aren't taken for 00EE
 
                 case 0x00E0: // Clear the display
                     clearDisplay(chip8);
@@ -109,14 +476,17 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                     break;
 
                 case 0x00EE: // 00EE Return from a subroutine
+                    if (chip8->SP == 0) {
+                        raiseFault(chip8, CHIP8_FAULT_STACK_UNDERFLOW); // Return with nothing on the stack
+                        break;
+                    }
                     chip8->SP--; // Decrement stack pointer
                     chip8->PC = chip8->stack[chip8->SP]; // Move to address at top of stack
                     chip8->PC += 2; // Move to next instruction
                     break;
                 
                 default:
-                    printf("Unknown opcode: 0x%X\n", opcode);
-                    exit(1); 
+                    raiseFault(chip8, CHIP8_FAULT_UNKNOWN_OPCODE);
             }
             break; 
 
@@ -125,6 +495,10 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
             break;
 
         case 0x2000: // 2NNN - Call subroutine at NNN
+            if (chip8->SP >= CHIP8_STACK_SIZE) {
+                raiseFault(chip8, CHIP8_FAULT_STACK_OVERFLOW); // 17th nested call
+                break;
+            }
             chip8->stack[chip8->SP] = chip8->PC; // Store current PC on stack
             chip8->SP++; // Increment stack pointer
             chip8->PC = opcode & 0x0FFF; // Jump to subroutine at NNN
@@ -154,7 +528,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                 break;
 
             case 0x6000: // 6XNN : Set VX to NN
-                chip8->V[(opcode & 0x0F00) >> 8] = chip8->V[(opcode & 0x00FF)]; // Set register VX to NN
+                chip8->V[(opcode & 0x0F00) >> 8] = opcode & 0x00FF; // Set register VX to NN
                 chip8->PC += 2; // Move to next instruction
                 break;
             
@@ -171,77 +545,98 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                         chip8->PC += 2; // Move to next instruction
                         break;
 
-                        case 0x0001: // 8XY1 : Set VX to bitwise VX OR VY
-                            chip8->V[(opcode & 0x0F00) >> 8] |= chip8->V[(opcode & 0x0F00) >> 4]; // VX |= VY
-                            chip8->PC += 2; // Move to next instruction
-                            break;
-                        
-                        case 0x0002: // 8XY2 : Set VX to bitwise VX AND VY
-                            chip8->V[(opcode & 0x0F00) >> 8] &= chip8->V[(opcode & 0x0F00) >> 4]; // VX |= VY
-                            chip8->PC += 2; // Move to next instruction
-                            break;
+                    case 0x0001: // 8XY1 : Set VX to bitwise VX OR VY
+                        chip8->V[(opcode & 0x0F00) >> 8] |= chip8->V[(opcode & 0x00F0) >> 4]; // VX |= VY
+                        if (chip8->quirks & CHIP8_QUIRK_VF_RESET) {
+                            chip8->V[0xF] = 0;
+                        }
+                        chip8->PC += 2; // Move to next instruction
+                        break;
+                    
+                    case 0x0002: // 8XY2 : Set VX to bitwise VX AND VY
+                        chip8->V[(opcode & 0x0F00) >> 8] &= chip8->V[(opcode & 0x00F0) >> 4]; // VX &= VY
+                        if (chip8->quirks & CHIP8_QUIRK_VF_RESET) {
+                            chip8->V[0xF] = 0;
+                        }
+                        chip8->PC += 2; // Move to next instruction
+                        break;
 
-                        case 0x0003: // 8XY2 : Set VX to bitwise VX XOR VY
-                            chip8->V[(opcode & 0x0F00) >> 8] ^= chip8->V[(opcode & 0x0F00) >> 4]; // VX |= VY
-                            chip8->PC += 2; // Move to next instruction
-                            break;
+                    case 0x0003: // 8XY3 : Set VX to bitwise VX XOR VY
+                        chip8->V[(opcode & 0x0F00) >> 8] ^= chip8->V[(opcode & 0x00F0) >> 4]; // VX ^= VY
+                        if (chip8->quirks & CHIP8_QUIRK_VF_RESET) {
+                            chip8->V[0xF] = 0;
+                        }
+                        chip8->PC += 2; // Move to next instruction
+                        break;
 
-                        case 0x0004: // 8XY4: Add VY to VX, set VF on carry
-                            if (chip8->V[(opcode & 0x00F0) >> 4] > (0xFF - chip8->V[(opcode & 0xF00) >> 8])) {
-                                chip8->V[0xF] = 1; // Carry flag set to 1 if there is an overflow
-                            } else {
-                                chip8->V[0xF] = 0; // No carry
-                            }
-                            break;
-                        
-                        case 0x0005:  // 8XY5 : Subtract VY from VX, set VF if no borrow
-                            // some turmoil occured here
-                            if (chip8->V[(opcode & 0x00F0) >> 4] > chip8->V[(opcode & 0x0F00 >> 8)]) {
-                                chip8->V[0xF] = 0; // Borrow occured
-                            } else {
-                                chip8->V[0xF] = 1; // No borrow
-                            }
-                            chip8->V[(opcode & 0x0F00) >> 8] -= chip8->V[(opcode & 0x00F0) >> 4]; //VX -= VY
-                            chip8->PC += 2; // Move to next instruction
-                            break;
+                    // The flag is written after the result in 8XY4-8XYE, so with X = F the flag wins
+                    case 0x0004: { // 8XY4: Add VY to VX, set VF on carry
+                        uint16_t sum = chip8->V[(opcode & 0x0F00) >> 8] + chip8->V[(opcode & 0x00F0) >> 4];
+                        chip8->V[(opcode & 0x0F00) >> 8] = sum & 0xFF; // VX += VY
+                        chip8->V[0xF] = sum > 0xFF; // Carry flag set to 1 if there is an overflow
+                        chip8->PC += 2; // Move to next instruction
                         break;
+                    }
+                    
+                    case 0x0005: { // 8XY5 : Subtract VY from VX, set VF if no borrow
+                        uint8_t noBorrow = chip8->V[(opcode & 0x0F00) >> 8] >= chip8->V[(opcode & 0x00F0) >> 4];
+                        chip8->V[(opcode & 0x0F00) >> 8] -= chip8->V[(opcode & 0x00F0) >> 4]; //VX -= VY
+                        chip8->V[0xF] = noBorrow;
+                        chip8->PC += 2; // Move to next instruction
+                        break;
+                    }
 
-                    case 0x0006: // 8XY6 Store least significant bit of VX in VF, then shift VX to the right by 1
-                        chip8->V[0xF] = chip8->V[(opcode & 0x0F00) >> 8] & 0x1; // Store least significant bit of VX in VF
-                        chip8->V[(opcode & 0x0F00) >> 8] >>= 1; // Shift VX to the right by 1
+                    case 0x0006: { // 8XY6 Store least significant bit of VX in VF, then shift VX to the right by 1
+                        uint8_t source = chip8->V[(chip8->quirks & CHIP8_QUIRK_SHIFT_VY) ? (opcode & 0x00F0) >> 4 : (opcode & 0x0F00) >> 8];
+                        uint8_t lsb = source & 0x1; // Least significant bit of VX (VY with the shift quirk)
+                        chip8->V[(opcode & 0x0F00) >> 8] = source >> 1; // Shift VX to the right by 1
+                        chip8->V[0xF] = lsb;
                         chip8->PC += 2; // Move to next instruction
                         break;
+                    }
                     
-                    case 0x0007: // 8XY7 : Set VX to VY - VX, set VF if no borrow
-                        if (chip8->V[(opcode & 0x0F00) >> 8] > chip8->V[(opcode & 0x00F0) >> 4]) {
-                            chip8->V[0xF] = 0; // Borrow occured
-                        } else {
-                            chip8->V[0xF] = 1; // No borrow
-                        }
+                    case 0x0007: { // 8XY7 : Set VX to VY - VX, set VF if no borrow
+                        uint8_t noBorrow = chip8->V[(opcode & 0x00F0) >> 4] >= chip8->V[(opcode & 0x0F00) >> 8];
                         chip8->V[(opcode & 0x0F00) >> 8] = chip8->V[(opcode & 0x00F0) >> 4] - chip8->V[(opcode & 0x0F00) >> 8]; // VX = VY - VX
+                        chip8->V[0xF] = noBorrow;
                         chip8->PC += 2; // Move to next instruction
                         break;
+                    }
                     
-                    case 0x000E: // 8XYE: Store most significant bit of VX in VF, then shift VX to the left by 1
-                        chip8->V[0xF] = chip8->V[(opcode & 0x0F00) >> 8] >> 7; // Store most significant bit of VX in VF
-                        chip8->V[(opcode & 0x0F00) >> 8] <<= 1; // Shift VX to the left by 1
+                    case 0x000E: { // 8XYE: Store most significant bit of VX in VF, then shift VX to the left by 1
+                        uint8_t source = chip8->V[(chip8->quirks & CHIP8_QUIRK_SHIFT_VY) ? (opcode & 0x00F0) >> 4 : (opcode & 0x0F00) >> 8];
+                        uint8_t msb = source >> 7; // Most significant bit of VX (VY with the shift quirk)
+                        chip8->V[(opcode & 0x0F00) >> 8] = source << 1; // Shift VX to the left by 1
+                        chip8->V[0xF] = msb;
                         chip8->PC += 2; // Move to next instruction
                         break;
+                    }
                     
                     default:
-                        printf("Unknown opcode: %X\n", opcode);
-                        exit(1);
+                        raiseFault(chip8, CHIP8_FAULT_UNKNOWN_OPCODE);
                         break;
                 }
                 break;
             
+            case 0x9000: // 9XY0: Skip next instruction if VX != VY
+                if (chip8->V[(opcode & 0x0F00) >> 8] != chip8->V[(opcode & 0x00F0) >> 4]) {
+                    chip8->PC += 4; // Skip the next instruction
+                } else {
+                    chip8->PC += 2; // Move to next instruction
+                }
+                break;
+
             case 0xA000: // ANNN : Set I to address NNN
                 chip8->I = opcode & 0x0FFF; // Set I to address NNN
                 chip8->PC += 2; // Move to next instruction
                 break;
             
+            case 0xB000: // BNNN : Jump to address NNN + V0 (BXNN: XNN + VX with the jump quirk)
+                chip8->PC = ((opcode & 0x0FFF) + chip8->V[(chip8->quirks & CHIP8_QUIRK_JUMP_VX) ? (opcode & 0x0F00) >> 8 : 0]) & 0x0FFF;
+                break;
+
             case 0xC000: // CXXN: Set VX to random byte AND NN
-                chip8->V[(opcode & 0x0F00) >> 8] = (rand() % 0xFF) & (opcode & 0x00FF); // VX = random byte AND NN
+                chip8->V[(opcode & 0x0F00) >> 8] = nextRandomByte(chip8) & (opcode & 0x00FF); // VX = random byte AND NN
                 chip8->PC += 2;
                 break;
             
@@ -249,7 +644,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                 uint8_t x = chip8->V[(opcode & 0xF00) >> 8]; // X-coordinate from VX
                 uint8_t y = chip8->V[(opcode & 0x0F0) >> 4]; // Y-coordinate from VY
                 uint8_t height = opcode & 0x000F; // Height (N bytes) from the last nibble
-                const uint8_t *sprite = &chip8->memory[chip8->I]; // Sprite draw starting at memory address I
+                const uint8_t *sprite = &chip8->memory[chip8->I & chip8->memoryMask]; // Sprite draw starting at memory address I
                 chip8->V[0xF] = drawSprite(chip8, x, y, sprite, height) ? 1 : 0; // Set VF to 1 if collision 
                 chip8->drawFlag = true; // Set draw flag to redraw screen
                 chip8->PC += 2; // Move to next instruction
@@ -260,7 +655,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                 // Opcodes below handle key press events
                 switch (opcode & 0x00FF) {
                     case 0x009E: // EX9E : Skip next instruction if key stored in VX is pressed
-                        if (chip8->keypad[chip8->V[(opcode & 0x0F00) >> 8 ]]) {
+                        if (chip8->keypad[chip8->V[(opcode & 0x0F00) >> 8] & 0xF]) { // Only the low nibble names a key
                             chip8->PC += 4; // skip next instruction
                         } else {
                             chip8->PC += 2; // Move to next instruction
@@ -268,7 +663,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                         break;
                     
                     case 0x00A1: //EXA1 : Skip next instruction if key stored in VX is not pressed
-                        if (!chip8->keypad[chip8->V[(opcode & 0x0F00) >> 8]]) {
+                        if (!chip8->keypad[chip8->V[(opcode & 0x0F00) >> 8] & 0xF]) {
                             chip8->PC += 4; // Skip next instruction
                         } else {
                             chip8->PC += 2; // Move to next instruction
@@ -276,8 +671,7 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                         break;
 
                     default:
-                        printf("Unknown opcode: 0x%X\n", opcode);
-                        exit(1); 
+                        raiseFault(chip8, CHIP8_FAULT_UNKNOWN_OPCODE);
                 }
                 break;
             
@@ -323,36 +717,53 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
                     chip8->PC += 2; // Move to next instruction
                     break;
                 
-                case 0x0033: // FX33 : Store BCD representation of VX in memory locations I, I+1, I+2
-                    chip8->memory[chip8->I] = chip8->V[(opcode & 0x0F00) >> 8] / 100; // Hundreds digit
-                    chip8->memory[chip8->I + 1] = (chip8->V[(opcode & 0x0F00) >> 8] / 10) % 10; // Tens digit
-                    chip8->memory[chip8->I + 2] = chip8->V[(opcode & 0x0F00) >> 8] % 10; // Ones digit
+                case 0x0029: // FX29 : Set I to the font sprite for the digit in VX
+                    chip8->I = CHIP8_FONTSET_START_ADDRESS + (chip8->V[(opcode & 0x0F00) >> 8] & 0xF) * 5; // 5 bytes per digit
+                    chip8->PC += 2; // Move to next instruction
+                    break;
+
+                case 0x0033: { // FX33 : Store BCD representation of VX in memory locations I, I+1, I+2
+                    uint8_t *bcd = &chip8->memory[chip8->I & chip8->memoryMask];
+                    markMemoryDirty(chip8, chip8->I, 3);
+                    bcd[0] = chip8->V[(opcode & 0x0F00) >> 8] / 100; // Hundreds digit
+                    bcd[1] = (chip8->V[(opcode & 0x0F00) >> 8] / 10) % 10; // Tens digit
+                    bcd[2] = chip8->V[(opcode & 0x0F00) >> 8] % 10; // Ones digit
                     chip8->PC += 2; // Move to next instruction
                     break;
+                }
                 
-                case 0x0055: // FX55: Store registers V0 through VX in memory starting at address I
+                case 0x0055: { // FX55: Store registers V0 through VX in memory starting at address I
+                    uint8_t *store = &chip8->memory[chip8->I & chip8->memoryMask]; // Up to 15 bytes may go into the padding
+                    markMemoryDirty(chip8, chip8->I, ((opcode & 0x0F00) >> 8) + 1);
                     for (int i = 0; i <= ((opcode & 0x0F00) >> 8); i++) {
-                        chip8->memory[chip8->I + i] = chip8->V[i]; // Store V0 to VX in memory starting at address I
+                        store[i] = chip8->V[i]; // Store V0 to VX in memory starting at address I
+                    }
+                    if (chip8->quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+                        chip8->I += ((opcode & 0x0F00) >> 8) + 1;
                     }
                     chip8->PC += 2; // Move to next instruction
                     break;
+                }
                 
-                case 0x0065: // FX65 : Read registers V0 through VX from memory starting at address I
+                case 0x0065: { // FX65 : Read registers V0 through VX from memory starting at address I
+                    const uint8_t *load = &chip8->memory[chip8->I & chip8->memoryMask];
                     for (int i = 0; i <= ((opcode & 0x0F00) >> 8); i++) {
-                        chip8->V[i] = chip8->memory[chip8->I + i]; // Load memory into V0 to VX
+                        chip8->V[i] = load[i]; // Load memory into V0 to VX
+                    }
+                    if (chip8->quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+                        chip8->I += ((opcode & 0x0F00) >> 8) + 1;
                     }
                     chip8->PC += 2; // Move to next instruction
                     break;
+                }
                 
                 default:
-                    printf("Unknown opcode: 0x%X\n", opcode);
-                    exit(1);
+                    raiseFault(chip8, CHIP8_FAULT_UNKNOWN_OPCODE);
             }
             break;
 
             default:
-                printf("Unknown opcode: 0x%X\n", opcode);
-                exit(1);
+                raiseFault(chip8, CHIP8_FAULT_UNKNOWN_OPCODE);
     }
 
 }
@@ -361,76 +772,46 @@ void decodeAndExecute(chip8_t *chip8, uint16_t opcode) {
 
 
 void clearDisplay(chip8_t *chip8) {
-    memset(chip8->display, 0, sizeof(chip8->display)); // Clear display
+    memset(chip8->display, 0, CHIP8_DISPLAY_SIZE); // Clear display
+    chip8->dirtyRows = 0xFFFFFFFF;
+}
+
+
+void setKeypadState(chip8_t *chip8, uint16_t keys) {
+    for (int i = 0; i < CHIP8_KEYPAD_SIZE; i++) {
+        chip8->keypad[i] = (keys >> i) & 1;
+    }
 }
 
 
 bool drawSprite(chip8_t *chip8, uint8_t x, uint8_t y, const uint8_t *sprite, uint8_t height) {
     bool pixelFlipped = false; // Set to true if a pixel is turned off
+    bool clip = chip8->quirks & CHIP8_QUIRK_CLIP;
+    if (clip) {
+        // The start position still wraps, only what would hang over the edge is cut off
+        x %= CHIP8_DISPLAY_WIDTH;
+        y %= CHIP8_DISPLAY_HEIGHT;
+    }
+
+    // Columns past the right edge are dropped from the sprite bits up front when clipping
+    uint8_t columnMask = clip && x + 8 > CHIP8_DISPLAY_WIDTH ? (uint8_t)(0xFF << (x + 8 - CHIP8_DISPLAY_WIDTH)) : 0xFF;
 
     for (int row = 0; row < height; row++) {
-        uint8_t spriteRow = sprite[row]; // Get current row of sprite
-        for (int col = 0; col < 8; col++) {
-            uint8_t spritePixel = (spriteRow & (0x80 >> col)) >> (7 - col); // Get current pixel of sprite
-            int displayIndex = (x + col) % CHIP8_DISPLAY_WIDTH + ((y + row) % CHIP8_DISPLAY_HEIGHT) * CHIP8_DISPLAY_WIDTH; // Get index of display pixel
-
-            if (spritePixel) {
-                if (chip8->display[displayIndex]) {
-                    pixelFlipped = true; // Collision detected
-                }
-                chip8->display[displayIndex] ^= 1; // XOR with sprite pixel
+        if (clip && y + row >= CHIP8_DISPLAY_HEIGHT) {
+            break;
+        }
+        unsigned line = (unsigned)(y + row) % CHIP8_DISPLAY_HEIGHT;
+        uint8_t spriteRow = sprite[row] & columnMask; // Get current row of sprite
+        uint8_t *pixels = &chip8->display[line * CHIP8_DISPLAY_WIDTH];
+        chip8->dirtyRows |= 1u << line;
+        for (unsigned col = 0; spriteRow; col++, spriteRow <<= 1) {
+            if (spriteRow & 0x80) {
+                uint8_t *pixel = &pixels[(x + col) % CHIP8_DISPLAY_WIDTH];
+                pixelFlipped |= *pixel != 0; // Collision detected
+                *pixel ^= 1; // XOR with sprite pixel
             }
         }
     }
 
     return pixelFlipped;
 }
-
-
-//Map SDL Keys to corresponding Chip-8 keypad keys
-			//Left: Keyboard Right: CHIP-8 Keypad
-			// 1 2 3 4 -> 1 2 3 C
-			// Q W E R -> 4 5 6 D
-			// A S D F -> 7 8 9 E
-			// Z X C V -> A 0 B F
-
-
-uint8_t waitForKeyPress(chip8_t *chip8) {
-	SDL_Event event;
-	while (true) {
-		while (SDL_PollEvent(&event)) {
-			if (event.type == SDL_KEYDOWN) {
-				uint8_t key = 0xFF;
-				switch (event.key.keysym.sym) {
-					case SDLK_ESCAPE: exit(0);
-					case SDLK_1: key = 0x1; break;
-					case SDLK_2: key = 0x2; break;
-					case SDLK_3: key = 0x3; break;
-					case SDLK_4: key = 0xc; break;
-					case SDLK_q: key = 0x4; break;
-					case SDLK_w: key = 0x5; break;
-					case SDLK_e: key = 0x6; break;
-					case SDLK_r: key = 0xD; break;
-					case SDLK_a: key = 0x7; break;
-					case SDLK_s: key = 0x8; break;
-					case SDLK_d: key = 0x9; break;
-					case SDLK_f: key = 0xE; break;
-					case SDLK_z: key = 0xA; break;
-					case SDLK_x: key = 0x0; break;
-					case SDLK_c: key = 0xB; break;
-					case SDLK_v: key = 0xF; break;
-					default:
-						break;
-					}
-					if (key != 0xFF) {
-						chip8->keypad[key] = true;
-						logDebug("Key %X pressed during wait", key);
-						return key;
-					}
-				}  else if (event.type == SDL_QUIT) {
-					exit(0);
-				}
-			}
-			SDL_Delay(1); // CPU usage considerations
-		}	
-}
@@ -0,0 +1,592 @@
+#include "debugger.h"
+#include "trace.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ADDRESS_WORDS (CHIP8_MEMORY_SIZE / 64)
+#define MAX_PACKET 4096
+#define REGISTER_BLOCK_SIZE (CHIP8_REGISTER_COUNT + 2 + 2 + 3)
+
+// One bit per address. Written by the server thread, read by the emulation thread.
+static _Atomic uint64_t breakpoints[ADDRESS_WORDS];
+static _Atomic uint64_t readWatches[ADDRESS_WORDS];
+static _Atomic uint64_t writeWatches[ADDRESS_WORDS];
+static atomic_int pointCount = 0;          // Bits set across all three maps
+static atomic_bool haltRequested = false;
+
+// Halt handshake between the emulation thread (stops, waits) and whoever resumes it
+static pthread_mutex_t haltLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t haltChanged = PTHREAD_COND_INITIALIZER;
+static bool halted = false;
+static bool stepping = false;
+static char stopReply[64] = "S05"; // GDB stop packet describing why the machine halted
+
+static chip8_t *target = NULL;
+static pthread_t serverThread;
+static bool serverStarted = false;
+static atomic_bool serverRunning = false;
+static int listenSocket = -1;
+static char serverPath[108];
+
+static bool testBit(_Atomic uint64_t *map, uint16_t address) {
+    address &= CHIP8_MEMORY_SIZE - 1;
+    return (atomic_load_explicit(&map[address >> 6], memory_order_relaxed) >> (address & 63)) & 1;
+}
+
+static void changeBit(_Atomic uint64_t *map, uint16_t address, bool enabled) {
+    address &= CHIP8_MEMORY_SIZE - 1;
+    uint64_t bit = 1ULL << (address & 63);
+    uint64_t old = enabled ? atomic_fetch_or(&map[address >> 6], bit) : atomic_fetch_and(&map[address >> 6], ~bit);
+    if (enabled && !(old & bit)) {
+        atomic_fetch_add(&pointCount, 1);
+    } else if (!enabled && (old & bit)) {
+        atomic_fetch_sub(&pointCount, 1);
+    }
+}
+
+void setBreakpoint(uint16_t address, bool enabled) {
+    changeBit(breakpoints, address, enabled);
+}
+
+void setWatchpoint(uint16_t address, uint16_t length, watchType_t type, bool enabled) {
+    for (uint16_t i = 0; i < length; i++) {
+        if (type & WATCH_READ) {
+            changeBit(readWatches, address + i, enabled);
+        }
+        if (type & WATCH_WRITE) {
+            changeBit(writeWatches, address + i, enabled);
+        }
+    }
+}
+
+void clearAllBreakpoints() {
+    for (int i = 0; i < ADDRESS_WORDS; i++) {
+        atomic_store(&breakpoints[i], 0);
+        atomic_store(&readWatches[i], 0);
+        atomic_store(&writeWatches[i], 0);
+    }
+    atomic_store(&pointCount, 0);
+}
+
+bool isDebuggerArmed() {
+    return atomic_load_explicit(&pointCount, memory_order_relaxed) > 0 ||
+           atomic_load_explicit(&haltRequested, memory_order_relaxed);
+}
+
+void debugHalt() {
+    atomic_store(&haltRequested, true);
+}
+
+static void resume(bool step) {
+    pthread_mutex_lock(&haltLock);
+    if (halted) {
+        stepping = step;
+        halted = false;
+        pthread_cond_broadcast(&haltChanged);
+    }
+    pthread_mutex_unlock(&haltLock);
+}
+
+void debugContinue() {
+    resume(false);
+}
+
+void debugStep() {
+    resume(true);
+}
+
+bool isDebugHalted() {
+    pthread_mutex_lock(&haltLock);
+    bool result = halted;
+    pthread_mutex_unlock(&haltLock);
+    return result;
+}
+
+// Called on the emulation thread, blocks until somebody resumes the machine.
+// Returns true if it was resumed with a single step.
+static bool haltHere(const char *reply) {
+    pthread_mutex_lock(&haltLock);
+    atomic_store(&haltRequested, false);
+    snprintf(stopReply, sizeof(stopReply), "%s", reply);
+    halted = true;
+    stepping = false;
+    pthread_cond_broadcast(&haltChanged);
+    logInfo("Debugger: halted at %03X (%s)", target ? target->PC : 0, reply);
+    while (halted) {
+        pthread_cond_wait(&haltChanged, &haltLock);
+    }
+    bool step = stepping;
+    stepping = false;
+    pthread_mutex_unlock(&haltLock);
+    return step;
+}
+
+// Returns a GDB stop reply if the instruction at PC must not run yet, NULL if it may
+static const char *checkInstruction(chip8_t *chip8, char *reply, size_t size) {
+    if (testBit(breakpoints, chip8->PC)) {
+        snprintf(reply, size, "T05swbreak:;");
+        return reply;
+    }
+
+    uint16_t opcode = fetchOpcode(chip8);
+    uint16_t address;
+    uint8_t length;
+    bool isWrite;
+    if (getMemoryAccess(chip8, opcode, &address, &length, &isWrite)) {
+        _Atomic uint64_t *map = isWrite ? writeWatches : readWatches;
+        for (uint8_t i = 0; i < length; i++) {
+            if (testBit(map, address + i)) {
+                snprintf(reply, size, "T05%s:%x;", isWrite ? "watch" : "rwatch", (address + i) & (CHIP8_MEMORY_SIZE - 1));
+                return reply;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int runOne(chip8_t *chip8) {
+    return isTracing() ? traceCycle(chip8) : stepInstruction(chip8);
+}
+
+uint64_t debugRunInstructions(chip8_t *chip8, uint64_t count) {
+    uint64_t retired = 0;
+    bool skipChecks = false; // We just resumed on this instruction, it already had its turn
+
+    while (retired < count && !chip8->fault && (skipChecks || isDebuggerArmed())) {
+        char reply[64];
+        const char *reason = NULL;
+        if (atomic_load(&haltRequested)) {
+            reason = "S02"; // Interrupted
+        } else if (!skipChecks) {
+            reason = checkInstruction(chip8, reply, sizeof(reply));
+        }
+
+        if (reason) {
+            bool step = haltHere(reason);
+            while (step) {
+                retired += runOne(chip8);
+                step = haltHere("S05");
+            }
+            skipChecks = true;
+            continue;
+        }
+
+        skipChecks = false;
+        retired += runOne(chip8);
+    }
+
+    // Everything got cleared, hand the rest back to the check-free path
+    while (retired < count && !chip8->fault) {
+        retired += isTracing() ? traceCycle(chip8) : executeCycle(chip8);
+    }
+    return retired;
+}
+
+// ---- GDB remote serial protocol ----
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes count bytes of hex text, failing on the first character that isn't a hex digit
+static bool parseHexBytes(const char *text, uint8_t *out, int count) {
+    for (int i = 0; i < count; i++) {
+        int high = hexValue(text[i * 2]);
+        int low = high < 0 ? -1 : hexValue(text[i * 2 + 1]);
+        if (low < 0) {
+            return false;
+        }
+        out[i] = (uint8_t)(high << 4 | low);
+    }
+    return true;
+}
+
+static void putHexByte(char *out, uint8_t value) {
+    out[0] = hexDigits[value >> 4];
+    out[1] = hexDigits[value & 0xF];
+}
+
+static int sendPacket(int client, const char *data) {
+    char buffer[MAX_PACKET * 2 + 4];
+    size_t length = strlen(data);
+    uint8_t checksum = 0;
+    buffer[0] = '$';
+    memcpy(buffer + 1, data, length);
+    for (size_t i = 0; i < length; i++) {
+        checksum += (uint8_t)data[i];
+    }
+    buffer[length + 1] = '#';
+    putHexByte(buffer + length + 2, checksum);
+    return write(client, buffer, length + 4) == (ssize_t)(length + 4) ? 0 : -1;
+}
+
+// Reads one packet into data. Returns 1 for a packet, 2 for a Ctrl-C interrupt, 0 on timeout, -1 on disconnect
+static int readPacket(int client, char *data, size_t size, int timeoutMs) {
+    struct pollfd pfd = { client, POLLIN, 0 };
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+
+    size_t length = 0;
+    bool inPacket = false;
+    while (true) {
+        char c;
+        if (read(client, &c, 1) != 1) {
+            return -1;
+        }
+        if (!inPacket) {
+            if (c == 0x03) {
+                return 2;
+            }
+            if (c == '$') {
+                inPacket = true;
+            }
+            continue; // Acks ('+'/'-') and noise between packets
+        }
+        if (c == '#') {
+            char checksum[2];
+            if (read(client, checksum, 2) != 2) {
+                return -1;
+            }
+            data[length] = '\0';
+            return write(client, "+", 1) == 1 ? 1 : -1;
+        }
+        if (length + 1 < size) {
+            data[length++] = c;
+        }
+    }
+}
+
+static void readRegisters(uint8_t *block) {
+    memcpy(block, target->V, CHIP8_REGISTER_COUNT);
+    block[16] = target->I & 0xFF;
+    block[17] = target->I >> 8;
+    block[18] = target->PC & 0xFF;
+    block[19] = target->PC >> 8;
+    block[20] = target->SP;
+    block[21] = target->delay_timer;
+    block[22] = target->sound_timer;
+}
+
+// Rejects a block whose SP points outside the stack, the machine is left untouched
+static bool writeRegisters(const uint8_t *block) {
+    if (block[20] > CHIP8_STACK_SIZE) {
+        return false;
+    }
+    memcpy(target->V, block, CHIP8_REGISTER_COUNT);
+    target->I = block[16] | (block[17] << 8);
+    target->PC = block[18] | (block[19] << 8);
+    target->SP = block[20];
+    target->delay_timer = block[21];
+    target->sound_timer = block[22];
+    return true;
+}
+
+// Offset and size of register n inside the g/G block
+static bool registerSlot(unsigned n, int *offset, int *size) {
+    if (n < 16) { *offset = n; *size = 1; return true; }
+    if (n == 16) { *offset = 16; *size = 2; return true; }
+    if (n == 17) { *offset = 18; *size = 2; return true; }
+    if (n <= 20) { *offset = 20 + (n - 18); *size = 1; return true; }
+    return false;
+}
+
+static void handlePointPacket(const char *packet, char *reply) {
+    unsigned type, address, kind;
+    if (sscanf(packet + 1, "%x,%x,%x", &type, &address, &kind) != 3 || address >= CHIP8_MEMORY_SIZE) {
+        strcpy(reply, "E01");
+        return;
+    }
+    bool enabled = packet[0] == 'Z';
+    switch (type) {
+        case 0: // Software and hardware breakpoints are the same thing here
+        case 1:
+            setBreakpoint(address, enabled);
+            break;
+        case 2:
+            setWatchpoint(address, kind, WATCH_WRITE, enabled);
+            break;
+        case 3:
+            setWatchpoint(address, kind, WATCH_READ, enabled);
+            break;
+        case 4:
+            setWatchpoint(address, kind, WATCH_ACCESS, enabled);
+            break;
+        default:
+            reply[0] = '\0'; // Unsupported type
+            return;
+    }
+    strcpy(reply, "OK");
+}
+
+// Waits for the machine to halt after c/s, a Ctrl-C from the client forces the halt
+static int waitForStop(int client, char *reply) {
+    while (atomic_load(&serverRunning)) {
+        pthread_mutex_lock(&haltLock);
+        if (halted) {
+            strcpy(reply, stopReply);
+            pthread_mutex_unlock(&haltLock);
+            return 0;
+        }
+        pthread_mutex_unlock(&haltLock);
+
+        char ignored[MAX_PACKET];
+        int result = readPacket(client, ignored, sizeof(ignored), 20);
+        if (result == 2) {
+            debugHalt();
+        } else if (result < 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static void waitUntilHalted() {
+    debugHalt();
+    pthread_mutex_lock(&haltLock);
+    while (!halted && atomic_load(&serverRunning)) {
+        pthread_mutex_unlock(&haltLock);
+        usleep(1000);
+        pthread_mutex_lock(&haltLock);
+    }
+    pthread_mutex_unlock(&haltLock);
+}
+
+static void serveClient(int client) {
+    char packet[MAX_PACKET];
+    char reply[MAX_PACKET * 2 + 1];
+
+    waitUntilHalted(); // GDB expects a stopped target when it attaches
+    logInfo("Debugger: client attached");
+
+    while (atomic_load(&serverRunning)) {
+        int result = readPacket(client, packet, sizeof(packet), 100);
+        if (result < 0) {
+            break;
+        }
+        if (result != 1) {
+            continue;
+        }
+
+        reply[0] = '\0';
+        switch (packet[0]) {
+            case '?':
+                pthread_mutex_lock(&haltLock);
+                strcpy(reply, stopReply);
+                pthread_mutex_unlock(&haltLock);
+                break;
+
+            case 'g': {
+                uint8_t block[REGISTER_BLOCK_SIZE];
+                readRegisters(block);
+                for (int i = 0; i < REGISTER_BLOCK_SIZE; i++) {
+                    putHexByte(reply + i * 2, block[i]);
+                }
+                reply[REGISTER_BLOCK_SIZE * 2] = '\0';
+                break;
+            }
+
+            case 'G': {
+                uint8_t block[REGISTER_BLOCK_SIZE];
+                if (strlen(packet + 1) < REGISTER_BLOCK_SIZE * 2 || !parseHexBytes(packet + 1, block, REGISTER_BLOCK_SIZE) ||
+                    !writeRegisters(block)) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                strcpy(reply, "OK");
+                break;
+            }
+
+            case 'p':
+            case 'P': {
+                unsigned n;
+                int offset, size;
+                uint8_t block[REGISTER_BLOCK_SIZE];
+                if (sscanf(packet + 1, "%x", &n) != 1 || !registerSlot(n, &offset, &size)) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                readRegisters(block);
+                if (packet[0] == 'p') {
+                    for (int i = 0; i < size; i++) {
+                        putHexByte(reply + i * 2, block[offset + i]);
+                    }
+                    reply[size * 2] = '\0';
+                } else {
+                    const char *value = strchr(packet, '=');
+                    if (!value || (int)strlen(value + 1) < size * 2 || !parseHexBytes(value + 1, block + offset, size) ||
+                        !writeRegisters(block)) {
+                        strcpy(reply, "E01");
+                        break;
+                    }
+                    strcpy(reply, "OK");
+                }
+                break;
+            }
+
+            case 'm': {
+                unsigned address, length;
+                if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || length > MAX_PACKET / 2) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (unsigned i = 0; i < length; i++) {
+                    putHexByte(reply + i * 2, readMemory(target, (uint16_t)(address + i)));
+                }
+                reply[length * 2] = '\0';
+                break;
+            }
+
+            case 'M': {
+                unsigned address, length;
+                uint8_t bytes[MAX_PACKET / 2];
+                const char *data = strchr(packet, ':');
+                if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || !data || length > MAX_PACKET / 2 ||
+                    strlen(data + 1) < length * 2 || !parseHexBytes(data + 1, bytes, (int)length)) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (unsigned i = 0; i < length; i++) {
+                    writeMemory(target, (uint16_t)(address + i), bytes[i]);
+                }
+                strcpy(reply, "OK");
+                break;
+            }
+
+            case 'c':
+            case 's':
+                if (packet[0] == 's') {
+                    debugStep();
+                } else {
+                    debugContinue();
+                }
+                if (waitForStop(client, reply) != 0) {
+                    goto detach;
+                }
+                break;
+
+            case 'Z':
+            case 'z':
+                handlePointPacket(packet, reply);
+                break;
+
+            case 'H':
+                strcpy(reply, "OK"); // Only one thread
+                break;
+
+            case 'q':
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    snprintf(reply, sizeof(reply), "PacketSize=%x;swbreak+", MAX_PACKET);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                }
+                break;
+
+            case 'D':
+                sendPacket(client, "OK");
+                goto detach;
+
+            case 'k':
+                goto detach;
+
+            default:
+                break; // Empty reply = not supported
+        }
+        if (sendPacket(client, reply) != 0) {
+            break;
+        }
+    }
+
+detach:
+    // Leaving the machine stopped with nobody attached would hang it for good
+    clearAllBreakpoints();
+    atomic_store(&haltRequested, false);
+    debugContinue();
+    logInfo("Debugger: client detached");
+}
+
+static void *serverLoop(void *data) {
+    (void)data;
+    while (atomic_load(&serverRunning)) {
+        struct pollfd pfd = { listenSocket, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        int client = accept(listenSocket, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        serveClient(client);
+        close(client);
+    }
+    return NULL;
+}
+
+int startDebugServer(chip8_t *chip8, const char *socketPath) {
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        logError("Debug socket path too long: %s", socketPath);
+        return -1;
+    }
+
+    target = chip8;
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        logError("Failed to create debug socket");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenSocket, 1) != 0) {
+        logError("Failed to listen on debug socket %s", socketPath);
+        close(listenSocket);
+        listenSocket = -1;
+        return -1;
+    }
+    snprintf(serverPath, sizeof(serverPath), "%s", socketPath);
+
+    atomic_store(&serverRunning, true);
+    if (pthread_create(&serverThread, NULL, serverLoop, NULL) != 0) {
+        logError("Failed to start debug server thread");
+        atomic_store(&serverRunning, false);
+        close(listenSocket);
+        listenSocket = -1;
+        return -1;
+    }
+    serverStarted = true;
+    logInfo("Debugger listening on %s", socketPath);
+    return 0;
+}
+
+void stopDebugServer() {
+    atomic_store(&serverRunning, false);
+    clearAllBreakpoints();
+    atomic_store(&haltRequested, false);
+    debugContinue();
+    if (serverStarted) {
+        pthread_join(serverThread, NULL);
+        serverStarted = false;
+    }
+    if (listenSocket >= 0) {
+        close(listenSocket);
+        listenSocket = -1;
+        unlink(serverPath);
+    }
+}
@@ -0,0 +1,393 @@
+#include "emulator.h"
+#include "logger.h"
+#include "input.h"
+#include "audio.h"
+#include "trace.h"
+#include "debugger.h"
+#include "arena.h"
+#include "viptiming.h"
+#include "metrics.h"
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Emulation speed: one instruction every 2 ms (about 500 instructions per second)
+#define MS_PER_INSTRUCTION 2
+// The loop wakes up once per emulated 60 Hz frame
+#define FRAME_RATE 60
+// Never try to catch up on more than this many instructions at once (e.g. after the host was suspended)
+#define MAX_CATCHUP_INSTRUCTIONS 500
+// Same limit for VIP timing, in frames
+#define MAX_CATCHUP_FRAMES 30
+
+static SDL_Thread *emulatorThread = NULL;
+static atomic_bool running = false;
+static chip8_t *machine = NULL;
+static framebuffer_t *frameOutput = NULL;
+
+// Run-ahead: every frame the machine is cloned and the clone runs this many frames further
+// with the current keys. The clone's screen is shown, then the clone is thrown away.
+static int runAheadFrames = 0;
+static chip8_t speculative; // Has its own memory arena, allocated when the thread starts
+
+// VIP timing: the machine runs whole 60 Hz frames through runVipFrame() instead of a fixed instruction rate
+static bool vipTiming = false;
+// Fixed instructions per frame (0 = off): whole 60 Hz frames through runFrame(), usually a calibrated rate (see calibrate.h)
+static int fixedInstructionsPerFrame = 0;
+
+// Turbo: no throttle, frames are skipped so the presenter keeps up. Toggled from the main thread.
+static atomic_bool turboMode = false;
+
+// Optional recording, one video frame per emulated frame of the real machine (never the speculative one)
+static videoSink_t *videoSink = NULL;
+
+// Playlist: the next machine is handed over here and swapped in at the start of a frame, the one it
+// replaced comes back through retiredMachine. The rate is stored before the machine so it's always the right one.
+static _Atomic(chip8_t *) pendingMachine = NULL;
+static atomic_int pendingInstructionsPerFrame = 0;
+static _Atomic(chip8_t *) retiredMachine = NULL;
+// With a playlist a fault only stops the faulting game, the loop keeps going until the next swap
+static bool stopOnFault = true;
+static atomic_bool machineFaulted = false;
+
+// Run instructions until at least `count` have been retired, returns how many actually were
+static uint64_t runInstructions(chip8_t *chip8, uint64_t count) {
+	uint64_t retired = 0;
+	while (retired < count && !chip8->fault) {
+		retired += executeCycle(chip8);
+	}
+	return retired;
+}
+
+// One whole 60 Hz frame for the frame-based schedulers, VIP timing or a fixed number of instructions per frame
+static uint64_t runWholeFrame(chip8_t *chip8) {
+	return vipTiming ? runVipFrame(chip8) : runFrame(chip8, fixedInstructionsPerFrame);
+}
+
+// Run `count` whole frames, returns the instructions retired
+static uint64_t runWholeFrames(chip8_t *chip8, uint64_t count) {
+	uint64_t retired = 0;
+	for (uint64_t i = 0; i < count && !chip8->fault; i++) {
+		retired += runWholeFrame(chip8);
+	}
+	return retired;
+}
+
+// Same as runInstructions() but records every instruction, only used for the real machine
+static uint64_t runTracedInstructions(chip8_t *chip8, uint64_t count) {
+	uint64_t retired = 0;
+	while (retired < count && !chip8->fault) {
+		retired += traceCycle(chip8);
+	}
+	return retired;
+}
+
+// Default rate: instructions since the schedule started by the end of emulated frame `frame`
+static uint64_t frameEndInstruction(uint64_t frame) {
+	return (frame * 1000 + FRAME_RATE * MS_PER_INSTRUCTION - 1) / (FRAME_RATE * MS_PER_INSTRUCTION);
+}
+
+// Instructions for the real machine through whichever runner is active
+static uint64_t runScheduledInstructions(chip8_t *chip8, uint64_t count) {
+	if (isDebuggerArmed()) {
+		return debugRunInstructions(chip8, count);
+	}
+	if (isTracing()) {
+		return runTracedInstructions(chip8, count);
+	}
+	return runInstructions(chip8, count);
+}
+
+// One video frame per emulated frame, written as soon as that frame has run
+static void recordFrame(const chip8_t *chip8) {
+	if (videoSink && writeVideoFrame(videoSink, chip8->display) != 0) {
+		logError("Video output failed, recording stopped");
+		videoSink = NULL;
+	}
+}
+
+// The buzzer follows the real machine only, speculative frames never reach the audio device
+static void updateAudio(const chip8_t *chip8) {
+	if (chip8->sound_timer > 0) {
+		playSound();
+	} else {
+		stopSound();
+	}
+}
+
+// Turbo runs one emulated frame per loop iteration, back to back. Every TURBO_ADAPT_MS it counts how many
+// frames it got through and from then on publishes only every Nth, so about FRAME_RATE a second reach the presenter.
+#define TURBO_ADAPT_MS 250
+
+// One frame's worth of emulation for turbo, through whatever runner is active
+static uint64_t runTurboFrame(chip8_t *chip8, uint64_t instructionsPerFrame) {
+	if (vipTiming || fixedInstructionsPerFrame > 0) {
+		return runWholeFrame(chip8);
+	}
+	return runScheduledInstructions(chip8, instructionsPerFrame);
+}
+
+static int emulationLoop(void *data) {
+	(void)data;
+	// Real-time schedule, restarted whenever turbo ends so the emulator doesn't try to catch up on it
+	uint32_t startTime = SDL_GetTicks();
+	uint64_t frameIndex = 0;
+	uint64_t scheduledRetired = 0; // Instructions run since startTime
+	uint64_t framesRun = 0;        // Frame-based schedulers only
+	uint64_t recordedRetired = 0;  // Default rate with a recording: instructions run since startTime, dropped time not counted
+	uint64_t framesRecorded = 0;
+	bool wholeFrames = vipTiming || fixedInstructionsPerFrame > 0;
+	uint64_t retiredTotal = 0;
+	// Instructions in one emulated frame, rounded up so a speculative run covers at least N frames
+	uint64_t instructionsPerFrame = (1000 / FRAME_RATE + MS_PER_INSTRUCTION - 1) / MS_PER_INSTRUCTION;
+
+	// Turbo state
+	bool wasTurbo = false;
+	uint64_t turboStart = 0;
+	uint64_t turboFrames = 0;
+	uint64_t turboRetired = 0;
+	uint64_t turboSkip = 1;       // Publish every Nth frame
+	uint64_t turboWindowStart = 0;
+	uint64_t turboWindowFrames = 0;
+
+	while (atomic_load(&running)) {
+		uint64_t frameStart = metricsClock();
+		uint64_t retiredBefore = retiredTotal;
+		bool turbo = atomic_load(&turboMode);
+
+		chip8_t *next = atomic_exchange(&pendingMachine, NULL);
+		if (next) {
+			// The old machine's last frame stays on screen until this frame publishes the new one.
+			// It's handed back last, whoever takes it sees the new machine's fault state.
+			chip8_t *old = machine;
+			machine = next;
+			machine->drawFlag = true;
+			fixedInstructionsPerFrame = atomic_load(&pendingInstructionsPerFrame);
+			wholeFrames = vipTiming || fixedInstructionsPerFrame > 0;
+			startTime = SDL_GetTicks();
+			frameIndex = scheduledRetired = framesRun = recordedRetired = framesRecorded = 0;
+			atomic_store(&machineFaulted, false);
+			stopSound();
+			atomic_store(&retiredMachine, old);
+		}
+
+		if (turbo != wasTurbo) {
+			if (turbo) {
+				turboStart = turboWindowStart = frameStart;
+				turboFrames = turboWindowFrames = turboRetired = 0;
+				turboSkip = 1;
+				stopSound(); // Muted for as long as turbo lasts
+			} else {
+				// The speed-up this host sustained, in emulated time over real time
+				double seconds = (double)(frameStart - turboStart) / 1e9;
+				double emulated = wholeFrames ? (double)turboFrames / FRAME_RATE : turboRetired * MS_PER_INSTRUCTION / 1000.0;
+				logInfo("Turbo off: %llu frames, %.2f s emulated in %.2f s, %.1fx real time",
+					(unsigned long long)turboFrames, emulated, seconds, seconds > 0.0 ? emulated / seconds : 0.0);
+				startTime = SDL_GetTicks();
+				frameIndex = scheduledRetired = framesRun = recordedRetired = framesRecorded = 0;
+			}
+			wasTurbo = turbo;
+		}
+
+		// Pick up the keypad once per frame instead of touching SDL from this thread
+		setKeypadState(machine, getKeypadState());
+
+		if (machine->fault) {
+			// Only with stopOnFault off: nothing runs until the playlist swaps this machine out
+		} else if (turbo) {
+			uint64_t retired = runTurboFrame(machine, instructionsPerFrame);
+			turboRetired += retired;
+			retiredTotal += retired;
+			recordFrame(machine);
+		} else if (wholeFrames) {
+			// Whole frames are due here, the scheduler decides how many instructions fit in each
+			uint64_t framesDue = (uint64_t)(SDL_GetTicks() - startTime) * FRAME_RATE / 1000 + 1;
+			if (framesDue > framesRun + MAX_CATCHUP_FRAMES) {
+				countDroppedTime((framesDue - MAX_CATCHUP_FRAMES - framesRun) * 1000000000ull / FRAME_RATE);
+				framesRun = framesDue - MAX_CATCHUP_FRAMES;
+			}
+			for (; framesRun < framesDue && !machine->fault; framesRun++) {
+				retiredTotal += runWholeFrame(machine);
+				recordFrame(machine);
+			}
+		} else {
+			// Run however many instructions are due by now, independent of how long presents take
+			uint64_t due = (SDL_GetTicks() - startTime) / MS_PER_INSTRUCTION;
+			if (due > scheduledRetired + MAX_CATCHUP_INSTRUCTIONS) {
+				countDroppedTime((due - MAX_CATCHUP_INSTRUCTIONS - scheduledRetired) * MS_PER_INSTRUCTION * 1000000ull);
+				scheduledRetired = due - MAX_CATCHUP_INSTRUCTIONS;
+			}
+			while (due > scheduledRetired && !machine->fault) {
+				// With a recording, stop at every emulated frame boundary so each frame gets written
+				uint64_t count = due - scheduledRetired;
+				if (videoSink && frameEndInstruction(framesRecorded + 1) - recordedRetired < count) {
+					count = frameEndInstruction(framesRecorded + 1) - recordedRetired;
+				}
+				uint64_t retired = runScheduledInstructions(machine, count);
+				scheduledRetired += retired;
+				retiredTotal += retired;
+				recordedRetired += retired;
+				while (videoSink && recordedRetired >= frameEndInstruction(framesRecorded + 1)) {
+					recordFrame(machine);
+					framesRecorded++;
+				}
+			}
+		}
+		countInstructions(retiredTotal - retiredBefore);
+		if (!turbo) {
+			updateAudio(machine);
+		}
+
+		if (machine->fault && !atomic_load(&machineFaulted)) {
+			// The ROM did something the machine can't do, stop instead of taking the whole process down
+			printf("CHIP-8 fault: %s (opcode 0x%04X at 0x%03X)\n", faultName(machine->fault), fetchOpcode(machine), machine->PC);
+			logError("CHIP-8 fault: %s (opcode 0x%04X at 0x%03X)", faultName(machine->fault), fetchOpcode(machine), machine->PC);
+			atomic_store(&machineFaulted, true);
+			if (stopOnFault) {
+				atomic_store(&running, false);
+				break;
+			}
+		}
+
+		if (turbo) {
+			// No run-ahead, the game is already ahead. Skipped frames leave drawFlag set for the next published one.
+			turboFrames++;
+			turboWindowFrames++;
+			if (turboFrames % turboSkip == 0 && machine->drawFlag) {
+				publishFrame(frameOutput, machine->display);
+				machine->drawFlag = false;
+			}
+			if (frameStart - turboWindowStart >= TURBO_ADAPT_MS * 1000000ull) {
+				// Frames per present slot in the last window, so the presenter gets about FRAME_RATE a second
+				uint64_t slots = (frameStart - turboWindowStart) * FRAME_RATE / 1000000000ull;
+				turboSkip = slots > 0 && turboWindowFrames > slots ? turboWindowFrames / slots : 1;
+				turboWindowStart = frameStart;
+				turboWindowFrames = 0;
+			}
+		} else if (runAheadFrames > 0) {
+			// Predict where the game will be N frames from now with the keys held right now.
+			// Only the last speculative frame is published, none of them are rendered or heard.
+			cloneMachine(&speculative, machine);
+			if (wholeFrames) {
+				runWholeFrames(&speculative, runAheadFrames);
+			} else {
+				runInstructions(&speculative, instructionsPerFrame * runAheadFrames);
+			}
+			if (machine->drawFlag || speculative.drawFlag) {
+				publishFrame(frameOutput, speculative.display);
+				machine->drawFlag = false;
+			}
+		} else if (machine->drawFlag) {
+			publishFrame(frameOutput, machine->display);
+			machine->drawFlag = false;
+		}
+
+		countEmulatedFrame(metricsClock() - frameStart);
+		if (turbo && !machine->fault) {
+			continue; // No throttle
+		}
+
+		// Sleep until the next frame is due
+		frameIndex++;
+		uint32_t nextFrame = startTime + (uint32_t)(frameIndex * 1000 / FRAME_RATE);
+		uint32_t now = SDL_GetTicks();
+		if ((int32_t)(nextFrame - now) > 0) {
+			uint64_t sleepStart = metricsClock();
+			SDL_Delay(nextFrame - now);
+			countOversleep((uint64_t)(nextFrame - now) * 1000000ull, metricsClock() - sleepStart);
+		} else if ((int32_t)(now - nextFrame) > 1000) {
+			frameIndex = (uint64_t)(now - startTime) * FRAME_RATE / 1000; // Way behind, resync the frame clock
+		}
+	}
+
+	stopSound();
+	if (isTracing()) {
+		flushTrace(); // This thread's trace buffer dies with it
+	}
+	logInfo("Emulation thread finished after %llu instructions", (unsigned long long)retiredTotal);
+	return 0;
+}
+
+int startEmulator(chip8_t *chip8, framebuffer_t *frames) {
+	machine = chip8;
+	frameOutput = frames;
+	if (runAheadFrames > 0 && !speculative.memory &&
+	    allocateMemoryArena(&speculative, chip8->memoryMask + 1u) != 0) {
+		return -1;
+	}
+	atomic_store(&running, true);
+
+	emulatorThread = SDL_CreateThread(emulationLoop, "chip8_emulation", NULL);
+	if (!emulatorThread) {
+		logError("Failed to create emulation thread: %s", SDL_GetError());
+		atomic_store(&running, false);
+		return -1;
+	}
+	logInfo("Emulation thread started");
+	return 0;
+}
+
+void stopEmulator() {
+	atomic_store(&running, false);
+	if (emulatorThread) {
+		SDL_WaitThread(emulatorThread, NULL);
+		emulatorThread = NULL;
+		logInfo("Emulation thread stopped");
+	}
+	freeMemoryArena(&speculative);
+}
+
+bool isEmulatorRunning() {
+	return atomic_load(&running);
+}
+
+void setVideoSink(videoSink_t *sink) {
+	videoSink = sink;
+}
+
+void setVipTiming(bool enabled) {
+	vipTiming = enabled;
+	logInfo("Timing: %s", enabled ? "COSMAC VIP" : "fixed instruction rate");
+}
+
+void setInstructionsPerFrame(int instructionsPerFrame) {
+	fixedInstructionsPerFrame = instructionsPerFrame < 0 ? 0 : instructionsPerFrame;
+	if (fixedInstructionsPerFrame > 0) {
+		logInfo("Timing: %d instructions per frame", fixedInstructionsPerFrame);
+	}
+}
+
+void swapMachine(chip8_t *next, int instructionsPerFrame) {
+	atomic_store(&pendingInstructionsPerFrame, instructionsPerFrame < 0 ? 0 : instructionsPerFrame);
+	atomic_store(&pendingMachine, next);
+}
+
+chip8_t *takeRetiredMachine() {
+	return atomic_exchange(&retiredMachine, NULL);
+}
+
+void setStopOnFault(bool stop) {
+	stopOnFault = stop;
+}
+
+bool hasMachineFaulted() {
+	return atomic_load(&machineFaulted);
+}
+
+void setTurbo(bool enabled) {
+	atomic_store(&turboMode, enabled);
+	logInfo("Turbo %s", enabled ? "on" : "off");
+}
+
+void toggleTurbo() {
+	setTurbo(!atomic_load(&turboMode));
+}
+
+bool isTurbo() {
+	return atomic_load(&turboMode);
+}
+
+void setRunAhead(int frames) {
+	runAheadFrames = frames < 0 ? 0 : frames;
+	logInfo("Run-ahead set to %d frames", runAheadFrames);
+}
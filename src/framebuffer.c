@@ -0,0 +1,32 @@
+#include "framebuffer.h"
+#include <string.h>
+
+// Set in framebuffer_t.middle when the middle buffer holds a frame the renderer hasn't picked up
+#define FRAMEBUFFER_FRESH 0x4
+#define FRAMEBUFFER_INDEX_MASK 0x3
+
+void initializeFramebuffer(framebuffer_t *frames) {
+    memset(frames->buffers, 0, sizeof(frames->buffers));
+    frames->writeIndex = 0;
+    atomic_init(&frames->middle, 1);
+    frames->readIndex = 2;
+}
+
+void publishFrame(framebuffer_t *frames, const uint8_t *display) {
+    memcpy(frames->buffers[frames->writeIndex], display, CHIP8_DISPLAY_SIZE);
+
+    // Swap the finished buffer into the middle and take whatever was there to write the next frame into.
+    // If the renderer never picked that one up it simply gets overwritten, the renderer only wants the latest.
+    int previous = atomic_exchange_explicit(&frames->middle, frames->writeIndex | FRAMEBUFFER_FRESH, memory_order_acq_rel);
+    frames->writeIndex = previous & FRAMEBUFFER_INDEX_MASK;
+}
+
+const uint8_t *acquireFrame(framebuffer_t *frames) {
+    if (!(atomic_load_explicit(&frames->middle, memory_order_acquire) & FRAMEBUFFER_FRESH)) {
+        return NULL; // Nothing new since the last acquire
+    }
+
+    int previous = atomic_exchange_explicit(&frames->middle, frames->readIndex, memory_order_acq_rel);
+    frames->readIndex = previous & FRAMEBUFFER_INDEX_MASK;
+    return frames->buffers[frames->readIndex];
+}
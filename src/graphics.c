@@ -1,6 +1,9 @@
 #include "graphics.h"
 #include "logger.h"
+#include "video.h"
+#include "metrics.h"
 #include <SDL2/SDL.h>
+#include <string.h>
 
 //Constants for window size
 
@@ -15,6 +18,59 @@ static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
 
+// Software presentation, for hosts without a usable GPU: the display is expanded straight into the
+// window surface at integer scale and only the rows that changed are sent to the window
+static bool softwareRendering = false;
+static scaleEffect_t scaleEffect = SCALE_PLAIN;
+static SDL_Surface *surface = NULL;
+static int surfaceScale = 1;
+static int originX = 0, originY = 0; // Top left of the display, centred in the window
+static scalePalette_t palette;
+static uint8_t shownFrame[CHIP8_DISPLAY_SIZE]; // What the surface holds right now
+static bool surfaceValid = false;             // false = redraw everything on the next present
+static int overlayRows = 0;                   // Display rows the overlay covered on the last present
+static int initializeSurface();
+
+// Presentation pacing, one present per display refresh at most
+#define DEFAULT_REFRESH_RATE 60
+static bool vsyncEnabled = false;
+static int refreshRate = DEFAULT_REFRESH_RATE;
+static uint64_t refreshInterval = 0; // In performance counter ticks
+static uint64_t nextRefresh = 0;     // Performance counter value of the next refresh
+
+// Anti-flicker keeps the previous frame around and ORs it into the current one
+static bool antiFlicker = false;
+static uint8_t previousFrame[CHIP8_DISPLAY_SIZE];
+
+// Present interval statistics
+static uint64_t lastPresent = 0;
+static uint64_t presentCount = 0;
+static uint64_t missedRefreshes = 0;
+static double intervalSumMs = 0.0;
+static double intervalMinMs = 0.0;
+static double intervalMaxMs = 0.0;
+
+// Log a summary every this many presents
+#define FRAME_STATS_LOG_INTERVAL 3600
+
+// Metrics overlay, three numbers in the top left corner:
+//   emulation speed in % of real time (green when keeping up, red when not)
+//   99th percentile present interval in ms
+//   audio underruns since startup
+static bool overlayEnabled = false;
+static metrics_t overlayBefore;
+static uint64_t overlayValues[3];
+static bool overlayBehind = false;
+#define OVERLAY_UPDATE_INTERVAL 30 // Presents between updates, often enough to follow and slow enough to read
+#define OVERLAY_SCALE 3            // Window pixels per glyph pixel
+// Digits 0-9 from the CHIP-8 font, 4x5 pixels with the top nibble holding each row
+static const uint8_t overlayDigits[10][5] = {
+	{0xF0, 0x90, 0x90, 0x90, 0xF0}, {0x20, 0x60, 0x20, 0x20, 0x70}, {0xF0, 0x10, 0xF0, 0x80, 0xF0},
+	{0xF0, 0x10, 0xF0, 0x10, 0xF0}, {0x90, 0x90, 0xF0, 0x10, 0x10}, {0xF0, 0x80, 0xF0, 0x10, 0xF0},
+	{0xF0, 0x80, 0xF0, 0x90, 0xF0}, {0xF0, 0x10, 0x20, 0x40, 0x40}, {0xF0, 0x90, 0xF0, 0x90, 0xF0},
+	{0xF0, 0x90, 0xF0, 0x10, 0xF0}
+};
+
 int initializeGraphics() {
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		logError("Can't start SDL video, error: %s", SDL_GetError());
@@ -34,12 +90,40 @@ int initializeGraphics() {
 	}
 	logInfo("Window created");
 
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-	if (!renderer) {
-		logError("Failed to create renderer with error: %s", SDL_GetError());
-		return -1;
+	if (!softwareRendering) {
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+		SDL_RendererInfo info = { 0 };
+		if (!renderer) {
+			logWarning("No accelerated renderer (%s), using software rendering", SDL_GetError());
+			softwareRendering = true;
+		} else if (SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE)) {
+			// SDL's own software renderer scales the texture generically, the surface path is much faster
+			logWarning("Renderer %s is software only, using software rendering", info.name);
+			SDL_DestroyRenderer(renderer);
+			renderer = NULL;
+			softwareRendering = true;
+		} else {
+			logInfo("Renderer Created");
+			// Not every driver can honour vsync, if it can't presents are paced by hand
+			vsyncEnabled = (info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+		}
+	}
+
+	SDL_DisplayMode mode;
+	if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0) {
+		refreshRate = mode.refresh_rate;
+	}
+	refreshInterval = SDL_GetPerformanceFrequency() / refreshRate;
+	nextRefresh = SDL_GetPerformanceCounter() + refreshInterval;
+	logInfo("Presenting at %d Hz, vsync %s", refreshRate, vsyncEnabled ? "on" : "off (paced by timer)");
+
+	if (softwareRendering) {
+		if (initializeSurface() != 0) {
+			return -1;
+		}
+		logInfo("Software rendering at %dx scale", surfaceScale);
+		return 0;
 	}
-	logInfo("Renderer Created");
 
 	texture = SDL_CreateTexture(renderer,
 				    SDL_PIXELFORMAT_RGBA8888,
@@ -56,7 +140,19 @@ int initializeGraphics() {
 
 }
 
+static void logFrameStats() {
+	frameStats_t stats;
+	getFrameStats(&stats);
+	logInfo("Frames presented: %llu, interval min/avg/max %.2f/%.2f/%.2f ms, %llu missed refreshes",
+		(unsigned long long)stats.presents, stats.minIntervalMs, stats.avgIntervalMs, stats.maxIntervalMs,
+		(unsigned long long)stats.missedRefreshes);
+}
+
 void destroyGraphics() {
+	if (presentCount > 0) {
+		logFrameStats();
+	}
+
 	if (texture) {
 		SDL_DestroyTexture(texture);
 		texture = NULL;
@@ -75,30 +171,276 @@ void destroyGraphics() {
 		logInfo("Window DESTROYED");
 	}
 
+	surface = NULL; // Belongs to the window
+	surfaceValid = false;
+
 	SDL_QuitSubSystem(SDL_INIT_VIDEO);
 	logInfo("SDL Video subsystem QUIT it just QUIT");
 }
 
+static void updateOverlayValues() {
+	metrics_t now;
+	getMetrics(&now);
+	double seconds = (double)(now.timeNs - overlayBefore.timeNs) / 1e9;
+	if (overlayBefore.timeNs != 0 && seconds > 0.0) {
+		double speed = (double)(now.framesEmulated - overlayBefore.framesEmulated) / (seconds * 60.0);
+		overlayValues[0] = (uint64_t)(speed * 100.0 + 0.5);
+		overlayValues[1] = metricsPercentileUs(now.presentInterval, overlayBefore.presentInterval, 99) / 1000;
+		overlayValues[2] = now.audioUnderruns;
+		overlayBehind = speed < 0.98;
+	}
+	overlayBefore = now;
+}
+
+// The overlay draws through the renderer, or straight into the surface (opaque) in software mode
+static void fillOverlayRect(const SDL_Rect *rect, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+	if (softwareRendering) {
+		SDL_FillRect(surface, rect, SDL_MapRGB(surface->format, r, g, b));
+	} else {
+		SDL_SetRenderDrawColor(renderer, r, g, b, a);
+		SDL_RenderFillRect(renderer, rect);
+	}
+}
+
+static void drawOverlayNumber(uint64_t value, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+	char digits[21];
+	int count = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+	for (int d = 0; d < count; d++) {
+		const uint8_t *glyph = overlayDigits[digits[d] - '0'];
+		for (int row = 0; row < 5; row++) {
+			for (int column = 0; column < 4; column++) {
+				if (glyph[row] & (0x80 >> column)) {
+					SDL_Rect pixel = { x + (d * 5 + column) * OVERLAY_SCALE, y + row * OVERLAY_SCALE, OVERLAY_SCALE, OVERLAY_SCALE };
+					fillOverlayRect(&pixel, r, g, b, 255);
+				}
+			}
+		}
+	}
+}
+
+// Draws the overlay, returns the area it covered
+static SDL_Rect drawOverlay() {
+	if (presentCount % OVERLAY_UPDATE_INTERVAL == 0) {
+		updateOverlayValues();
+	}
+	SDL_Rect background = { 0, 0, (6 * 5 + 1) * OVERLAY_SCALE, (3 * 6 + 1) * OVERLAY_SCALE }; // Room for 6 digits
+	if (!softwareRendering) {
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	}
+	fillOverlayRect(&background, 0, 0, 0, 192);
+	for (int line = 0; line < 3; line++) {
+		int y = OVERLAY_SCALE + line * 6 * OVERLAY_SCALE;
+		if (line == 0) {
+			drawOverlayNumber(overlayValues[line], OVERLAY_SCALE, y, overlayBehind ? 255 : 64, overlayBehind ? 64 : 255, 64);
+		} else {
+			drawOverlayNumber(overlayValues[line], OVERLAY_SCALE, y, 255, 255, 0);
+		}
+	}
+	if (!softwareRendering) {
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // RenderClear uses the draw colour
+	}
+	return background;
+}
+
+// (Re)reads the window surface, it changes when the window does
+static int initializeSurface() {
+	surface = SDL_GetWindowSurface(window);
+	if (!surface) {
+		logError("Failed to get the window surface: %s", SDL_GetError());
+		return -1;
+	}
+	if (surface->format->BytesPerPixel != 4) {
+		logError("Software rendering needs a 32-bit window surface, got %d bytes per pixel", surface->format->BytesPerPixel);
+		return -1;
+	}
+
+	int scaleX = surface->w / CHIP8_DISPLAY_WIDTH;
+	int scaleY = surface->h / CHIP8_DISPLAY_HEIGHT;
+	surfaceScale = scaleX < scaleY ? scaleX : scaleY;
+	if (surfaceScale < 1) {
+		surfaceScale = 1;
+	}
+	originX = (surface->w - CHIP8_DISPLAY_WIDTH * surfaceScale) / 2;
+	originY = (surface->h - CHIP8_DISPLAY_HEIGHT * surfaceScale) / 2;
+
+	palette.off = SDL_MapRGB(surface->format, 0, 0, 0);
+	palette.on = SDL_MapRGB(surface->format, 255, 255, 255);
+	palette.dimOff = SDL_MapRGB(surface->format, 0, 0, 0);
+	palette.dimOn = SDL_MapRGB(surface->format, 150, 150, 150);
+
+	SDL_FillRect(surface, NULL, palette.off); // Borders around a centred display stay black
+	surfaceValid = false;
+	return 0;
+}
+
+// Software present, returns the time spent before waiting for the refresh
+static uint64_t presentSoftware(const uint8_t *display, uint64_t renderStart) {
+	if (SDL_GetWindowSurface(window) != surface && initializeSurface() != 0) {
+		return metricsClock() - renderStart;
+	}
+	if (SDL_MUSTLOCK(surface)) {
+		SDL_LockSurface(surface);
+	}
+
+	uint32_t *origin = (uint32_t *)((uint8_t *)surface->pixels + originY * surface->pitch) + originX;
+	int pitch = surface->pitch / sizeof(uint32_t);
+	SDL_Rect rects[CHIP8_DISPLAY_HEIGHT + 1];
+	int rectCount = 0;
+
+	// Runs of changed rows are expanded and sent to the window as one rectangle each.
+	// Rows the overlay covered last time are redrawn as well, it may be gone or smaller now.
+	for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; ) {
+		int end = row;
+		while (end < CHIP8_DISPLAY_HEIGHT && (!surfaceValid || end < overlayRows ||
+		       memcmp(&shownFrame[end * CHIP8_DISPLAY_WIDTH], &display[end * CHIP8_DISPLAY_WIDTH], CHIP8_DISPLAY_WIDTH) != 0)) {
+			end++;
+		}
+		if (end == row) {
+			row++;
+			continue;
+		}
+		scaleFrameRows(display, row, end - row, origin, pitch, surfaceScale, &palette, scaleEffect);
+		rects[rectCount++] = (SDL_Rect){ originX, originY + row * surfaceScale, CHIP8_DISPLAY_WIDTH * surfaceScale, (end - row) * surfaceScale };
+		row = end;
+	}
+	memcpy(shownFrame, display, CHIP8_DISPLAY_SIZE);
+	if (!surfaceValid) {
+		rects[0] = (SDL_Rect){ 0, 0, surface->w, surface->h }; // Borders too
+		rectCount = 1;
+		surfaceValid = true;
+	}
+
+	overlayRows = 0;
+	if (overlayEnabled) {
+		SDL_Rect covered = drawOverlay();
+		overlayRows = (covered.y + covered.h - originY + surfaceScale - 1) / surfaceScale;
+		if (rectCount < CHIP8_DISPLAY_HEIGHT + 1) {
+			rects[rectCount++] = covered;
+		}
+	}
+
+	if (SDL_MUSTLOCK(surface)) {
+		SDL_UnlockSurface(surface);
+	}
+	uint64_t renderTime = metricsClock() - renderStart;
+	waitForNextRefresh(); // No vsync for window surfaces, presents are paced by hand
+	if (rectCount > 0) {
+		SDL_UpdateWindowSurfaceRects(window, rects, rectCount);
+	}
+	return renderTime;
+}
+
 void renderGraphics(chip8_t *chip8) {
-	//create an array to hold pixel data for the entire display
-	uint32_t pixels[CHIP8_DISPLAY_SIZE];
+	renderFrame(chip8->display);
+}
+
+void renderFrame(const uint8_t *display) {
+	uint64_t renderStart = metricsClock();
+
+	// With anti-flicker a pixel stays lit for one extra frame, hiding erase/redraw flicker
+	const uint8_t *source = display;
+	uint8_t blended[CHIP8_DISPLAY_SIZE];
+	if (antiFlicker) {
+		for (int i = 0; i < CHIP8_DISPLAY_SIZE; i++) {
+			blended[i] = display[i] | previousFrame[i];
+		}
+		memcpy(previousFrame, display, CHIP8_DISPLAY_SIZE);
+		source = blended;
+	}
+
+	uint64_t renderTime; // Everything but waiting for the refresh
+	if (softwareRendering) {
+		renderTime = presentSoftware(source, renderStart);
+	} else {
+		//create an array to hold pixel data for the entire display
+		uint32_t pixels[CHIP8_DISPLAY_SIZE];
+
+		//Convert display buffer into pixel data for SDL, set pixels are white (0xFFFFFFFF) and the rest black (0xFF000000)
+		convertFrameToRGBA(source, pixels);
+
+		//	Texture Update - New Pixel Data
+		SDL_UpdateTexture(texture, NULL, pixels, CHIP8_DISPLAY_WIDTH * sizeof(uint32_t));
+		//	Rendering Process
+
+		SDL_RenderClear(renderer); // Clear current rendering target with 0xFF000000
+		SDL_RenderCopy(renderer, texture, NULL, NULL); // Copy texture to render target (render target is the window in this instance)
+		if (overlayEnabled) {
+			drawOverlay();
+		}
+		renderTime = metricsClock() - renderStart;
+		if (!vsyncEnabled) {
+			waitForNextRefresh(); // No vsync, hold the present back to the refresh rate ourselves
+		}
+		SDL_RenderPresent(renderer); // Update screen with rendering performed since last call of renderFrame
+	}
 
-	//Convert display buffer into pixel data for SDL
-	for (int i = 0; i < CHIP8_DISPLAY_SIZE; i++) {
-		// If pixel is set (1) it is white = 0xFFFFFFFF
-		// If pixel is not set (0) it is black 0xFF000000
-		pixels[i] = chip8->display[i] ? 0xFFFFFFFF : 0xFF000000;
+	uint64_t now = SDL_GetPerformanceCounter();
+	nextRefresh = now + refreshInterval;
+	double intervalMs = 0.0;
+	if (lastPresent != 0) {
+		intervalMs = (double)(now - lastPresent) * 1000.0 / SDL_GetPerformanceFrequency();
+		if (presentCount == 1 || intervalMs < intervalMinMs) {
+			intervalMinMs = intervalMs;
+		}
+		if (intervalMs > intervalMaxMs) {
+			intervalMaxMs = intervalMs;
+		}
+		if (intervalMs > 1500.0 / refreshRate) {
+			missedRefreshes++;
+		}
+		intervalSumMs += intervalMs;
 	}
-		
-	//	Texture Update - New Pixel Data
-	SDL_UpdateTexture(texture, NULL, pixels, CHIP8_DISPLAY_WIDTH * sizeof(uint32_t));
-	//	Rendering Process
+	lastPresent = now;
+	presentCount++;
+	countPresent((uint64_t)(intervalMs * 1e6), renderTime);
 
+	if (presentCount % FRAME_STATS_LOG_INTERVAL == 0) {
+		logFrameStats();
+	}
+}
 
-	SDL_RenderClear(renderer); // Clear current rendering target with 0xFF000000
-	SDL_RenderCopy(renderer, texture, NULL, NULL); // Copy texture to render target (render target is the window in this instance)
-	SDL_RenderPresent(renderer); // Update screen with rendering performed since last call of renderGraphics
-	logDebug("Graphics rendered");
+void waitForNextRefresh() {
+	uint64_t now = SDL_GetPerformanceCounter();
+	if (now < nextRefresh) {
+		uint32_t waitMs = (uint32_t)((nextRefresh - now) * 1000 / SDL_GetPerformanceFrequency());
+		if (waitMs > 0) {
+			SDL_Delay(waitMs);
+		}
+		// Spin out the sub-millisecond remainder so the interval doesn't drift
+		while (SDL_GetPerformanceCounter() < nextRefresh) {
+		}
+	}
+	nextRefresh += refreshInterval;
+	if (nextRefresh < SDL_GetPerformanceCounter()) {
+		nextRefresh = SDL_GetPerformanceCounter() + refreshInterval; // Fell behind, don't try to catch up
+	}
+}
+
+void setAntiFlicker(bool enabled) {
+	antiFlicker = enabled;
+	memset(previousFrame, 0, sizeof(previousFrame));
+}
+
+void setSoftwareRendering(bool enabled, scaleEffect_t effect) {
+	softwareRendering = enabled;
+	scaleEffect = effect;
+}
+
+void setMetricsOverlay(bool enabled) {
+	overlayEnabled = enabled;
+	overlayBefore.timeNs = 0; // Start measuring from the next update
+}
+
+void toggleMetricsOverlay() {
+	setMetricsOverlay(!overlayEnabled);
+}
 
-	
+void getFrameStats(frameStats_t *stats) {
+	stats->presents = presentCount;
+	stats->missedRefreshes = missedRefreshes;
+	stats->minIntervalMs = intervalMinMs;
+	stats->maxIntervalMs = intervalMaxMs;
+	stats->avgIntervalMs = presentCount > 1 ? intervalSumMs / (presentCount - 1) : 0.0;
+	stats->refreshRate = refreshRate;
+	stats->vsync = vsyncEnabled;
 }
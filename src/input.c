@@ -1,7 +1,15 @@
 #include "chip8.h"
 #include "input.h"
 #include "logger.h"
+#include "latency.h"
+#include "graphics.h"
+#include "emulator.h"
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Written by the main thread, read by the emulation thread
+static atomic_uint keypadState = 0;
 
 //Map SDL key events to CHIP-8 key inputs
 
@@ -13,7 +21,7 @@
 			// A S D F -> 7 8 9 E
 			// Z X C V -> A 0 B F
 
-void handleInput(chip8_t *chip8, bool *running) {
+void handleInput(bool *running) {
 	SDL_Event event;
 	while (SDL_PollEvent(&event)) {
 		switch (event.type) {
@@ -29,6 +37,16 @@ void handleInput(chip8_t *chip8, bool *running) {
 					case SDLK_ESCAPE: // Exit emulator
 						*running = false;
 						break;
+					case SDLK_F1: // Metrics overlay on/off
+						if (keyState && !event.key.repeat) {
+							toggleMetricsOverlay();
+						}
+						break;
+					case SDLK_TAB: // Turbo on/off
+						if (keyState && !event.key.repeat) {
+							toggleTurbo();
+						}
+						break;
 					case SDLK_1: key = 0x1; break;
 					case SDLK_2: key = 0x2; break;
 					case SDLK_3: key = 0x3; break;
@@ -48,8 +66,19 @@ void handleInput(chip8_t *chip8, bool *running) {
 					default:
 						break;
 				}
-				if (key != 0xFF) {
-					chip8->keypad[key] = keyState; // Set key state , in other words if key is pressed or not
+				if (key != 0xFF && !event.key.repeat) {
+					// Set key state , in other words if key is pressed or not
+					if (keyState) {
+						atomic_fetch_or(&keypadState, 1u << key);
+					} else {
+						atomic_fetch_and(&keypadState, ~(1u << key));
+					}
+
+					// Timestamp the event for latency measurement. SDL stamps events in ms when they
+					// are queued, so add however long it sat in the queue before this poll.
+					uint64_t frequency = SDL_GetPerformanceFrequency();
+					uint32_t queuedMs = SDL_GetTicks() - event.key.timestamp;
+					recordKeyEvent(SDL_GetPerformanceCounter() - queuedMs * frequency / 1000);
 					logDebug("Key %X %s", key, keyState ? "pressed" : "released");
 				}
 				break;
@@ -58,4 +87,8 @@ void handleInput(chip8_t *chip8, bool *running) {
 				break;
 		}
 	}
-}
\ No newline at end of file
+}
+
+uint16_t getKeypadState() {
+	return (uint16_t)atomic_load(&keypadState);
+}
@@ -0,0 +1,31 @@
+#include "keyscript.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Key N is held for KEY_TAP_FRAMES every KEY_TAP_PERIOD frames, N going round the keypad
+#define KEY_TAP_PERIOD 30
+#define KEY_TAP_FRAMES 4
+
+uint16_t *loadKeyScript(const char *path, int frames) {
+    uint16_t *keys = calloc(frames, sizeof(uint16_t));
+    if (!keys || !path) {
+        return keys;
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        logError("Failed to open key script %s", path);
+        free(keys);
+        return NULL;
+    }
+    unsigned mask;
+    for (int f = 0; f < frames && fscanf(file, "%x", &mask) == 1; f++) {
+        keys[f] = (uint16_t)mask;
+    }
+    fclose(file);
+    return keys;
+}
+
+uint16_t keyTapMask(int frame) {
+    return frame % KEY_TAP_PERIOD < KEY_TAP_FRAMES ? (uint16_t)(1u << (frame / KEY_TAP_PERIOD % 16)) : 0;
+}
@@ -0,0 +1,74 @@
+#include "latency.h"
+#include "chip8.h"
+#include "logger.h"
+#include <SDL2/SDL.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Key events still waiting for a frame to change. If more than this pile up before anything
+// changes on screen, the oldest ones are kept since they have the largest latency.
+#define MAX_PENDING_EVENTS 32
+
+static uint64_t pendingEvents[MAX_PENDING_EVENTS];
+static int pendingCount = 0;
+
+static uint8_t lastPresented[CHIP8_DISPLAY_SIZE];
+static bool havePresented = false;
+
+static uint64_t buckets[LATENCY_BUCKET_COUNT];
+static uint64_t samples = 0;
+static double sumMs = 0.0;
+static double maxMs = 0.0;
+
+void recordKeyEvent(uint64_t eventCounter) {
+	if (pendingCount < MAX_PENDING_EVENTS) {
+		pendingEvents[pendingCount++] = eventCounter;
+	}
+}
+
+void recordPresentedFrame(const uint8_t *display) {
+	bool changed = !havePresented || memcmp(lastPresented, display, CHIP8_DISPLAY_SIZE) != 0;
+	if (!changed) {
+		return;
+	}
+	memcpy(lastPresented, display, CHIP8_DISPLAY_SIZE);
+	havePresented = true;
+
+	uint64_t now = SDL_GetPerformanceCounter();
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	for (int i = 0; i < pendingCount; i++) {
+		double latencyMs = (double)(now - pendingEvents[i]) * 1000.0 / frequency;
+
+		int bucket = 0;
+		while (bucket < LATENCY_BUCKET_COUNT - 1 && latencyMs >= (double)(1 << bucket)) {
+			bucket++;
+		}
+		buckets[bucket]++;
+		samples++;
+		sumMs += latencyMs;
+		if (latencyMs > maxMs) {
+			maxMs = latencyMs;
+		}
+	}
+	pendingCount = 0;
+}
+
+void getLatencyHistogram(uint64_t out[LATENCY_BUCKET_COUNT]) {
+	memcpy(out, buckets, sizeof(buckets));
+}
+
+void logLatencyHistogram() {
+	if (samples == 0) {
+		logInfo("Input latency: no samples");
+		return;
+	}
+	logInfo("Input latency: %llu samples, avg %.2f ms, max %.2f ms",
+		(unsigned long long)samples, sumMs / samples, maxMs);
+	for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+		if (i == LATENCY_BUCKET_COUNT - 1) {
+			logInfo("  >= %4d ms: %llu", 1 << (i - 1), (unsigned long long)buckets[i]);
+		} else {
+			logInfo("  <  %4d ms: %llu", 1 << i, (unsigned long long)buckets[i]);
+		}
+	}
+}
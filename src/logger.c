@@ -1,4 +1,5 @@
 #include "logger.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
@@ -23,7 +24,8 @@ void logMessage(LogLevel level, const char *format, va_list args) {
     if (!logFile) return;
 
     time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+    struct tm tmBuf;
+    struct tm *t = localtime_r(&now, &tmBuf);
 
     char timeStr[20];
     strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", t);
@@ -37,10 +39,16 @@ void logMessage(LogLevel level, const char *format, va_list args) {
         default: levelStr = "UNKNOWN"; break;
     }
 
+    // Emulation and rendering run on separate threads, keep each message in one piece.
+    // Writes are synchronous, so the time callers spend here (waiting for the lock included) is the backlog.
+    uint64_t start = metricsClock();
+    flockfile(logFile);
     fprintf(logFile, "[%s] [%s] ", timeStr, levelStr);
     vfprintf(logFile, format, args);
     fprintf(logFile, "\n");
     fflush(logFile);
+    funlockfile(logFile);
+    countLogMessage(metricsClock() - start);
 }
 
 void logError(const char *format, ...) {
@@ -5,21 +5,209 @@
 #include "memory.h"
 #include "logger.h"
 #include "sdl_wrapper.h"
+#include "emulator.h"
+#include "metrics.h"
+#include "framebuffer.h"
+#include "latency.h"
+#include "trace.h"
+#include "debugger.h"
+#include "arena.h"
+#include "video.h"
+#include "rominfo.h"
+#include "calibrate.h"
+#include "playlist.h"
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 void cleanup() {	
+	logFusionStats();
+	logLatencyHistogram();
 	destroyGraphics();
 	cleanupAudio();
 	destroySDL();
 	closeLogger();
 }
 
+void printUsage(const char *program) {
+	printf("Usage: %s [options] <ROM_FILE>\n", program);
+	printf("       %s [options] --playlist <PLAYLIST_FILE>\n", program);
+	printf("Options:\n");
+	printf("  --anti-flicker    Show the OR of the last two frames to hide sprite flicker\n");
+	printf("  --trace <file>    Record every instruction to a binary trace (read it with chip8_trace)\n");
+	printf("  --debug <socket>  Serve a GDB remote protocol debugger on a Unix socket\n");
+	printf("  --run-ahead <N>   Show the game N frames ahead to hide its input lag (0-%d)\n", MAX_RUN_AHEAD_FRAMES);
+	printf("  --timing <mode>   rate (default, about 500 instructions per second) or vip (COSMAC VIP cycle timing)\n");
+	printf("  --ipf <N|auto>    N instructions per 60 Hz frame, or auto to calibrate the ROM once and remember the result\n");
+	printf("  --quirks <list>   Interpreter quirks: vip, schip, xochip, none, or a comma separated list of\n");
+	printf("                    shift-vy, load-store-i, vf-reset, clip, jump-vx (default: as detected by chip8_quirks)\n");
+	printf("  --rominfo <file>  Calibrated ROM settings, by ROM hash (default %s)\n", ROMINFO_DEFAULT_PATH);
+	printf("  --playlist <file> Cycle through the ROMs in a playlist instead of running one (see playlist.h)\n");
+	printf("  --software        Render on the CPU straight into the window, for hosts without a usable GPU\n");
+	printf("  --effect <name>   Software rendering effect: plain (default), scanlines or grid (implies --software)\n");
+	printf("  --turbo           Start in turbo mode, as fast as possible and muted (Tab toggles it)\n");
+	printf("  --metrics <path>  Write performance counters as JSON every second, to a file or to unix:<socket>\n");
+	printf("  --overlay         Start with the metrics overlay on (F1 toggles it)\n");
+	printf("  --record <file>   Write every frame to a 60 fps video, Y4M or raw RGBA if the name ends in .rgba\n");
+}
+
+// Loads the ROM with the quirks and rate stored for it (see rominfo.h), unless the command line chose them.
+// If asked to, a ROM without a stored rate is calibrated first and the result stored.
+static int loadGame(chip8_t *chip8, const char *romPath, const char *romInfoPath, int quirks, bool useStoredRate,
+		bool calibrate, int *instructionsPerFrame) {
+	uint8_t *romData;
+	size_t romSize;
+	if (readROMFile(romPath, &romData, &romSize) != 0) {
+		return -1;
+	}
+	if (loadROMData(chip8, romData, romSize) != 0) {
+		free(romData);
+		return -1;
+	}
+
+	romInfo_t romInfo;
+	uint64_t hash = hashROM(romData, romSize);
+	free(romData);
+	bool known = findRomInfo(romInfoPath, hash, &romInfo);
+	if (quirks < 0 && known && romInfo.quirksKnown) {
+		quirks = romInfo.quirks;
+	}
+	if (quirks >= 0) {
+		char names[128];
+		formatQuirks(names, sizeof(names), quirks);
+		logInfo("Quirks: %s", names);
+		chip8->quirks = quirks; // Before calibrating, the rate depends on them
+	}
+	if (*instructionsPerFrame > 0 || !useStoredRate) {
+		return 0;
+	}
+
+	if (known && romInfo.instructionsPerFrame > 0) {
+		*instructionsPerFrame = romInfo.instructionsPerFrame;
+		logInfo("Using the calibrated rate from %s", romInfoPath);
+	} else if (calibrate) {
+		calibration_t calibration;
+		if (calibrateSpeed(chip8, NULL, &calibration) == 0) {
+			*instructionsPerFrame = calibration.instructionsPerFrame;
+			if (!known) {
+				romInfo = (romInfo_t){ .hash = hash };
+				const char *name = strrchr(romPath, '/');
+				snprintf(romInfo.name, sizeof(romInfo.name), "%s", name ? name + 1 : romPath);
+			}
+			romInfo.instructionsPerFrame = *instructionsPerFrame;
+			saveRomInfo(romInfoPath, &romInfo);
+		} else {
+			printf("Calibration failed, see the log. Running at the default rate\n");
+		}
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
-	if (argc != 2) {
-		printf("Usage: %s <ROM_FILE>\n", argv[0]);
+	const char *romPath = NULL;
+	bool antiFlicker = false;
+	int runAhead = 0;
+	const char *tracePath = NULL;
+	const char *recordPath = NULL;
+	const char *debugSocket = NULL;
+	bool vipTiming = false;
+	bool rateTiming = false;       // --timing rate, a stored calibration isn't used
+	int instructionsPerFrame = 0;  // 0 = whatever is stored for the ROM, else the default rate
+	bool calibrate = false;
+	int quirks = -1;               // -1 = whatever is stored for the ROM
+	const char *romInfoPath = ROMINFO_DEFAULT_PATH;
+	const char *playlistPath = NULL;
+	bool overlay = false;
+	bool turbo = false;
+	bool software = false;
+	scaleEffect_t effect = SCALE_PLAIN;
+	const char *metricsPath = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--anti-flicker") == 0) {
+			antiFlicker = true;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			recordPath = argv[++i];
+		} else if (strcmp(argv[i], "--debug") == 0 && i + 1 < argc) {
+			debugSocket = argv[++i];
+		} else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			metricsPath = argv[++i];
+		} else if (strcmp(argv[i], "--software") == 0) {
+			software = true;
+		} else if (strcmp(argv[i], "--effect") == 0 && i + 1 < argc) {
+			i++;
+			software = true;
+			if (strcmp(argv[i], "scanlines") == 0) {
+				effect = SCALE_SCANLINES;
+			} else if (strcmp(argv[i], "grid") == 0) {
+				effect = SCALE_GRID;
+			} else if (strcmp(argv[i], "plain") != 0) {
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--turbo") == 0) {
+			turbo = true;
+		} else if (strcmp(argv[i], "--overlay") == 0) {
+			overlay = true;
+		} else if (strcmp(argv[i], "--timing") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "vip") == 0) {
+				vipTiming = true;
+			} else if (strcmp(argv[i], "rate") == 0) {
+				rateTiming = true;
+			} else {
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "auto") == 0) {
+				calibrate = true;
+			} else if ((instructionsPerFrame = atoi(argv[i])) < 1) {
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+			if ((quirks = parseQuirks(argv[++i])) < 0) {
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--rominfo") == 0 && i + 1 < argc) {
+			romInfoPath = argv[++i];
+		} else if (strcmp(argv[i], "--playlist") == 0 && i + 1 < argc) {
+			playlistPath = argv[++i];
+		} else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+			runAhead = atoi(argv[++i]);
+			if (runAhead < 0 || runAhead > MAX_RUN_AHEAD_FRAMES) {
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		} else if (argv[i][0] == '-' || romPath) {
+			printUsage(argv[0]);
+			return EXIT_FAILURE;
+		} else {
+			romPath = argv[i];
+		}
+	}
+	if (!romPath == !playlistPath) {
+		printUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (playlistPath && debugSocket) {
+		printf("--playlist can't be combined with --debug\n");
+		return EXIT_FAILURE;
+	}
+	if ((vipTiming || instructionsPerFrame > 0 || calibrate) && (tracePath || debugSocket)) {
+		// Both of those step the machine one instruction at a time on their own schedule
+		printf("--timing vip and --ipf can't be combined with --trace or --debug\n");
+		return EXIT_FAILURE;
+	}
+	if ((vipTiming || rateTiming) && (instructionsPerFrame > 0 || calibrate)) {
+		printf("--ipf can't be combined with --timing\n");
 		return EXIT_FAILURE;
 	}
 	
@@ -28,12 +216,19 @@ int main(int argc, char **argv) {
 	initLogger("logs/chip8_emulator.log");
 	logInfo("CHIP-8 Emulator started");
 
+	if (playlistPath && loadPlaylist(playlistPath) != 0) {
+		printf("Can't use playlist %s, see the log\n", playlistPath);
+		closeLogger();
+		return EXIT_FAILURE;
+	}
+
 	if (initializeSDL() != 0) {
 		logError("Failed to initialize SDL");
 		closeLogger();
 		return EXIT_FAILURE;
 	}
 
+	setSoftwareRendering(software, effect);
 	if (initializeGraphics() != 0) {
 		logError("Failed to initialize graphics");
 		destroySDL();
@@ -41,6 +236,9 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	setAntiFlicker(antiFlicker);
+	setMetricsOverlay(overlay);
+
 	if (initializeAudio() != 0) {
 		logError("Failed to initialize audio");
 		destroyGraphics();
@@ -49,43 +247,105 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	//Create CHIP8 instance
-	chip8_t chip8;
-	initializeCPU(&chip8);
+	//Create CHIP8 instance, its memory is an mmap'd arena (see arena.h).
+	//A playlist brings its own machines and swaps them while the emulator runs
+	chip8_t chip8 = { 0 };
+	chip8_t *machine = &chip8;
+	bool useStoredRate = !vipTiming && !rateTiming && !tracePath && !debugSocket;
+	if (playlistPath) {
+		playlistOptions_t options = {
+			.romInfoPath = romInfoPath,
+			.instructionsPerFrame = instructionsPerFrame,
+			.useStoredRate = useStoredRate,
+			.calibrate = calibrate,
+			.quirks = quirks,
+		};
+		if (startPlaylist(&options, &machine, &instructionsPerFrame) != 0) {
+			logError("Failed to start the playlist");
+			cleanup();
+			return EXIT_FAILURE;
+		}
+		setStopOnFault(false); // A faulting game is just switched early
+	} else {
+		if (allocateMemoryArena(&chip8, CHIP8_MEMORY_SIZE) != 0) {
+			cleanup();
+			return EXIT_FAILURE;
+		}
+		initializeCPU(&chip8);
+		if (loadGame(&chip8, romPath, romInfoPath, quirks, useStoredRate, calibrate, &instructionsPerFrame) != 0) {
+			logError("Failed to load ROM");
+			freeMemoryArena(&chip8);
+			cleanup();
+			return EXIT_FAILURE;
+		}
+	}
 
-	// Load ROM
-	if (loadROM(&chip8, argv[1]) != 0) {
-		logError("Failed to load ROM");
+		
+	// Emulation runs on its own thread and hands frames over through a triple buffer,
+	// this thread only handles input and presents the newest frame once per display refresh.
+	// Every draw since the last refresh ends up in that one present.
+	static framebuffer_t frames;
+	initializeFramebuffer(&frames);
+	setRunAhead(runAhead);
+	setVipTiming(vipTiming);
+	setInstructionsPerFrame(instructionsPerFrame);
+	setTurbo(turbo);
+	static videoSink_t recording;
+	if (recordPath) {
+		size_t length = strlen(recordPath);
+		videoFormat_t format = length > 5 && strcmp(recordPath + length - 5, ".rgba") == 0 ? VIDEO_RGBA : VIDEO_Y4M;
+		if (openVideoSink(&recording, recordPath, format) != 0) {
+			cleanup();
+			return EXIT_FAILURE;
+		}
+		setVideoSink(&recording);
+	}
+	if (tracePath && startTrace(tracePath) != 0) {
+		cleanup();
+		return EXIT_FAILURE;
+	}
+	if (debugSocket && startDebugServer(&chip8, debugSocket) != 0) {
+		stopTrace();
+		cleanup();
+		return EXIT_FAILURE;
+	}
+	if (metricsPath && startMetricsDump(metricsPath) != 0) {
+		stopDebugServer();
+		stopTrace();
+		cleanup();
+		return EXIT_FAILURE;
+	}
+	if (startEmulator(machine, &frames) != 0) {
+		logError("Failed to start emulation thread");
+		stopMetricsDump();
 		cleanup();
 		return EXIT_FAILURE;
 	}
-		
-	// Main emulation loop
-	
-	bool running = true;
-	uint32_t lastCycleTime = SDL_GetTicks();
-	while (running) {
-		handleInput(&chip8, &running);
-
-		//One cycle
-		executeCycle(&chip8);
 
-		//Render if needed
-		
-		if (chip8.drawFlag) {
-			renderGraphics(&chip8);
-			chip8.drawFlag = false;
+	bool running = true;
+	while (running && isEmulatorRunning()) { // The emulation thread stops by itself on a fault
+		handleInput(&running); // Events are polled once per refresh
+		if (playlistPath) {
+			updatePlaylist();
 		}
 
-		// Delay to control emulation speed
-		// This can be made more accurate/done better
-
-		uint32_t currentTime = SDL_GetTicks();
-		uint32_t elapsedTime = currentTime - lastCycleTime;
-		if (elapsedTime < 2 ) {
-			SDL_Delay(2 - elapsedTime);
+		const uint8_t *frame = acquireFrame(&frames);
+		if (frame) {
+			renderFrame(frame); // Blocks until the refresh (vsync or timer paced)
+			recordPresentedFrame(frame);
+		} else {
+			waitForNextRefresh(); // Nothing new to show this refresh
 		}
-		lastCycleTime = currentTime;
+	}
+	stopDebugServer(); // Releases the emulation thread if it is sitting at a breakpoint
+	stopEmulator();
+	stopMetricsDump();
+	stopTrace();
+	closeVideoSink(&recording);
+	if (playlistPath) {
+		stopPlaylist();
+	} else {
+		freeMemoryArena(&chip8);
 	}
 	
 	//Cleanup before exiting
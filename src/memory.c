@@ -26,7 +26,7 @@ static const uint8_t chip8_fontset[CHIP8_FONTSET_SIZE] = {
 };
 
 int initializeMemory(chip8_t *chip8) {
-    memset(chip8->memory, 0, sizeof(chip8->memory)); // Clear memory
+    memset(chip8->memory, 0, chip8->memoryMask + 1u); // Clear memory
 
     //Load fontset into memory (starting at 0x50)
     for (int i = 0; i < CHIP8_FONTSET_SIZE; i++) {
@@ -36,7 +36,7 @@ int initializeMemory(chip8_t *chip8) {
     return 0;
 }
 
-int loadROM(chip8_t *chip, const char *romPath) {
+int readROMFile(const char *romPath, uint8_t **data, size_t *size) {
     FILE *rom = fopen(romPath, "rb");
     if (!rom) {
         fprintf(stderr, "Failed to open ROM: %s\n", romPath);
@@ -45,18 +45,41 @@ int loadROM(chip8_t *chip, const char *romPath) {
 
     //Get size of ROM
     fseek(rom, 0, SEEK_END); // Seek to end of file
-    long romSize = ftell(rom); 
+    long romSize = ftell(rom);
     rewind(rom); // Reset file pointer to beginning of file
 
+    *data = malloc(romSize > 0 ? romSize : 1);
+    if (!*data || romSize < 0 || fread(*data, 1, romSize, rom) != (size_t)romSize) {
+        fprintf(stderr, "Failed to read ROM: %s\n", romPath);
+        free(*data);
+        *data = NULL;
+        fclose(rom);
+        return 1;
+    }
+    fclose(rom);
+    *size = romSize;
+    return 0;
+}
+
+int loadROMData(chip8_t *chip, const uint8_t *data, size_t size) {
     // Can the ROM fit in memory? (Max size after 0x200)
-    if (romSize > (CHIP8_MEMORY_SIZE - CHIP8_START_ADDRESS)) {
-        fprintf(stderr, "ROM too large to fit in memory: %ld bytes\n", romSize);
+    if (size > chip->memoryMask + 1u - CHIP8_START_ADDRESS) {
+        fprintf(stderr, "ROM too large to fit in memory: %zu bytes\n", size);
         return 1; // nope, error
     }
 
     //Load ROM into memory (starting at 0x200)
-    fread(&chip->memory[CHIP8_START_ADDRESS], sizeof(uint8_t), romSize, rom);
-    fclose(rom);
-
+    memcpy(&chip->memory[CHIP8_START_ADDRESS], data, size);
     return 0; //good to go
 }
+
+int loadROM(chip8_t *chip, const char *romPath) {
+    uint8_t *data;
+    size_t size;
+    if (readROMFile(romPath, &data, &size) != 0) {
+        return 1;
+    }
+    int result = loadROMData(chip, data, size);
+    free(data);
+    return result;
+}
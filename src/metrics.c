@@ -0,0 +1,331 @@
+#include "metrics.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// A sleep that overshoots by more than this counts as a late wake
+#define LATE_WAKE_NS 2000000ull
+
+static _Atomic uint64_t instructions = 0;
+static _Atomic uint64_t framesEmulated = 0;
+static _Atomic uint64_t framesPresented = 0;
+static _Atomic uint64_t frameWork[METRICS_BUCKET_COUNT];
+static _Atomic uint64_t presentInterval[METRICS_BUCKET_COUNT];
+static _Atomic uint64_t renderNs = 0;
+static _Atomic uint64_t renderMaxNs = 0;
+static _Atomic uint64_t oversleepNs = 0;
+static _Atomic uint64_t oversleepMaxNs = 0;
+static _Atomic uint64_t lateWakes = 0;
+static _Atomic uint64_t droppedNs = 0;
+static _Atomic uint64_t audioCallbacks = 0;
+static _Atomic uint64_t audioUnderruns = 0;
+static _Atomic uint64_t logMessages = 0;
+static _Atomic uint64_t logBlockedNs = 0;
+static _Atomic uint64_t logBlockedMaxNs = 0;
+
+static uint64_t startTime = 0;
+
+// Dump thread
+static pthread_t dumpThread;
+static bool dumpStarted = false;
+static atomic_bool dumpRunning = false;
+static char dumpPath[PATH_MAX];
+static int listenSocket = -1; // Only in unix: mode
+
+uint64_t metricsClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static void raiseMax(_Atomic uint64_t *counter, uint64_t value) {
+    uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(counter, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Buckets 0-7 hold 0-7 us exactly, after that each power of two 2^e is split into 8 buckets of 2^(e-3)
+static int bucketIndex(uint64_t us) {
+    if (us < 8) {
+        return (int)us;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    int bucket = (exponent - 2) * 8 + (int)((us >> (exponent - 3)) & 7);
+    return bucket < METRICS_BUCKET_COUNT ? bucket : METRICS_BUCKET_COUNT - 1;
+}
+
+static uint64_t bucketUpperBound(int bucket) {
+    if (bucket < 8) {
+        return (uint64_t)bucket + 1;
+    }
+    int exponent = bucket / 8 + 2;
+    return (uint64_t)(8 + bucket % 8 + 1) << (exponent - 3);
+}
+
+static void addToHistogram(_Atomic uint64_t *buckets, uint64_t ns) {
+    add(&buckets[bucketIndex(ns / 1000)], 1);
+}
+
+void countInstructions(uint64_t count) {
+    add(&instructions, count);
+}
+
+void countEmulatedFrame(uint64_t workNs) {
+    add(&framesEmulated, 1);
+    addToHistogram(frameWork, workNs);
+}
+
+void countDroppedTime(uint64_t ns) {
+    add(&droppedNs, ns);
+}
+
+void countOversleep(uint64_t requestedNs, uint64_t sleptNs) {
+    if (sleptNs <= requestedNs) {
+        return;
+    }
+    uint64_t over = sleptNs - requestedNs;
+    add(&oversleepNs, over);
+    raiseMax(&oversleepMaxNs, over);
+    if (over > LATE_WAKE_NS) {
+        add(&lateWakes, 1);
+    }
+}
+
+void countPresent(uint64_t intervalNs, uint64_t renderTimeNs) {
+    add(&framesPresented, 1);
+    if (intervalNs > 0) {
+        addToHistogram(presentInterval, intervalNs);
+    }
+    add(&renderNs, renderTimeNs);
+    raiseMax(&renderMaxNs, renderTimeNs);
+}
+
+void countAudioCallback(uint64_t gapNs, uint64_t bufferNs) {
+    add(&audioCallbacks, 1);
+    // SDL pulls samples, so an underrun shows up as a callback that comes later than the buffer lasts
+    if (gapNs > bufferNs + bufferNs / 2) {
+        add(&audioUnderruns, 1);
+    }
+}
+
+void countLogMessage(uint64_t blockedNs) {
+    add(&logMessages, 1);
+    add(&logBlockedNs, blockedNs);
+    raiseMax(&logBlockedMaxNs, blockedNs);
+}
+
+void getMetrics(metrics_t *metrics) {
+    metrics->timeNs = metricsClock();
+    metrics->instructions = atomic_load_explicit(&instructions, memory_order_relaxed);
+    metrics->framesEmulated = atomic_load_explicit(&framesEmulated, memory_order_relaxed);
+    metrics->framesPresented = atomic_load_explicit(&framesPresented, memory_order_relaxed);
+    for (int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+        metrics->frameWork[i] = atomic_load_explicit(&frameWork[i], memory_order_relaxed);
+        metrics->presentInterval[i] = atomic_load_explicit(&presentInterval[i], memory_order_relaxed);
+    }
+    metrics->renderNs = atomic_load_explicit(&renderNs, memory_order_relaxed);
+    metrics->renderMaxNs = atomic_load_explicit(&renderMaxNs, memory_order_relaxed);
+    metrics->oversleepNs = atomic_load_explicit(&oversleepNs, memory_order_relaxed);
+    metrics->oversleepMaxNs = atomic_load_explicit(&oversleepMaxNs, memory_order_relaxed);
+    metrics->lateWakes = atomic_load_explicit(&lateWakes, memory_order_relaxed);
+    metrics->droppedNs = atomic_load_explicit(&droppedNs, memory_order_relaxed);
+    metrics->audioCallbacks = atomic_load_explicit(&audioCallbacks, memory_order_relaxed);
+    metrics->audioUnderruns = atomic_load_explicit(&audioUnderruns, memory_order_relaxed);
+    metrics->logMessages = atomic_load_explicit(&logMessages, memory_order_relaxed);
+    metrics->logBlockedNs = atomic_load_explicit(&logBlockedNs, memory_order_relaxed);
+    metrics->logBlockedMaxNs = atomic_load_explicit(&logBlockedMaxNs, memory_order_relaxed);
+}
+
+uint64_t metricsPercentileUs(const uint64_t *now, const uint64_t *before, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+        total += now[i] - before[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+        seen += now[i] - before[i];
+        if (seen >= target && seen > 0) {
+            return bucketUpperBound(i);
+        }
+    }
+    return bucketUpperBound(METRICS_BUCKET_COUNT - 1);
+}
+
+int formatMetricsJSON(char *buffer, size_t size, const metrics_t *now, const metrics_t *before) {
+    double seconds = (double)(now->timeNs - before->timeNs) / 1e9;
+    if (seconds <= 0.0) {
+        seconds = 1.0;
+    }
+    uint64_t frames = now->framesEmulated - before->framesEmulated;
+    uint64_t presents = now->framesPresented - before->framesPresented;
+
+    // speed is emulated frames per real frame, below 1.0 the unit isn't keeping up
+    return snprintf(buffer, size,
+        "{\"uptime_s\":%.1f,\"interval_s\":%.3f,"
+        "\"instructions\":%llu,\"ips\":%.0f,\"mips\":%.4f,\"speed\":%.3f,"
+        "\"frames_emulated\":%llu,\"frames_presented\":%llu,\"fps\":%.1f,"
+        "\"frame_work_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu},"
+        "\"present_interval_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu},"
+        "\"render_us\":{\"avg\":%.1f,\"max\":%llu},"
+        "\"oversleep_us\":{\"avg\":%.1f,\"max\":%llu,\"late_wakes\":%llu},"
+        "\"dropped_ms\":%llu,"
+        "\"audio\":{\"callbacks\":%llu,\"underruns\":%llu},"
+        "\"log\":{\"messages\":%llu,\"blocked_us\":%.1f,\"blocked_max_us\":%llu}}\n",
+        startTime ? (double)(now->timeNs - startTime) / 1e9 : 0.0, seconds,
+        (unsigned long long)now->instructions, (double)(now->instructions - before->instructions) / seconds,
+        (double)(now->instructions - before->instructions) / seconds / 1e6,
+        (double)frames / (seconds * 60.0),
+        (unsigned long long)now->framesEmulated, (unsigned long long)now->framesPresented, (double)presents / seconds,
+        (unsigned long long)metricsPercentileUs(now->frameWork, before->frameWork, 50),
+        (unsigned long long)metricsPercentileUs(now->frameWork, before->frameWork, 90),
+        (unsigned long long)metricsPercentileUs(now->frameWork, before->frameWork, 99),
+        (unsigned long long)metricsPercentileUs(now->presentInterval, before->presentInterval, 50),
+        (unsigned long long)metricsPercentileUs(now->presentInterval, before->presentInterval, 90),
+        (unsigned long long)metricsPercentileUs(now->presentInterval, before->presentInterval, 99),
+        presents ? (double)(now->renderNs - before->renderNs) / presents / 1e3 : 0.0,
+        (unsigned long long)(now->renderMaxNs / 1000),
+        frames ? (double)(now->oversleepNs - before->oversleepNs) / frames / 1e3 : 0.0,
+        (unsigned long long)(now->oversleepMaxNs / 1000), (unsigned long long)now->lateWakes,
+        (unsigned long long)(now->droppedNs / 1000000),
+        (unsigned long long)now->audioCallbacks, (unsigned long long)now->audioUnderruns,
+        (unsigned long long)now->logMessages,
+        (double)(now->logBlockedNs - before->logBlockedNs) / 1e3,
+        (unsigned long long)(now->logBlockedMaxNs / 1000));
+}
+
+// Written next to the target and renamed over it, so a reader always gets a whole dump
+static void writeDumpFile(const char *json) {
+    char temporary[PATH_MAX + 8];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", dumpPath);
+    FILE *file = fopen(temporary, "w");
+    if (!file) {
+        return;
+    }
+    bool ok = fputs(json, file) != EOF;
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        rename(temporary, dumpPath);
+    }
+}
+
+static void *dumpLoop(void *data) {
+    (void)data;
+    metrics_t before, now;
+    getMetrics(&before);
+    char json[4096];
+    formatMetricsJSON(json, sizeof(json), &before, &before);
+    uint64_t nextDump = before.timeNs + METRICS_DUMP_INTERVAL_MS * 1000000ull;
+
+    while (atomic_load(&dumpRunning)) {
+        uint64_t clock = metricsClock();
+        if (clock >= nextDump) {
+            getMetrics(&now);
+            formatMetricsJSON(json, sizeof(json), &now, &before);
+            before = now;
+            nextDump += METRICS_DUMP_INTERVAL_MS * 1000000ull;
+            if (nextDump < clock) {
+                nextDump = clock + METRICS_DUMP_INTERVAL_MS * 1000000ull; // Stalled, don't dump in a burst
+            }
+            if (listenSocket < 0) {
+                writeDumpFile(json);
+            }
+            continue;
+        }
+
+        int waitMs = (int)((nextDump - clock) / 1000000) + 1;
+        if (listenSocket < 0) {
+            usleep(waitMs > 100 ? 100000 : waitMs * 1000); // Short naps so stopMetricsDump() doesn't wait long
+            continue;
+        }
+        // Every client gets the latest dump and is disconnected, e.g. `socat - UNIX-CONNECT:<path>`
+        struct pollfd pfd = { listenSocket, POLLIN, 0 };
+        if (poll(&pfd, 1, waitMs > 100 ? 100 : waitMs) > 0) {
+            int client = accept(listenSocket, NULL, NULL);
+            if (client >= 0) {
+                if (send(client, json, strlen(json), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                    logWarning("Metrics client went away before the dump was sent");
+                }
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int openMetricsSocket(const char *socketPath) {
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        logError("Metrics socket path too long: %s", socketPath);
+        return -1;
+    }
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        logError("Failed to create metrics socket");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenSocket, 8) != 0) {
+        logError("Failed to listen on metrics socket %s", socketPath);
+        close(listenSocket);
+        listenSocket = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int startMetricsDump(const char *path) {
+    startTime = metricsClock();
+    bool socketMode = strncmp(path, "unix:", 5) == 0;
+    snprintf(dumpPath, sizeof(dumpPath), "%s", socketMode ? path + 5 : path);
+    if (socketMode && openMetricsSocket(dumpPath) != 0) {
+        return -1;
+    }
+
+    atomic_store(&dumpRunning, true);
+    if (pthread_create(&dumpThread, NULL, dumpLoop, NULL) != 0) {
+        logError("Failed to start metrics thread");
+        atomic_store(&dumpRunning, false);
+        if (listenSocket >= 0) {
+            close(listenSocket);
+            listenSocket = -1;
+            unlink(dumpPath);
+        }
+        return -1;
+    }
+    dumpStarted = true;
+    logInfo("Writing metrics to %s%s every %d ms", socketMode ? "socket " : "", dumpPath, METRICS_DUMP_INTERVAL_MS);
+    return 0;
+}
+
+void stopMetricsDump() {
+    atomic_store(&dumpRunning, false);
+    if (dumpStarted) {
+        pthread_join(dumpThread, NULL);
+        dumpStarted = false;
+    }
+    if (listenSocket >= 0) {
+        close(listenSocket);
+        listenSocket = -1;
+        unlink(dumpPath);
+    }
+}
@@ -0,0 +1,325 @@
+#include "playlist.h"
+#include "emulator.h"
+#include "arena.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "rominfo.h"
+#include "calibrate.h"
+#include "metrics.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The ready games, the one playing and the one just swapped out
+#define PLAYLIST_SLOTS (PLAYLIST_PRELOAD + 2)
+// Rate for the trial run of games without one, about the default rate
+#define CHECK_INSTRUCTIONS_PER_FRAME 9
+
+typedef struct {
+    char romPath[256];
+    char snapshotPath[256];
+    int seconds;
+} playlistEntry_t;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_LOADING,   // The preloader is working on it
+    SLOT_READY,
+    SLOT_PLAYING    // Handed to the emulation thread, until it comes back from takeRetiredMachine()
+} slotState_t;
+
+typedef struct {
+    chip8_t machine;          // Own memory arena, allocated once
+    slotState_t state;
+    int entry;
+    int instructionsPerFrame;
+    uint64_t sequence;        // Order the games were made ready in
+} playlistSlot_t;
+
+static playlistEntry_t entries[PLAYLIST_MAX_ENTRIES];
+static int entryCount = 0;
+static playlistOptions_t options;
+
+// Slot states are shared with the preloader and go through the lock, everything else in a slot belongs to its state's owner
+static playlistSlot_t slots[PLAYLIST_SLOTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_t preloadThread;
+static bool preloadStarted = false;
+static bool stopping = false;
+static bool gaveUp = false;    // Every entry failed in a row, nothing left to try
+static uint64_t readySequence = 0;
+
+// Main thread only
+static playlistSlot_t *playing = NULL;
+static uint64_t switchAt = 0;  // metricsClock() when the playing game's time is up
+static bool swapInFlight = false;
+static bool waitingLogged = false;
+
+int loadPlaylist(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        logError("Failed to open playlist %s", path);
+        return -1;
+    }
+    char line[640];
+    entryCount = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#\n")] = '\0';
+        playlistEntry_t entry = { .seconds = PLAYLIST_DEFAULT_SECONDS };
+        if (sscanf(line, "%255s %d %255s", entry.romPath, &entry.seconds, entry.snapshotPath) < 1) {
+            continue; // Blank or comment
+        }
+        if (entryCount == PLAYLIST_MAX_ENTRIES) {
+            logWarning("Playlist %s has more than %d entries, the rest are ignored", path, PLAYLIST_MAX_ENTRIES);
+            break;
+        }
+        if (entry.seconds < 1) {
+            entry.seconds = PLAYLIST_DEFAULT_SECONDS;
+        }
+        entries[entryCount++] = entry;
+    }
+    fclose(file);
+
+    if (entryCount == 0) {
+        logError("Playlist %s has no entries", path);
+        return -1;
+    }
+    logInfo("Playlist %s: %d entries", path, entryCount);
+    return 0;
+}
+
+// Loads an entry into a slot's machine and checks it. Runs on the preloader thread, the slot is SLOT_LOADING.
+static int prepareSlot(playlistSlot_t *slot, int index, chip8_t *scratch) {
+    const playlistEntry_t *entry = &entries[index];
+    chip8_t *machine = &slot->machine;
+
+    uint8_t *data;
+    size_t size;
+    if (readROMFile(entry->romPath, &data, &size) != 0) {
+        logWarning("Playlist: can't read %s, skipped", entry->romPath);
+        return -1;
+    }
+    initializeCPU(machine);
+    uint64_t hash = hashROM(data, size);
+    int result = loadROMData(machine, data, size);
+    free(data);
+    if (result != 0) {
+        logWarning("Playlist: %s doesn't fit in memory, skipped", entry->romPath);
+        return -1;
+    }
+
+    // Same settings the emulator would pick for the ROM on its own
+    romInfo_t info;
+    bool known = findRomInfo(options.romInfoPath, hash, &info);
+    machine->quirks = options.quirks >= 0 ? options.quirks : known && info.quirksKnown ? info.quirks : 0;
+    slot->instructionsPerFrame = options.instructionsPerFrame;
+    if (slot->instructionsPerFrame == 0 && options.useStoredRate && known) {
+        slot->instructionsPerFrame = info.instructionsPerFrame;
+    }
+    calibration_t calibration;
+    if (slot->instructionsPerFrame == 0 && options.useStoredRate && options.calibrate && calibrateSpeed(machine, NULL, &calibration) == 0) {
+        if (!known) {
+            const char *name = strrchr(entry->romPath, '/');
+            info = (romInfo_t){ .hash = hash };
+            snprintf(info.name, sizeof(info.name), "%s", name ? name + 1 : entry->romPath);
+        }
+        info.instructionsPerFrame = slot->instructionsPerFrame = calibration.instructionsPerFrame;
+        saveRomInfo(options.romInfoPath, &info);
+    }
+
+    // Warm start: the game picks up where the snapshot left it, past its boot and title screen
+    if (entry->snapshotPath[0] && loadSnapshot(machine, entry->snapshotPath) != 0) {
+        logWarning("Playlist: snapshot %s for %s can't be loaded, skipped", entry->snapshotPath, entry->romPath);
+        return -1;
+    }
+
+    // Trial run on a copy, so a broken entry never reaches the screen
+    cloneMachine(scratch, machine);
+    int rate = slot->instructionsPerFrame > 0 ? slot->instructionsPerFrame : CHECK_INSTRUCTIONS_PER_FRAME;
+    for (int frame = 0; frame < PLAYLIST_CHECK_FRAMES && !scratch->fault; frame++) {
+        runFrame(scratch, rate);
+    }
+    if (scratch->fault) {
+        logWarning("Playlist: %s faults (%s at 0x%03X) within %d frames, skipped", entry->romPath,
+                   faultName(scratch->fault), scratch->PC, PLAYLIST_CHECK_FRAMES);
+        return -1;
+    }
+    return 0;
+}
+
+// With the lock held
+static playlistSlot_t *oldestReadySlot() {
+    playlistSlot_t *oldest = NULL;
+    for (int i = 0; i < PLAYLIST_SLOTS; i++) {
+        if (slots[i].state == SLOT_READY && (!oldest || slots[i].sequence < oldest->sequence)) {
+            oldest = &slots[i];
+        }
+    }
+    return oldest;
+}
+
+// With the lock held: a free slot if fewer than PLAYLIST_PRELOAD games are ready or on their way
+static playlistSlot_t *slotToPreload() {
+    playlistSlot_t *freeSlot = NULL;
+    int pending = 0;
+    for (int i = 0; i < PLAYLIST_SLOTS; i++) {
+        if (slots[i].state == SLOT_READY || slots[i].state == SLOT_LOADING) {
+            pending++;
+        } else if (slots[i].state == SLOT_FREE && !freeSlot) {
+            freeSlot = &slots[i];
+        }
+    }
+    return pending < PLAYLIST_PRELOAD ? freeSlot : NULL;
+}
+
+static void *preloadLoop(void *data) {
+    (void)data;
+    chip8_t scratch;
+    bool haveScratch = allocateMemoryArena(&scratch, CHIP8_MEMORY_SIZE) == 0;
+    int nextEntry = 0;
+    int failures = 0;
+
+    pthread_mutex_lock(&lock);
+    if (!haveScratch) {
+        gaveUp = true;
+        pthread_cond_broadcast(&changed);
+    }
+    while (!stopping) {
+        playlistSlot_t *slot = gaveUp ? NULL : slotToPreload();
+        if (!slot) {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+        slot->state = SLOT_LOADING;
+        int index = nextEntry;
+        nextEntry = (nextEntry + 1) % entryCount;
+
+        // File reads, calibration and the trial run happen without the lock
+        pthread_mutex_unlock(&lock);
+        int result = prepareSlot(slot, index, &scratch);
+        pthread_mutex_lock(&lock);
+
+        if (result == 0) {
+            slot->entry = index;
+            slot->sequence = readySequence++;
+            slot->state = SLOT_READY;
+            failures = 0;
+        } else {
+            slot->state = SLOT_FREE;
+            if (++failures >= entryCount) {
+                logError("Playlist: none of the entries can be played");
+                gaveUp = true;
+            }
+        }
+        pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (haveScratch) {
+        freeMemoryArena(&scratch);
+    }
+    return NULL;
+}
+
+static void startPlaying(playlistSlot_t *slot) {
+    playing = slot;
+    switchAt = metricsClock() + (uint64_t)entries[slot->entry].seconds * 1000000000ull;
+    waitingLogged = false;
+    logInfo("Playlist: playing %s for %d s", entries[slot->entry].romPath, entries[slot->entry].seconds);
+}
+
+int startPlaylist(const playlistOptions_t *playlistOptions, chip8_t **first, int *instructionsPerFrame) {
+    options = *playlistOptions;
+    for (int i = 0; i < PLAYLIST_SLOTS; i++) {
+        slots[i].state = SLOT_FREE;
+        if (allocateMemoryArena(&slots[i].machine, CHIP8_MEMORY_SIZE) != 0) {
+            stopPlaylist();
+            return -1;
+        }
+    }
+    stopping = gaveUp = false;
+    if (pthread_create(&preloadThread, NULL, preloadLoop, NULL) != 0) {
+        logError("Failed to start the playlist preloader");
+        stopPlaylist();
+        return -1;
+    }
+    preloadStarted = true;
+
+    // Only the first game is waited for, every later one is ready before it's needed
+    pthread_mutex_lock(&lock);
+    playlistSlot_t *slot;
+    while (!(slot = oldestReadySlot()) && !gaveUp) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    if (slot) {
+        slot->state = SLOT_PLAYING;
+        pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+    if (!slot) {
+        stopPlaylist();
+        return -1;
+    }
+
+    startPlaying(slot);
+    *first = &slot->machine;
+    *instructionsPerFrame = slot->instructionsPerFrame;
+    return 0;
+}
+
+void updatePlaylist() {
+    // The emulation thread has let go of the previous game, its slot can be preloaded again
+    chip8_t *retired = takeRetiredMachine();
+    if (retired) {
+        pthread_mutex_lock(&lock);
+        for (int i = 0; i < PLAYLIST_SLOTS; i++) {
+            if (&slots[i].machine == retired) {
+                slots[i].state = SLOT_FREE;
+            }
+        }
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+        swapInFlight = false;
+    }
+    if (!playing || swapInFlight || (metricsClock() < switchAt && !hasMachineFaulted())) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    playlistSlot_t *slot = oldestReadySlot();
+    if (slot) {
+        slot->state = SLOT_PLAYING;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!slot) {
+        if (!waitingLogged) {
+            logWarning("Playlist: the next game isn't ready, %s keeps playing", entries[playing->entry].romPath);
+            waitingLogged = true;
+        }
+        return;
+    }
+
+    swapMachine(&slot->machine, slot->instructionsPerFrame);
+    swapInFlight = true;
+    startPlaying(slot);
+}
+
+void stopPlaylist() {
+    if (preloadStarted) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+        pthread_join(preloadThread, NULL);
+        preloadStarted = false;
+    }
+    for (int i = 0; i < PLAYLIST_SLOTS; i++) {
+        freeMemoryArena(&slots[i].machine);
+        slots[i].state = SLOT_FREE;
+    }
+    playing = NULL;
+    swapInFlight = false;
+}
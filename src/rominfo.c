@@ -0,0 +1,134 @@
+#include "rominfo.h"
+#include "chip8.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#define ROMINFO_LINE_LENGTH 256
+
+uint64_t hashROM(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Parses one line into info, false for comments, blank lines and anything without a hash
+static bool parseLine(const char *line, romInfo_t *info) {
+    char *end;
+    memset(info, 0, sizeof(*info));
+    info->hash = strtoull(line, &end, 16);
+    if (end == line || (*end != ' ' && *end != '\t' && *end != '\n' && *end != '\0')) {
+        return false;
+    }
+
+    const char *p = end;
+    while (*p && *p != '#' && *p != '\n') {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (strncmp(p, "ipf=", 4) == 0) {
+            info->instructionsPerFrame = atoi(p + 4);
+        } else if (strncmp(p, "quirks=", 7) == 0) {
+            char names[128];
+            size_t length = strcspn(p + 7, " \t#\n");
+            snprintf(names, sizeof(names), "%.*s", (int)length, p + 7);
+            int quirks = parseQuirks(names);
+            info->quirksKnown = quirks >= 0;
+            info->quirks = quirks >= 0 ? quirks : 0;
+        }
+        while (*p && *p != ' ' && *p != '\t' && *p != '#' && *p != '\n') {
+            p++; // Unknown keys are skipped
+        }
+    }
+    if (*p == '#') {
+        p++;
+        while (*p == ' ') {
+            p++;
+        }
+        size_t length = strcspn(p, "\n");
+        if (length >= sizeof(info->name)) {
+            length = sizeof(info->name) - 1;
+        }
+        memcpy(info->name, p, length);
+    }
+    return true;
+}
+
+static void writeLine(FILE *file, const romInfo_t *info) {
+    fprintf(file, "%016" PRIx64, info->hash);
+    if (info->instructionsPerFrame > 0) {
+        fprintf(file, " ipf=%d", info->instructionsPerFrame);
+    }
+    if (info->quirksKnown) {
+        char names[128];
+        formatQuirks(names, sizeof(names), info->quirks);
+        fprintf(file, " quirks=%s", names);
+    }
+    if (info->name[0]) {
+        fprintf(file, " # %s", info->name);
+    }
+    fprintf(file, "\n");
+}
+
+bool findRomInfo(const char *path, uint64_t hash, romInfo_t *info) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (errno != ENOENT) {
+            logWarning("Failed to open ROM info %s: %s", path, strerror(errno));
+        }
+        return false;
+    }
+    char line[ROMINFO_LINE_LENGTH];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        found = parseLine(line, info) && info->hash == hash;
+    }
+    fclose(file);
+    return found;
+}
+
+int saveRomInfo(const char *path, const romInfo_t *info) {
+    char tempPath[512];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE *out = fopen(tempPath, "w");
+    if (!out) {
+        logError("Failed to create %s: %s", tempPath, strerror(errno));
+        return -1;
+    }
+
+    // Every other line is kept as it is, comments included
+    bool written = false;
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[ROMINFO_LINE_LENGTH];
+        romInfo_t existing;
+        while (fgets(line, sizeof(line), in)) {
+            if (parseLine(line, &existing) && existing.hash == info->hash) {
+                if (!written) {
+                    writeLine(out, info);
+                    written = true;
+                }
+            } else {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# ROM settings by image hash, see include/rominfo.h\n");
+    }
+    if (!written) {
+        writeLine(out, info);
+    }
+
+    if (fclose(out) != 0 || rename(tempPath, path) != 0) {
+        logError("Failed to write ROM info %s: %s", path, strerror(errno));
+        remove(tempPath);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "snapshot.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char snapshotMagic[8] = { 'C', '8', 'S', 'N', 'A', 'P', '0', '1' };
+
+// magic + memory size + V + I + PC + stack + SP, DT, ST + keypad + rng + fault + quirks + cycle balance
+#define SNAPSHOT_HEADER_BYTES (8 + 4 + 16 + 2 + 2 + 32 + 3 + 2 + 4 + 1 + 1 + 4)
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (8 * i); }
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+
+int saveSnapshot(const chip8_t *chip8, const char *path) {
+    uint8_t header[SNAPSHOT_HEADER_BYTES];
+    uint8_t *p = header;
+    uint32_t memorySize = chip8->memoryMask + 1u;
+
+    memcpy(p, snapshotMagic, 8); p += 8;
+    put32(p, memorySize); p += 4;
+    memcpy(p, chip8->V, 16); p += 16;
+    put16(p, chip8->I); p += 2;
+    put16(p, chip8->PC); p += 2;
+    for (int i = 0; i < CHIP8_STACK_SIZE; i++, p += 2) {
+        put16(p, chip8->stack[i]);
+    }
+    *p++ = chip8->SP;
+    *p++ = chip8->delay_timer;
+    *p++ = chip8->sound_timer;
+    uint16_t keys = 0;
+    for (int i = 0; i < CHIP8_KEYPAD_SIZE; i++) {
+        keys |= chip8->keypad[i] << i;
+    }
+    put16(p, keys); p += 2;
+    put32(p, chip8->rngState); p += 4;
+    *p++ = chip8->fault;
+    *p++ = chip8->quirks;
+    put32(p, (uint32_t)chip8->cycleBalance); p += 4;
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        logError("Failed to create snapshot %s", path);
+        return -1;
+    }
+    int ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+             fwrite(chip8->display, 1, CHIP8_DISPLAY_SIZE, file) == CHIP8_DISPLAY_SIZE &&
+             fwrite(chip8->memory, 1, memorySize, file) == memorySize;
+    if (fclose(file) != 0 || !ok) {
+        logError("Failed to write snapshot %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+int loadSnapshot(chip8_t *chip8, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        logError("Failed to open snapshot %s", path);
+        return -1;
+    }
+
+    uint8_t header[SNAPSHOT_HEADER_BYTES];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, snapshotMagic, 8) != 0) {
+        logError("%s is not a snapshot", path);
+        fclose(file);
+        return -1;
+    }
+    const uint8_t *p = header + 8;
+    uint32_t memorySize = get32(p); p += 4;
+    if (memorySize != chip8->memoryMask + 1u) {
+        logError("Snapshot %s has %u bytes of memory, the machine has %u", path, memorySize, chip8->memoryMask + 1u);
+        fclose(file);
+        return -1;
+    }
+
+    // Read everything before touching the machine, a short file leaves it as it was
+    uint8_t display[CHIP8_DISPLAY_SIZE];
+    uint8_t *memory = malloc(memorySize);
+    if (!memory) {
+        logError("Out of memory loading snapshot %s", path);
+        fclose(file);
+        return -1;
+    }
+    if (fread(display, 1, CHIP8_DISPLAY_SIZE, file) != CHIP8_DISPLAY_SIZE ||
+        fread(memory, 1, memorySize, file) != memorySize) {
+        logError("Snapshot %s is truncated", path);
+        free(memory);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    memcpy(chip8->V, p, 16); p += 16;
+    chip8->I = get16(p); p += 2;
+    chip8->PC = get16(p); p += 2;
+    for (int i = 0; i < CHIP8_STACK_SIZE; i++, p += 2) {
+        chip8->stack[i] = get16(p);
+    }
+    chip8->SP = *p > CHIP8_STACK_SIZE ? CHIP8_STACK_SIZE : *p; // SP indexes the stack, never trust it
+    p++;
+    chip8->delay_timer = *p++;
+    chip8->sound_timer = *p++;
+    setKeypadState(chip8, get16(p)); p += 2;
+    chip8->rngState = get32(p) | 1; p += 4;
+    chip8->fault = *p++;
+    chip8->quirks = *p++;
+    chip8->cycleBalance = (int32_t)get32(p); p += 4;
+
+    memcpy(chip8->memory, memory, memorySize);
+    free(memory);
+    memcpy(chip8->display, display, CHIP8_DISPLAY_SIZE);
+    chip8->drawFlag = true;
+    chip8->dirtyPages = 0xFFFF; // Everything changed as far as a dirty-state restore is concerned
+    chip8->dirtyRows = 0xFFFFFFFF;
+    return 0;
+}
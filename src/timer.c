@@ -1,6 +1,5 @@
 #include "timer.h"
 #include "chip8.h"
-#include "audio.h"
 
 //Function to update the delay and sound timers
 void updateTimers(chip8_t *chip8) {
@@ -9,11 +8,10 @@ void updateTimers(chip8_t *chip8) {
 		chip8->delay_timer--;
 	}
 
-	// Decrement sound timer if > 0 and playSound() if = 0
+	// Decrement sound timer if > 0
+	// The buzzer itself is driven from the emulation thread (see updateAudio() in emulator.c),
+	// that way speculative run-ahead frames can tick timers without making any noise
 	if (chip8->sound_timer > 0) {
 		chip8->sound_timer--;
 	}
-	if (chip8->sound_timer == 0) {
-		playSound();
-	}
 }
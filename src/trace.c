@@ -0,0 +1,124 @@
+#include "trace.h"
+#include "tracefile.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static traceWriter_t writer;
+static pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool tracing = false;
+static bool fusionBeforeTrace = true; // Records are per instruction, fusion is off while tracing
+
+// One ring per thread, so recording never takes a lock; only flushing a full block does.
+// Every ring is also on a list so stopTrace() can free the ones of threads that are gone.
+typedef struct traceRing {
+    traceRecord_t records[TRACE_BLOCK_RECORDS];
+    uint32_t count;
+    struct traceRing *next;
+} traceRing_t;
+
+static traceRing_t *rings = NULL; // Guarded by writerLock
+static _Thread_local traceRing_t *ring = NULL;
+
+int startTrace(const char *path) {
+    if (openTraceWriter(&writer, path) != 0) {
+        logError("Failed to open trace file: %s", path);
+        return -1;
+    }
+    fusionBeforeTrace = isFusionEnabled();
+    setFusionEnabled(false);
+    atomic_store(&tracing, true);
+    logInfo("Tracing instructions to %s", path);
+    return 0;
+}
+
+bool isTracing() {
+    return atomic_load(&tracing);
+}
+
+// With writerLock held
+static void writeRing(traceRing_t *full) {
+    if (full->count > 0 && writeTraceBlock(&writer, full->records, full->count) != 0) {
+        logError("Failed to write trace block");
+    }
+    full->count = 0;
+}
+
+void flushTrace() {
+    if (!ring || ring->count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&writerLock);
+    writeRing(ring);
+    pthread_mutex_unlock(&writerLock);
+}
+
+int traceCycle(chip8_t *chip8) {
+    if (!ring) {
+        ring = malloc(sizeof(traceRing_t));
+        if (!ring) {
+            logError("Failed to allocate trace buffer, tracing disabled for this thread");
+            atomic_store(&tracing, false);
+            return executeCycle(chip8);
+        }
+        ring->count = 0;
+        pthread_mutex_lock(&writerLock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&writerLock);
+    }
+
+    traceRecord_t *rec = &ring->records[ring->count];
+    uint8_t before[CHIP8_REGISTER_COUNT];
+    memcpy(before, chip8->V, sizeof(before));
+    uint16_t iBefore = chip8->I;
+    rec->pc = chip8->PC;
+    rec->opcode = fetchOpcode(chip8);
+
+    // Memory writes are known from the opcode alone
+    bool isWrite;
+    if (!getMemoryAccess(chip8, rec->opcode, &rec->memAddr, &rec->memLength, &isWrite) || !isWrite) {
+        rec->memLength = 0;
+    }
+
+    int retired = executeCycle(chip8);
+
+    rec->regMask = 0;
+    for (int i = 0; i < CHIP8_REGISTER_COUNT; i++) {
+        if (chip8->V[i] != before[i]) {
+            rec->regMask |= 1 << i;
+        }
+    }
+    memcpy(rec->V, chip8->V, sizeof(rec->V));
+    rec->I = chip8->I;
+    rec->iChanged = chip8->I != iBefore;
+
+    if (++ring->count == TRACE_BLOCK_RECORDS) {
+        flushTrace();
+    }
+    return retired;
+}
+
+void stopTrace() {
+    if (!atomic_exchange(&tracing, false)) {
+        return;
+    }
+    pthread_mutex_lock(&writerLock);
+    // Whatever a thread didn't flush itself still goes into the trace
+    while (rings) {
+        traceRing_t *next = rings->next;
+        writeRing(rings);
+        free(rings);
+        rings = next;
+    }
+    uint64_t records = writer.recordCount;
+    if (closeTraceWriter(&writer) != 0) {
+        logError("Failed to finish trace file");
+    }
+    pthread_mutex_unlock(&writerLock);
+    ring = NULL;
+    setFusionEnabled(fusionBeforeTrace);
+    logInfo("Trace finished, %llu instructions recorded", (unsigned long long)records);
+}
@@ -0,0 +1,354 @@
+#include "tracefile.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Per-record flags, first byte of every encoded record
+#define REC_PC          0x01 // PC is stored (execution did not continue where predictNextPc() said)
+#define REC_OPCODE      0x02 // Opcode is stored (not the same as last time at this PC)
+#define REC_REGS        0x04 // u16 register mask followed by one byte per changed register
+#define REC_I           0x08 // New value of I
+#define REC_MEM         0x10 // u16 address + u8 length of a memory write
+
+// Worst case encoded record: flags + pc + opcode + mask + 16 regs + I + addr + length
+#define MAX_RECORD_BYTES (1 + 2 + 2 + 2 + 16 + 2 + 2 + 1)
+#define CALL_STACK_DEPTH 16
+
+static const char headerMagic[8] = { 'C', '8', 'T', 'R', 'A', 'C', 'E', '1' };
+static const char footerMagic[8] = { 'C', '8', 'T', 'R', 'I', 'D', 'X', '1' };
+static const char blockMagic[4] = { 'B', 'L', 'K', '1' };
+
+// Last opcode seen at each address in the current block, reset per block so blocks decode on their own
+typedef struct {
+    uint16_t pc[4096];
+    uint16_t opcode[4096];
+    uint8_t valid[4096];
+} opcodeCache_t;
+
+// Return addresses of the calls seen so far in the block, the oldest are dropped past 16
+typedef struct {
+    uint16_t address[CALL_STACK_DEPTH];
+    int depth;
+} callStack_t;
+
+// Where execution continues after an instruction unless something unusual happens (a skip, BNNN,
+// a fault): jumps and calls go to their target, returns to the matching call. Writer and reader
+// run the same records through it, so only mispredicted PCs need to be stored.
+static uint16_t predictNextPc(uint16_t pc, uint16_t opcode, callStack_t *calls) {
+    if ((opcode & 0xF000) == 0x1000) {
+        return opcode & 0x0FFF;
+    }
+    if ((opcode & 0xF000) == 0x2000) {
+        if (calls->depth == CALL_STACK_DEPTH) {
+            memmove(calls->address, calls->address + 1, (CALL_STACK_DEPTH - 1) * sizeof(uint16_t));
+            calls->depth--;
+        }
+        calls->address[calls->depth++] = pc + 2;
+        return opcode & 0x0FFF;
+    }
+    if (opcode == 0x00EE && calls->depth > 0) {
+        return calls->address[--calls->depth];
+    }
+    return pc + 2;
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (8 * i); }
+static void put64(uint8_t *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = v >> (8 * i); }
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+static uint64_t get64(const uint8_t *p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+
+static int writeU64(FILE *file, uint64_t v) {
+    uint8_t buf[8];
+    put64(buf, v);
+    return fwrite(buf, 1, 8, file) == 8 ? 0 : -1;
+}
+
+int openTraceWriter(traceWriter_t *writer, const char *path) {
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        return -1;
+    }
+    writer->payload = malloc((size_t)TRACE_BLOCK_RECORDS * MAX_RECORD_BYTES);
+    if (!writer->payload || fwrite(headerMagic, 1, sizeof(headerMagic), writer->file) != sizeof(headerMagic)) {
+        fclose(writer->file);
+        free(writer->payload);
+        return -1;
+    }
+    return 0;
+}
+
+int writeTraceBlock(traceWriter_t *writer, const traceRecord_t *records, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count > TRACE_BLOCK_RECORDS) {
+        return -1;
+    }
+
+    static opcodeCache_t cache; // Only ever used from the thread holding the writer
+    memset(cache.valid, 0, sizeof(cache.valid));
+    callStack_t calls = { .depth = 0 };
+
+    uint8_t *out = writer->payload;
+    uint16_t nextPc = records[0].pc + 1; // Force the first PC of the block to be stored
+    for (uint32_t i = 0; i < count; i++) {
+        const traceRecord_t *rec = &records[i];
+        uint8_t *flags = out++;
+        *flags = 0;
+
+        if (rec->pc != nextPc) {
+            *flags |= REC_PC;
+            put16(out, rec->pc);
+            out += 2;
+        }
+        int slot = rec->pc & 0xFFF;
+        if (!cache.valid[slot] || cache.pc[slot] != rec->pc || cache.opcode[slot] != rec->opcode) {
+            *flags |= REC_OPCODE;
+            put16(out, rec->opcode);
+            out += 2;
+            cache.valid[slot] = 1;
+            cache.pc[slot] = rec->pc;
+            cache.opcode[slot] = rec->opcode;
+        }
+        if (rec->regMask) {
+            *flags |= REC_REGS;
+            put16(out, rec->regMask);
+            out += 2;
+            for (int r = 0; r < 16; r++) {
+                if (rec->regMask & (1 << r)) {
+                    *out++ = rec->V[r];
+                }
+            }
+        }
+        if (rec->iChanged) {
+            *flags |= REC_I;
+            put16(out, rec->I);
+            out += 2;
+        }
+        if (rec->memLength) {
+            *flags |= REC_MEM;
+            put16(out, rec->memAddr);
+            out[2] = rec->memLength;
+            out += 3;
+        }
+        nextPc = predictNextPc(rec->pc, rec->opcode, &calls);
+    }
+
+    if (writer->blockCount == writer->blockCapacity) {
+        uint64_t capacity = writer->blockCapacity ? writer->blockCapacity * 2 : 64;
+        uint64_t *first = realloc(writer->blockFirst, capacity * sizeof(uint64_t));
+        if (!first) {
+            return -1;
+        }
+        writer->blockFirst = first;
+        uint64_t *offset = realloc(writer->blockOffset, capacity * sizeof(uint64_t));
+        if (!offset) {
+            return -1;
+        }
+        writer->blockOffset = offset;
+        writer->blockCapacity = capacity;
+    }
+    writer->blockFirst[writer->blockCount] = writer->recordCount;
+    writer->blockOffset[writer->blockCount] = (uint64_t)ftell(writer->file);
+    writer->blockCount++;
+
+    uint8_t header[20];
+    uint32_t payloadSize = (uint32_t)(out - writer->payload);
+    memcpy(header, blockMagic, 4);
+    put32(header + 4, count);
+    put64(header + 8, writer->recordCount);
+    put32(header + 16, payloadSize);
+    if (fwrite(header, 1, sizeof(header), writer->file) != sizeof(header) ||
+        fwrite(writer->payload, 1, payloadSize, writer->file) != payloadSize) {
+        return -1;
+    }
+    writer->recordCount += count;
+    return 0;
+}
+
+int closeTraceWriter(traceWriter_t *writer) {
+    int result = 0;
+    if (writer->file) {
+        uint64_t indexOffset = (uint64_t)ftell(writer->file);
+        for (uint64_t i = 0; i < writer->blockCount && result == 0; i++) {
+            result |= writeU64(writer->file, writer->blockFirst[i]);
+            result |= writeU64(writer->file, writer->blockOffset[i]);
+        }
+        result |= writeU64(writer->file, writer->blockCount);
+        result |= writeU64(writer->file, indexOffset);
+        if (fwrite(footerMagic, 1, sizeof(footerMagic), writer->file) != sizeof(footerMagic)) {
+            result = -1;
+        }
+        if (fclose(writer->file) != 0) {
+            result = -1;
+        }
+    }
+    free(writer->payload);
+    free(writer->blockFirst);
+    free(writer->blockOffset);
+    memset(writer, 0, sizeof(*writer));
+    return result;
+}
+
+int openTraceReader(traceReader_t *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (!reader->file) {
+        return -1;
+    }
+
+    char magic[8];
+    uint8_t footer[24];
+    if (fread(magic, 1, 8, reader->file) != 8 || memcmp(magic, headerMagic, 8) != 0 ||
+        fseek(reader->file, -24, SEEK_END) != 0 || fread(footer, 1, 24, reader->file) != 24 ||
+        memcmp(footer + 16, footerMagic, 8) != 0) {
+        closeTraceReader(reader);
+        return -1; // Not a trace, or the recorder never wrote its index
+    }
+
+    reader->blockCount = get64(footer);
+    uint64_t indexOffset = get64(footer + 8);
+    reader->blockFirst = malloc((reader->blockCount + 1) * sizeof(uint64_t));
+    reader->blockOffset = malloc((reader->blockCount + 1) * sizeof(uint64_t));
+    if (!reader->blockFirst || !reader->blockOffset || fseek(reader->file, (long)indexOffset, SEEK_SET) != 0) {
+        closeTraceReader(reader);
+        return -1;
+    }
+    for (uint64_t i = 0; i < reader->blockCount; i++) {
+        uint8_t entry[16];
+        if (fread(entry, 1, 16, reader->file) != 16) {
+            closeTraceReader(reader);
+            return -1;
+        }
+        reader->blockFirst[i] = get64(entry);
+        reader->blockOffset[i] = get64(entry + 8);
+    }
+
+    // Total record count comes from the last block's header
+    if (reader->blockCount > 0) {
+        uint8_t header[20];
+        if (fseek(reader->file, (long)reader->blockOffset[reader->blockCount - 1], SEEK_SET) != 0 ||
+            fread(header, 1, sizeof(header), reader->file) != sizeof(header)) {
+            closeTraceReader(reader);
+            return -1;
+        }
+        reader->recordCount = get64(header + 8) + get32(header + 4);
+    }
+    return 0;
+}
+
+uint64_t findTraceBlock(const traceReader_t *reader, uint64_t index) {
+    // Binary search for the last block starting at or before index
+    uint64_t low = 0;
+    uint64_t high = reader->blockCount;
+    while (high - low > 1) {
+        uint64_t mid = (low + high) / 2;
+        if (reader->blockFirst[mid] <= index) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int readTraceBlock(traceReader_t *reader, uint64_t block, traceRecord_t *records) {
+    if (block >= reader->blockCount) {
+        return -1;
+    }
+
+    uint8_t header[20];
+    if (fseek(reader->file, (long)reader->blockOffset[block], SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), reader->file) != sizeof(header) || memcmp(header, blockMagic, 4) != 0) {
+        return -1;
+    }
+    uint32_t count = get32(header + 4);
+    uint64_t first = get64(header + 8);
+    uint32_t payloadSize = get32(header + 16);
+    if (count > TRACE_BLOCK_RECORDS || payloadSize > (uint32_t)TRACE_BLOCK_RECORDS * MAX_RECORD_BYTES) {
+        return -1;
+    }
+
+    // Padded so a truncated last record can't read past the allocation before the length check catches it
+    uint8_t *payload = malloc(payloadSize + MAX_RECORD_BYTES);
+    if (!payload || fread(payload, 1, payloadSize, reader->file) != payloadSize) {
+        free(payload);
+        return -1;
+    }
+    memset(payload + payloadSize, 0, MAX_RECORD_BYTES);
+
+    static opcodeCache_t cache;
+    memset(cache.valid, 0, sizeof(cache.valid));
+    callStack_t calls = { .depth = 0 };
+
+    const uint8_t *in = payload;
+    const uint8_t *end = payload + payloadSize;
+    uint16_t nextPc = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        traceRecord_t *rec = &records[i];
+        memset(rec, 0, sizeof(*rec));
+        rec->index = first + i;
+        if (in >= end) {
+            free(payload);
+            return -1;
+        }
+
+        uint8_t flags = *in++;
+        rec->pc = nextPc;
+        if (flags & REC_PC) {
+            rec->pc = get16(in);
+            in += 2;
+        }
+        int slot = rec->pc & 0xFFF;
+        if (flags & REC_OPCODE) {
+            rec->opcode = get16(in);
+            in += 2;
+            cache.valid[slot] = 1;
+            cache.pc[slot] = rec->pc;
+            cache.opcode[slot] = rec->opcode;
+        } else if (cache.valid[slot] && cache.pc[slot] == rec->pc) {
+            rec->opcode = cache.opcode[slot];
+        } else {
+            free(payload);
+            return -1;
+        }
+        if (flags & REC_REGS) {
+            rec->regMask = get16(in);
+            in += 2;
+            for (int r = 0; r < 16; r++) {
+                if (rec->regMask & (1 << r)) {
+                    rec->V[r] = *in++;
+                }
+            }
+        }
+        if (flags & REC_I) {
+            rec->iChanged = 1;
+            rec->I = get16(in);
+            in += 2;
+        }
+        if (flags & REC_MEM) {
+            rec->memAddr = get16(in);
+            rec->memLength = in[2];
+            in += 3;
+        }
+        if (in > end) {
+            free(payload);
+            return -1;
+        }
+        nextPc = predictNextPc(rec->pc, rec->opcode, &calls);
+    }
+
+    free(payload);
+    return (int)count;
+}
+
+void closeTraceReader(traceReader_t *reader) {
+    if (reader->file) {
+        fclose(reader->file);
+    }
+    free(reader->blockFirst);
+    free(reader->blockOffset);
+    memset(reader, 0, sizeof(*reader));
+}
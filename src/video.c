@@ -0,0 +1,244 @@
+#include "video.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// The AVX2 scaler is compiled on its own and only picked when the CPU has it, see pickExpandLine()
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VIDEO_AVX2 1
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+#define VIDEO_BASE_KERNEL "SSE2"
+#else
+#define VIDEO_BASE_KERNEL "scalar"
+#endif
+
+#define PIXEL_ON  0xFFFFFFFF // White
+#define PIXEL_OFF 0xFF000000 // Opaque black
+// Studio range luma for lit/unlit pixels, chroma is neutral grey
+#define LUMA_ON   235
+#define LUMA_OFF  16
+#define CHROMA    128
+
+// Same colours in either byte order, so these frames are also valid R G B A
+void convertFrameToRGBA(const uint8_t *display, uint32_t *pixels) {
+#ifdef __SSE2__
+    // 16 pixels per step: lit bytes become 0xFF, each byte is widened to a 32-bit all-ones/all-zeros
+    // pixel and OR'd with opaque black
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32((int)PIXEL_OFF);
+    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i += 16) {
+        __m128i lit = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)&display[i]), zero);
+        __m128i low = _mm_unpacklo_epi8(lit, lit);
+        __m128i high = _mm_unpackhi_epi8(lit, lit);
+        _mm_storeu_si128((__m128i *)&pixels[i], _mm_or_si128(_mm_unpacklo_epi16(low, low), alpha));
+        _mm_storeu_si128((__m128i *)&pixels[i + 4], _mm_or_si128(_mm_unpackhi_epi16(low, low), alpha));
+        _mm_storeu_si128((__m128i *)&pixels[i + 8], _mm_or_si128(_mm_unpacklo_epi16(high, high), alpha));
+        _mm_storeu_si128((__m128i *)&pixels[i + 12], _mm_or_si128(_mm_unpackhi_epi16(high, high), alpha));
+    }
+#else
+    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i++) {
+        pixels[i] = display[i] ? PIXEL_ON : PIXEL_OFF;
+    }
+#endif
+}
+
+static void convertFrameToLuma(const uint8_t *display, uint8_t *luma) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i range = _mm_set1_epi8((char)(LUMA_ON - LUMA_OFF));
+    const __m128i black = _mm_set1_epi8(LUMA_OFF);
+    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i += 16) {
+        __m128i lit = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)&display[i]), zero);
+        _mm_storeu_si128((__m128i *)&luma[i], _mm_add_epi8(_mm_and_si128(lit, range), black));
+    }
+#else
+    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i++) {
+        luma[i] = display[i] ? LUMA_ON : LUMA_OFF;
+    }
+#endif
+}
+
+// scale copies of one colour, whole vectors first and the remainder one by one
+static inline void fillPixels(uint32_t *out, uint32_t colour, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i vector = _mm_set1_epi32((int)colour);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *)&out[i], vector);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = colour;
+    }
+}
+
+#ifdef VIDEO_AVX2
+__attribute__((target("avx2")))
+static inline void fillPixelsAVX2(uint32_t *out, uint32_t colour, int count) {
+    int i = 0;
+    const __m256i wide = _mm256_set1_epi32((int)colour);
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i *)&out[i], wide);
+    }
+    if (i + 4 <= count) {
+        _mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(wide));
+        i += 4;
+    }
+    for (; i < count; i++) {
+        out[i] = colour;
+    }
+}
+#endif
+
+typedef void (*fillPixelsFn)(uint32_t *out, uint32_t colour, int count);
+typedef void (*expandLineFn)(const uint8_t *row, uint32_t *line, int scale, uint32_t off, uint32_t on,
+                             uint32_t edgeOff, uint32_t edgeOn, bool grid);
+
+// One display row into one output line. With grid, each pixel's last column gets the dim colour.
+// Inlined into one copy per fill kernel below.
+static inline void expandLineWith(fillPixelsFn fill, const uint8_t *row, uint32_t *line, int scale, uint32_t off,
+                                  uint32_t on, uint32_t edgeOff, uint32_t edgeOn, bool grid) {
+    int width = grid ? scale - 1 : scale;
+    for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++, line += scale) {
+        fill(line, row[x] ? on : off, width);
+        if (grid) {
+            line[scale - 1] = row[x] ? edgeOn : edgeOff;
+        }
+    }
+}
+
+static void expandLine(const uint8_t *row, uint32_t *line, int scale, uint32_t off, uint32_t on,
+                       uint32_t edgeOff, uint32_t edgeOn, bool grid) {
+    expandLineWith(fillPixels, row, line, scale, off, on, edgeOff, edgeOn, grid);
+}
+
+#ifdef VIDEO_AVX2
+__attribute__((target("avx2")))
+static void expandLineAVX2(const uint8_t *row, uint32_t *line, int scale, uint32_t off, uint32_t on,
+                           uint32_t edgeOff, uint32_t edgeOn, bool grid) {
+    expandLineWith(fillPixelsAVX2, row, line, scale, off, on, edgeOff, edgeOn, grid);
+}
+#endif
+
+// Picked on first use, the build doesn't assume the host CPU
+static expandLineFn pickExpandLine(void) {
+#ifdef VIDEO_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        logInfo("Software scaler: AVX2");
+        return expandLineAVX2;
+    }
+#endif
+    logInfo("Software scaler: %s", VIDEO_BASE_KERNEL);
+    return expandLine;
+}
+
+void scaleFrameRows(const uint8_t *display, int firstRow, int rowCount, uint32_t *pixels, int pitch,
+                    int scale, const scalePalette_t *palette, scaleEffect_t effect) {
+    if (scale < 2) {
+        effect = SCALE_PLAIN; // Nothing left to dim
+    }
+    static expandLineFn expand = NULL;
+    if (!expand) {
+        expand = pickExpandLine();
+    }
+    size_t lineBytes = (size_t)CHIP8_DISPLAY_WIDTH * scale * sizeof(uint32_t);
+    int brightLines = effect == SCALE_PLAIN ? scale : scale - 1;
+
+    for (int y = firstRow; y < firstRow + rowCount; y++) {
+        const uint8_t *row = &display[y * CHIP8_DISPLAY_WIDTH];
+        uint32_t *first = pixels + (size_t)y * scale * pitch;
+
+        // Expand once, the other lines of this row are copies
+        expand(row, first, scale, palette->off, palette->on, palette->dimOff, palette->dimOn, effect == SCALE_GRID);
+        for (int line = 1; line < brightLines; line++) {
+            memcpy(first + (size_t)line * pitch, first, lineBytes);
+        }
+        if (effect != SCALE_PLAIN) {
+            uint32_t *last = first + (size_t)(scale - 1) * pitch;
+            expand(row, last, scale, palette->dimOff, palette->dimOn, palette->dimOff, palette->dimOn, false);
+        }
+    }
+}
+
+uint64_t hashFrame(const uint8_t *display) {
+    // Word at a time multiply/xorshift, much faster than a byte-wise hash and good enough to tell frames apart
+    uint64_t hash = 0x243F6A8885A308D3ull;
+    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, &display[i], 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+int openVideoSink(videoSink_t *sink, const char *path, videoFormat_t format) {
+    memset(sink, 0, sizeof(*sink));
+    sink->format = format;
+    // Y4M is 4:2:0, a full size luma plane and two quarter size chroma planes
+    sink->frameSize = format == VIDEO_Y4M ? CHIP8_DISPLAY_SIZE * 3 / 2 : CHIP8_DISPLAY_SIZE * 4;
+    sink->frame = malloc(sink->frameSize);
+    if (!sink->frame) {
+        return -1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        sink->file = stdout;
+    } else {
+        sink->file = fopen(path, "wb");
+        sink->ownsFile = true;
+    }
+    if (!sink->file) {
+        logError("Failed to open video output %s", path);
+        free(sink->frame);
+        return -1;
+    }
+
+    if (format == VIDEO_Y4M) {
+        // The chroma planes never change, only the luma plane is converted per frame
+        memset(sink->frame + CHIP8_DISPLAY_SIZE, CHROMA, CHIP8_DISPLAY_SIZE / 2);
+        fprintf(sink->file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", CHIP8_DISPLAY_WIDTH, CHIP8_DISPLAY_HEIGHT);
+    }
+    return 0;
+}
+
+int writeVideoFrame(videoSink_t *sink, const uint8_t *display) {
+    uint64_t hash = hashFrame(display);
+    if (sink->haveFrame && hash == sink->lastHash) {
+        sink->repeats++; // Nothing changed, the last conversion goes out again
+    } else if (sink->format == VIDEO_Y4M) {
+        convertFrameToLuma(display, sink->frame);
+    } else {
+        convertFrameToRGBA(display, (uint32_t *)sink->frame);
+    }
+    sink->lastHash = hash;
+    sink->haveFrame = true;
+
+    if (sink->format == VIDEO_Y4M && fputs("FRAME\n", sink->file) == EOF) {
+        return -1;
+    }
+    if (fwrite(sink->frame, 1, sink->frameSize, sink->file) != sink->frameSize) {
+        return -1;
+    }
+    sink->frames++;
+    return 0;
+}
+
+void closeVideoSink(videoSink_t *sink) {
+    if (sink->file) {
+        logInfo("Video output: %llu frames, %llu repeats", (unsigned long long)sink->frames, (unsigned long long)sink->repeats);
+        if (sink->ownsFile) {
+            fclose(sink->file);
+        } else {
+            fflush(sink->file);
+        }
+        sink->file = NULL;
+    }
+    free(sink->frame);
+    sink->frame = NULL;
+}
@@ -0,0 +1,91 @@
+#include "viptiming.h"
+#include "timer.h"
+
+// Every instruction goes through the interpreter's fetch and decode first
+#define FETCH_CYCLES 40
+// Extra cycles when a skip instruction skips
+#define SKIP_CYCLES 4
+
+/* Execution cycles per instruction on top of the fetch, approximated from the VIP interpreter's
+   1802 code. They're a table on purpose: tune them here against hardware captures, nothing else
+   depends on the exact numbers.
+*/
+int vipInstructionCycles(uint16_t opcode, bool skipped) {
+    int x = (opcode & 0x0F00) >> 8;
+    int cycles;
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            cycles = opcode == 0x00E0 ? 24 + 4 * 256 : 10; // 00E0 clears 256 display bytes one by one
+            break;
+        case 0x1000: cycles = 12; break;
+        case 0x2000: cycles = 26; break;
+        case 0x3000:
+        case 0x4000: cycles = 10; break;
+        case 0x5000:
+        case 0x9000: cycles = 14; break;
+        case 0x6000: cycles = 6; break;
+        case 0x7000: cycles = 10; break;
+        case 0x8000: cycles = 44; break;
+        case 0xA000: cycles = 12; break;
+        case 0xB000: cycles = 22; break;
+        case 0xC000: cycles = 36; break;
+        case 0xD000: cycles = 26 + 18 * (opcode & 0x000F); break; // Per sprite row, before the vblank wait
+        case 0xE000: cycles = 14; break;
+        case 0xF000:
+            switch (opcode & 0x00FF) {
+                case 0x1E:
+                case 0x29: cycles = 16; break;
+                case 0x33: cycles = 164; break;
+                case 0x55:
+                case 0x65: cycles = 14 + 14 * (x + 1); break; // Per register moved
+                default: cycles = 10; break;
+            }
+            break;
+        default:
+            cycles = 10;
+            break;
+    }
+    return FETCH_CYCLES + cycles + (skipped ? SKIP_CYCLES : 0);
+}
+
+// 3XNN, 4XNN, 5XY0, 9XY0, EX9E and EXA1, the only ones that move PC by 4 without jumping
+static bool isSkip(uint16_t opcode) {
+    switch (opcode & 0xF000) {
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+        case 0xE000:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int runVipFrame(chip8_t *chip8) {
+    int retired = 0;
+    chip8->cycleBalance += VIP_INTERPRETER_CYCLES_PER_FRAME;
+
+    // No fusion here, every instruction has to be charged on its own
+    while (chip8->cycleBalance > 0 && !chip8->fault) {
+        uint16_t pc = chip8->PC;
+        chip8->opcode = fetchOpcode(chip8);
+        decodeAndExecute(chip8, chip8->opcode);
+        retired++;
+
+        chip8->cycleBalance -= vipInstructionCycles(chip8->opcode, isSkip(chip8->opcode) && chip8->PC == (uint16_t)(pc + 4));
+
+        if ((chip8->opcode & 0xF000) == 0xD000) {
+            // The interpreter waits for the display interrupt before drawing, nothing else runs this frame
+            chip8->cycleBalance = 0;
+            break;
+        }
+    }
+
+    // 60 Hz interrupt: timers tick once per frame, however many instructions ran
+    if (!chip8->fault) {
+        updateTimers(chip8);
+    }
+    return retired;
+}
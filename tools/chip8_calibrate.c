@@ -0,0 +1,130 @@
+// chip8_calibrate: finds the instructions per frame each ROM needs and stores it by ROM hash
+//
+// Every ROM runs headless at a range of rates, see calibrate.h for how the rate is picked. Results go
+// into the ROM info file the emulator reads at startup, so a whole ROM collection can be calibrated in
+// one go. ROMs already in the file are skipped unless --force is given.
+
+#include "chip8.h"
+#include "arena.h"
+#include "memory.h"
+#include "keyscript.h"
+#include "calibrate.h"
+#include "rominfo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <ROM>...\n", program);
+    printf("Options:\n");
+    printf("  --rominfo <file>  ROM info file to update (default %s)\n", ROMINFO_DEFAULT_PATH);
+    printf("  --keys <file>     Keypad script, one hex key mask per frame (default: tap each key in turn)\n");
+    printf("  --force           Calibrate ROMs that already have a rate again\n");
+    printf("  --dry-run         Print the results, don't write them\n");
+}
+
+// Returns 0 if the ROM was calibrated or skipped, -1 on failure
+static int calibrateROM(const char *romPath, const char *romInfoPath, const uint16_t *keys, bool force, bool dryRun) {
+    const char *name = strrchr(romPath, '/');
+    name = name ? name + 1 : romPath;
+
+    uint8_t *data;
+    size_t size;
+    if (readROMFile(romPath, &data, &size) != 0) {
+        return -1;
+    }
+    romInfo_t info;
+    uint64_t hash = hashROM(data, size);
+    if (!findRomInfo(romInfoPath, hash, &info)) {
+        info = (romInfo_t){ .hash = hash };
+        snprintf(info.name, sizeof(info.name), "%s", name);
+    } else if (info.instructionsPerFrame > 0 && !force) {
+        printf("%-24s %5d  (already calibrated)\n", name, info.instructionsPerFrame);
+        free(data);
+        return 0;
+    }
+
+    chip8_t machine;
+    if (allocateMemoryArena(&machine, CHIP8_MEMORY_SIZE) != 0) {
+        free(data);
+        return -1;
+    }
+    initializeCPU(&machine);
+    machine.rngState = 1; // Same ROM and keys, same result
+    if (info.quirksKnown) {
+        machine.quirks = info.quirks; // Run it the way it's going to be played
+    }
+    int result = loadROMData(&machine, data, size);
+    free(data);
+
+    calibration_t calibration;
+    if (result == 0 && calibrateSpeed(&machine, keys, &calibration) != 0) {
+        fprintf(stderr, "%s: faults during warm-up or neither waits on the delay timer nor draws\n", name);
+        result = -1;
+    }
+    freeMemoryArena(&machine);
+    if (result != 0) {
+        return -1;
+    }
+
+    printf("%-24s %5d  %-11s %6llu %6llu  %6.2f %6.2f\n", name, calibration.instructionsPerFrame,
+           calibration.timerPaced ? "delay timer" : "drawing",
+           (unsigned long long)calibration.waits, (unsigned long long)calibration.lateWaits,
+           calibration.drawsPerFrame, calibration.referenceDrawsPerFrame);
+    if (dryRun) {
+        return 0;
+    }
+    info.instructionsPerFrame = calibration.instructionsPerFrame;
+    if (saveRomInfo(romInfoPath, &info) != 0) {
+        fprintf(stderr, "Failed to write %s\n", romInfoPath);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *romInfoPath = ROMINFO_DEFAULT_PATH;
+    const char *keysPath = NULL;
+    bool force = false;
+    bool dryRun = false;
+    int firstROM = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rominfo") == 0 && i + 1 < argc) {
+            romInfoPath = argv[++i];
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            keysPath = argv[++i];
+        } else if (strcmp(argv[i], "--force") == 0) {
+            force = true;
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dryRun = true;
+        } else if (argv[i][0] != '-') {
+            firstROM = i;
+            break;
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (firstROM == 0) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint16_t *keys = NULL;
+    if (keysPath && !(keys = loadKeyScript(keysPath, CALIBRATION_TOTAL_FRAMES))) {
+        fprintf(stderr, "Can't read key script %s\n", keysPath);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %5s  %-11s %6s %6s  %6s %6s\n", "rom", "ipf", "paced by", "waits", "late", "draws", "ref");
+    int failed = 0;
+    for (int i = firstROM; i < argc; i++) {
+        failed += calibrateROM(argv[i], romInfoPath, keys, force, dryRun) != 0;
+    }
+    free(keys);
+    if (failed) {
+        fprintf(stderr, "%d of %d ROMs failed\n", failed, argc - firstROM);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,385 @@
+// chip8_fuzz: coverage-guided in-process fuzzer for the CHIP-8 core
+//
+// Mutates ROM bytes and per-frame keypad input, runs every case on one in-process machine and keeps
+// the cases that reach new control flow edges. Between cases the machine is reset with
+// restoreDirtyState(), which only copies back the memory pages and display rows the case touched.
+// Faults (unknown opcodes, stack overflow/underflow, out of range PC or I accesses) are saved as findings,
+// one per fault kind and opcode class (see opcodeClass()) so the same bug hit from many PCs is reported once.
+
+#include "chip8.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define MAX_ROM_SIZE (CHIP8_MEMORY_SIZE - CHIP8_START_ADDRESS)
+#define MAX_FRAMES 600
+#define MAX_CORPUS 4096
+#define COVERAGE_BITS 14
+#define COVERAGE_SIZE (1 << COVERAGE_BITS)
+#define FAULT_KINDS (CHIP8_FAULT_MEMORY_RANGE + 1)
+
+typedef struct {
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t romSize;
+    uint16_t keys[MAX_FRAMES]; // Keypad bitmask held during each frame
+} fuzzCase_t;
+
+typedef struct {
+    uint64_t execs;
+    uint64_t edges;
+    uint64_t findings;
+    int frames;
+    int instructionsPerFrame;
+    const char *findingsDir;
+} fuzzOptions_t;
+
+static fuzzCase_t *corpus;
+static int corpusCount = 0;
+
+static uint8_t caseCoverage[COVERAGE_SIZE];  // Hit counts of the current case, saturating at 255
+static uint16_t caseEdges[COVERAGE_SIZE];    // Entries of caseCoverage the current case touched, so merging doesn't scan the map
+static int caseEdgeCount = 0;
+static uint8_t virginBits[COVERAGE_SIZE];    // Hit count buckets never seen before, starts all ones
+static uint8_t seenFindings[FAULT_KINDS][0x10000]; // Only report each fault kind once per opcode class
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t nextRandom() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static uint32_t randomBelow(uint32_t limit) {
+    return (uint32_t)(nextRandom() % limit);
+}
+
+// Same hit count classes as AFL: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static uint8_t bucketOf(uint8_t hits) {
+    if (hits == 0) return 0;
+    if (hits <= 3) return 1 << (hits - 1);
+    if (hits <= 7) return 8;
+    if (hits <= 15) return 16;
+    if (hits <= 31) return 32;
+    if (hits <= 127) return 64;
+    return 128;
+}
+
+// Merges the case's coverage into the global map and clears it for the next case.
+// Returns true if it hit anything new.
+static bool mergeCoverage(fuzzOptions_t *options) {
+    bool interesting = false;
+    for (int e = 0; e < caseEdgeCount; e++) {
+        int i = caseEdges[e];
+        uint8_t bucket = bucketOf(caseCoverage[i]);
+        if (bucket & virginBits[i]) {
+            if (virginBits[i] == 0xFF) {
+                options->edges++;
+            }
+            virginBits[i] &= ~bucket;
+            interesting = true;
+        }
+        caseCoverage[i] = 0;
+    }
+    caseEdgeCount = 0;
+    return interesting;
+}
+
+// The opcode bits that pick the instruction, operands masked out: 8XY5 and 8AB5 are the same class,
+// 8XY5 and 8XY6 aren't. Unknown opcodes only keep their family, an unknown FXNN is one bug whatever NN
+// is, and most of them are data or zeroed memory executed as code. A PC that ran off the end of memory has opcode 0.
+static uint16_t opcodeClass(chip8Fault_t fault, uint16_t opcode) {
+    if (fault == CHIP8_FAULT_UNKNOWN_OPCODE) {
+        return opcode & 0xF000;
+    }
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            return opcode == 0x00E0 || opcode == 0x00EE ? opcode : 0x0000;
+        case 0x5000:
+        case 0x8000:
+        case 0x9000:
+            return opcode & 0xF00F;
+        case 0xE000:
+        case 0xF000:
+            return opcode & 0xF0FF;
+        default:
+            return opcode & 0xF000;
+    }
+}
+
+static void saveFinding(const fuzzCase_t *testCase, chip8Fault_t fault, uint16_t pc, uint16_t opcode, fuzzOptions_t *options) {
+    uint16_t opcodeKind = opcodeClass(fault, opcode);
+    if (seenFindings[fault][opcodeKind]) {
+        return;
+    }
+    seenFindings[fault][opcodeKind] = 1;
+    options->findings++;
+
+    printf("Finding: %s at 0x%03X (opcode 0x%04X)\n", faultName(fault), pc, opcode);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/fault%d-%04X.ch8", options->findingsDir, (int)fault, opcodeKind);
+    FILE *rom = fopen(path, "wb");
+    if (rom) {
+        fwrite(testCase->rom, 1, testCase->romSize, rom);
+        fclose(rom);
+    }
+    // Keypad script, one hex bitmask per frame
+    snprintf(path, sizeof(path), "%s/fault%d-%04X.keys", options->findingsDir, (int)fault, opcodeKind);
+    FILE *keys = fopen(path, "w");
+    if (keys) {
+        for (int f = 0; f < options->frames; f++) {
+            fprintf(keys, "%04X\n", testCase->keys[f]);
+        }
+        fclose(keys);
+    }
+}
+
+// Runs one case from the base snapshot. Returns the fault it hit, if any.
+static chip8Fault_t runCase(chip8_t *machine, const chip8_t *base, const fuzzCase_t *testCase,
+                            const fuzzOptions_t *options, uint16_t *faultPc, uint16_t *faultOpcode) {
+    restoreDirtyState(machine, base);
+    memcpy(&machine->memory[CHIP8_START_ADDRESS], testCase->rom, testCase->romSize);
+    markMemoryDirty(machine, CHIP8_START_ADDRESS, testCase->romSize);
+
+    uint32_t previous = 0; // caseCoverage was cleared by the previous mergeCoverage()
+
+    for (int frame = 0; frame < options->frames; frame++) {
+        setKeypadState(machine, testCase->keys[frame]);
+        for (int i = 0; i < options->instructionsPerFrame; i++) {
+            uint16_t pc = machine->PC;
+            *faultPc = pc;
+            if (pc >= CHIP8_MEMORY_SIZE - 1) {
+                *faultOpcode = 0;
+                return CHIP8_FAULT_MEMORY_RANGE; // Ran off the end of memory
+            }
+
+            uint16_t opcode = fetchOpcode(machine);
+            uint16_t address;
+            uint8_t length;
+            bool isWrite;
+            *faultOpcode = opcode;
+            if (getMemoryAccess(machine, opcode, &address, &length, &isWrite) && address + length > CHIP8_MEMORY_SIZE) {
+                return CHIP8_FAULT_MEMORY_RANGE;
+            }
+
+            // Edge coverage: hash of (previous PC, this PC)
+            uint32_t current = (pc * 2654435761u) >> (32 - COVERAGE_BITS);
+            uint32_t edge = current ^ previous;
+            if (caseCoverage[edge] == 0) {
+                caseEdges[caseEdgeCount++] = (uint16_t)edge;
+            }
+            if (caseCoverage[edge] < 255) {
+                caseCoverage[edge]++;
+            }
+            previous = current >> 1;
+
+            stepInstruction(machine);
+            if (machine->fault) {
+                return machine->fault;
+            }
+        }
+    }
+    return CHIP8_FAULT_NONE;
+}
+
+// Copies only the part of a case that is in use, the full struct is mostly unused ROM space
+static void copyCase(fuzzCase_t *dst, const fuzzCase_t *src, int frames) {
+    dst->romSize = src->romSize;
+    memcpy(dst->rom, src->rom, src->romSize);
+    memcpy(dst->keys, src->keys, frames * sizeof(uint16_t));
+}
+
+static void mutateCase(fuzzCase_t *testCase, int frames) {
+    int mutations = 1 + randomBelow(4);
+    for (int m = 0; m < mutations; m++) {
+        uint16_t size = testCase->romSize;
+        switch (randomBelow(7)) {
+            case 0: // Flip a bit
+                testCase->rom[randomBelow(size)] ^= 1 << randomBelow(8);
+                break;
+            case 1: // Random byte
+                testCase->rom[randomBelow(size)] = (uint8_t)nextRandom();
+                break;
+            case 2: { // Random instruction, high nibble kept valid so most of them decode
+                uint16_t at = randomBelow(size) & ~1;
+                if (at + 1 < size) {
+                    uint16_t opcode = (uint16_t)nextRandom();
+                    testCase->rom[at] = (uint8_t)(opcode >> 8);
+                    testCase->rom[at + 1] = (uint8_t)opcode;
+                }
+                break;
+            }
+            case 3: { // Copy a chunk within the ROM
+                uint16_t length = 1 + randomBelow(16);
+                uint16_t from = randomBelow(size);
+                uint16_t to = randomBelow(size);
+                if (from + length <= size && to + length <= size) {
+                    memmove(&testCase->rom[to], &testCase->rom[from], length);
+                }
+                break;
+            }
+            case 4: { // Hold a random key combination for a stretch of frames
+                int start = randomBelow(frames);
+                int length = 1 + randomBelow(frames - start);
+                uint16_t keys = randomBelow(4) == 0 ? 0 : (uint16_t)(1 << randomBelow(CHIP8_KEYPAD_SIZE));
+                for (int f = start; f < start + length; f++) {
+                    testCase->keys[f] = keys;
+                }
+                break;
+            }
+            case 5: // Grow the ROM with random bytes
+                if (size < MAX_ROM_SIZE) {
+                    uint16_t grow = 1 + randomBelow(MAX_ROM_SIZE - size < 32 ? MAX_ROM_SIZE - size : 32);
+                    for (uint16_t i = 0; i < grow; i++) {
+                        testCase->rom[size + i] = (uint8_t)nextRandom();
+                    }
+                    testCase->romSize += grow;
+                }
+                break;
+            default: // Shrink the ROM
+                if (size > 2) {
+                    testCase->romSize -= 1 + randomBelow(size / 2);
+                }
+                break;
+        }
+    }
+}
+
+static int addSeed(const char *path) {
+    FILE *rom = fopen(path, "rb");
+    if (!rom || corpusCount == MAX_CORPUS) {
+        if (rom) {
+            fclose(rom);
+        }
+        return -1;
+    }
+    fuzzCase_t *seed = &corpus[corpusCount];
+    memset(seed, 0, sizeof(*seed));
+    seed->romSize = (uint16_t)fread(seed->rom, 1, MAX_ROM_SIZE, rom);
+    bool tooLarge = fgetc(rom) != EOF;
+    fclose(rom);
+    if (seed->romSize < 2 || tooLarge) {
+        return -1;
+    }
+    corpusCount++;
+    return 0;
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <seed ROM>...\n", program);
+    printf("Options:\n");
+    printf("  --execs <n>       Stop after n executions (default: run forever)\n");
+    printf("  --frames <n>      Frames per case, 1-%d (default 10)\n", MAX_FRAMES);
+    printf("  --ipf <n>         Instructions per frame (default 20)\n");
+    printf("  --findings <dir>  Where to save faulting cases (default findings)\n");
+    printf("  --seed <n>        Random seed\n");
+}
+
+int main(int argc, char **argv) {
+    fuzzOptions_t options = { 0, 0, 0, 10, 20, "findings" };
+    uint64_t maxExecs = 0;
+    const char *seeds[64];
+    int seedCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--execs") == 0 && i + 1 < argc) {
+            maxExecs = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            options.instructionsPerFrame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--findings") == 0 && i + 1 < argc) {
+            options.findingsDir = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rngState = strtoull(argv[++i], NULL, 10) | 1;
+        } else if (argv[i][0] != '-' && seedCount < 64) {
+            seeds[seedCount++] = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (seedCount == 0 || options.frames < 1 || options.frames > MAX_FRAMES || options.instructionsPerFrame < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (mkdir(options.findingsDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create findings directory %s\n", options.findingsDir);
+        return EXIT_FAILURE;
+    }
+
+    corpus = malloc(MAX_CORPUS * sizeof(fuzzCase_t));
+    static chip8_t base, machine;
+    fuzzCase_t *testCase = malloc(sizeof(fuzzCase_t));
+    if (!corpus || !testCase ||
+        allocateMemoryArena(&base, CHIP8_MEMORY_SIZE) != 0 || allocateMemoryArena(&machine, CHIP8_MEMORY_SIZE) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // The base snapshot is a freshly reset machine with the fontset but no ROM, cases are laid over it
+    initializeCPU(&base);
+    base.rngState = 1; // Deterministic CXNN so findings reproduce
+    base.dirtyPages = 0;
+    base.dirtyRows = 0;
+    cloneMachine(&machine, &base);
+
+    for (int i = 0; i < seedCount; i++) {
+        if (addSeed(seeds[i]) != 0) {
+            fprintf(stderr, "Skipping seed %s\n", seeds[i]);
+        }
+    }
+    if (corpusCount == 0) {
+        fprintf(stderr, "No usable seeds\n");
+        return EXIT_FAILURE;
+    }
+    memset(virginBits, 0xFF, sizeof(virginBits));
+
+    struct timespec start, lastReport, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lastReport = start;
+
+    while (maxExecs == 0 || options.execs < maxExecs) {
+        copyCase(testCase, &corpus[randomBelow(corpusCount)], options.frames);
+        if (options.execs >= (uint64_t)corpusCount) {
+            mutateCase(testCase, options.frames); // Seeds run once as they are first
+        }
+
+        uint16_t faultPc, faultOpcode;
+        chip8Fault_t fault = runCase(&machine, &base, testCase, &options, &faultPc, &faultOpcode);
+        options.execs++;
+
+        bool interesting = mergeCoverage(&options);
+        if (fault != CHIP8_FAULT_NONE) {
+            saveFinding(testCase, fault, faultPc, faultOpcode, &options);
+        } else if (interesting && corpusCount < MAX_CORPUS) {
+            copyCase(&corpus[corpusCount++], testCase, options.frames);
+        }
+
+        if ((options.execs & 0x3FF) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec != lastReport.tv_sec) {
+                double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+                printf("execs %llu (%.0f/s), corpus %d, edges %llu, findings %llu\n",
+                       (unsigned long long)options.execs, options.execs / elapsed, corpusCount,
+                       (unsigned long long)options.edges, (unsigned long long)options.findings);
+                fflush(stdout);
+                lastReport = now;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Done: %llu execs in %.1f s (%.0f/s), corpus %d, edges %llu, findings %llu\n",
+           (unsigned long long)options.execs, elapsed, options.execs / (elapsed > 0 ? elapsed : 1), corpusCount,
+           (unsigned long long)options.edges, (unsigned long long)options.findings);
+    free(testCase);
+    free(corpus);
+    return EXIT_SUCCESS;
+}
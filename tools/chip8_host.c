@@ -0,0 +1,404 @@
+// chip8_host: runs many headless emulator sessions in one process
+//
+// Each session has its own chip8_t and its own scheduler thread running 60 Hz frames. ROMs are loaded
+// once into a read-only memory image (fontset + program, see arena.h) and every session running that
+// ROM maps the image copy-on-write, so a session only costs the pages it actually writes.
+//
+// Sessions are controlled through a Unix socket with a line based text protocol:
+//
+//   start <rom>              -> ok <id>
+//   stop <id>                -> ok
+//   key <id> <0-F> <down|up> -> ok
+//   snapshot <id> <file>     -> ok             (see snapshot.h for the file format)
+//   restore <id> <file>      -> ok
+//   list                     -> <id> <frames> <state> <rom> per session, then ok
+//   shutdown                 -> ok, then the host stops every session and exits
+//
+// Errors are answered with "error <message>". Clients are served one at a time.
+
+#include "chip8.h"
+#include "arena.h"
+#include "memory.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_SESSIONS 1024
+#define MAX_IMAGES 64
+#define FRAME_NS (1000000000L / 60)
+// Sessions only run the core, they don't need the default 8 MB of stack each
+#define SESSION_STACK_SIZE (64 * 1024)
+
+typedef struct {
+    char path[PATH_MAX]; // Resolved with realpath() so one ROM is one image however it is named
+    memoryImage_t image;
+    int users;
+} romImage_t;
+
+typedef struct {
+    bool used;
+    chip8_t machine;
+    pthread_t thread;
+    pthread_mutex_t lock;      // Held while a frame runs, snapshot and restore take it too
+    atomic_bool running;
+    atomic_uint keys;          // Bit N = key N held, injected by the control socket
+    atomic_uint_fast64_t frames;
+    romImage_t *rom;
+} session_t;
+
+// Only the control thread touches these tables, session threads only see their own session_t
+static session_t sessions[MAX_SESSIONS];
+static romImage_t images[MAX_IMAGES];
+static int instructionsPerFrame = 8; // About the emulator's 500 instructions per second
+static volatile sig_atomic_t quitRequested = 0;
+
+static void onSignal(int sig) {
+    (void)sig;
+    quitRequested = 1;
+}
+
+static romImage_t *acquireImage(const char *romPath) {
+    char path[PATH_MAX];
+    if (!realpath(romPath, path)) {
+        return NULL;
+    }
+
+    romImage_t *slot = NULL;
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        if (images[i].users > 0 && strcmp(images[i].path, path) == 0) {
+            images[i].users++;
+            return &images[i];
+        }
+        if (images[i].users == 0 && !slot) {
+            slot = &images[i];
+        }
+    }
+    if (!slot) {
+        return NULL;
+    }
+
+    // Build the image on a scratch machine: fontset from initializeCPU(), program from loadROM()
+    chip8_t scratch;
+    if (allocateMemoryArena(&scratch, CHIP8_MEMORY_SIZE) != 0) {
+        return NULL;
+    }
+    initializeCPU(&scratch);
+    int result = loadROM(&scratch, path) == 0 ? createMemoryImage(&slot->image, &scratch) : -1;
+    freeMemoryArena(&scratch);
+    if (result != 0) {
+        return NULL;
+    }
+
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->users = 1;
+    return slot;
+}
+
+static void releaseImage(romImage_t *rom) {
+    if (--rom->users == 0) {
+        destroyMemoryImage(&rom->image);
+    }
+}
+
+static void *sessionLoop(void *arg) {
+    session_t *session = arg;
+    chip8_t *machine = &session->machine;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (atomic_load(&session->running)) {
+        pthread_mutex_lock(&session->lock);
+        setKeypadState(machine, (uint16_t)atomic_load(&session->keys));
+        runFrame(machine, instructionsPerFrame); // Timers tick once per 60 Hz session frame
+        pthread_mutex_unlock(&session->lock);
+        atomic_fetch_add(&session->frames, 1);
+
+        if (machine->fault) {
+            break; // The session stays listed with its fault until it is stopped
+        }
+
+        next.tv_nsec += FRAME_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec + 1) {
+            next = now; // Fell far behind (host suspended), don't try to catch up
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    atomic_store(&session->running, false);
+    return NULL;
+}
+
+static int startSession(const char *romPath, char *error, size_t errorSize) {
+    int id = 0;
+    while (id < MAX_SESSIONS && sessions[id].used) {
+        id++;
+    }
+    if (id == MAX_SESSIONS) {
+        snprintf(error, errorSize, "too many sessions");
+        return -1;
+    }
+
+    session_t *session = &sessions[id];
+    session->rom = acquireImage(romPath);
+    if (!session->rom) {
+        snprintf(error, errorSize, "can't load %s", romPath);
+        return -1;
+    }
+    if (allocateMemoryArena(&session->machine, CHIP8_MEMORY_SIZE) != 0) {
+        releaseImage(session->rom);
+        snprintf(error, errorSize, "out of memory");
+        return -1;
+    }
+    // Registers and display are reset first, then the image replaces the freshly cleared memory
+    initializeCPU(&session->machine);
+    session->machine.rngState = (session->machine.rngState ^ ((uint32_t)id * 2654435761u)) | 1;
+    if (mapMemoryImage(&session->machine, &session->rom->image) != 0) {
+        freeMemoryArena(&session->machine);
+        releaseImage(session->rom);
+        snprintf(error, errorSize, "can't map %s", romPath);
+        return -1;
+    }
+
+    pthread_mutex_init(&session->lock, NULL);
+    atomic_store(&session->keys, 0);
+    atomic_store(&session->frames, 0);
+    atomic_store(&session->running, true);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+    int result = pthread_create(&session->thread, &attr, sessionLoop, session);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        pthread_mutex_destroy(&session->lock);
+        freeMemoryArena(&session->machine);
+        releaseImage(session->rom);
+        snprintf(error, errorSize, "can't create session thread");
+        return -1;
+    }
+    session->used = true;
+    return id;
+}
+
+static void stopSession(session_t *session) {
+    atomic_store(&session->running, false);
+    pthread_join(session->thread, NULL);
+    pthread_mutex_destroy(&session->lock);
+    freeMemoryArena(&session->machine);
+    releaseImage(session->rom);
+    session->used = false;
+}
+
+static session_t *findSession(const char *id) {
+    char *end;
+    long n = id ? strtol(id, &end, 10) : -1;
+    if (!id || *end || n < 0 || n >= MAX_SESSIONS || !sessions[n].used) {
+        return NULL;
+    }
+    return &sessions[n];
+}
+
+static int takeSnapshot(session_t *session, const char *path) {
+    // Copy the machine between frames and write the copy, the session doesn't wait for the disk
+    chip8_t copy;
+    if (allocateMemoryArena(&copy, session->machine.memoryMask + 1u) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&session->lock);
+    cloneMachine(&copy, &session->machine);
+    pthread_mutex_unlock(&session->lock);
+    int result = saveSnapshot(&copy, path);
+    freeMemoryArena(&copy);
+    return result;
+}
+
+// Runs one command, returns false when the host should shut down
+static bool handleCommand(char *line, FILE *reply) {
+    char *command = strtok(line, " \t\r\n");
+    char *arg1 = strtok(NULL, " \t\r\n");
+    char *arg2 = strtok(NULL, " \t\r\n");
+    char *arg3 = strtok(NULL, " \t\r\n");
+    session_t *session;
+
+    if (!command) {
+        return true;
+    }
+    if (strcmp(command, "start") == 0 && arg1) {
+        char error[128];
+        int id = startSession(arg1, error, sizeof(error));
+        if (id < 0) {
+            fprintf(reply, "error %s\n", error);
+        } else {
+            fprintf(reply, "ok %d\n", id);
+        }
+    } else if (strcmp(command, "stop") == 0) {
+        if (!(session = findSession(arg1))) {
+            fprintf(reply, "error no such session\n");
+        } else {
+            stopSession(session);
+            fprintf(reply, "ok\n");
+        }
+    } else if (strcmp(command, "key") == 0) {
+        char *end = NULL;
+        long key = arg2 ? strtol(arg2, &end, 16) : -1;
+        if (!(session = findSession(arg1))) {
+            fprintf(reply, "error no such session\n");
+        } else if (!arg2 || *end || key < 0 || key > 0xF || !arg3 ||
+                   (strcmp(arg3, "down") != 0 && strcmp(arg3, "up") != 0)) {
+            fprintf(reply, "error usage: key <id> <0-F> <down|up>\n");
+        } else if (strcmp(arg3, "down") == 0) {
+            atomic_fetch_or(&session->keys, 1u << key);
+            fprintf(reply, "ok\n");
+        } else {
+            atomic_fetch_and(&session->keys, ~(1u << key));
+            fprintf(reply, "ok\n");
+        }
+    } else if (strcmp(command, "snapshot") == 0 || strcmp(command, "restore") == 0) {
+        if (!(session = findSession(arg1))) {
+            fprintf(reply, "error no such session\n");
+        } else if (!arg2) {
+            fprintf(reply, "error usage: %s <id> <file>\n", command);
+        } else if (command[0] == 's') {
+            fprintf(reply, takeSnapshot(session, arg2) == 0 ? "ok\n" : "error can't write snapshot\n");
+        } else {
+            // Restoring into a stopped (faulted) session doesn't restart it, stop and start it instead
+            pthread_mutex_lock(&session->lock);
+            int result = loadSnapshot(&session->machine, arg2);
+            pthread_mutex_unlock(&session->lock);
+            fprintf(reply, result == 0 ? "ok\n" : "error can't load snapshot\n");
+        }
+    } else if (strcmp(command, "list") == 0) {
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            if (!sessions[i].used) {
+                continue;
+            }
+            const char *state = atomic_load(&sessions[i].running) ? "running" : "faulted";
+            fprintf(reply, "%d %llu %s %s\n", i, (unsigned long long)atomic_load(&sessions[i].frames), state, sessions[i].rom->path);
+        }
+        fprintf(reply, "ok\n");
+    } else if (strcmp(command, "shutdown") == 0) {
+        fprintf(reply, "ok\n");
+        return false;
+    } else {
+        fprintf(reply, "error unknown command\n");
+    }
+    return true;
+}
+
+static int openControlSocket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <socket>\n", program);
+    printf("Options:\n");
+    printf("  --ipf <n>    Instructions per frame for every session (default 8)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *socketPath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            instructionsPerFrame = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !socketPath) {
+            socketPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!socketPath || instructionsPerFrame < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // No SA_RESTART, so a signal breaks out of accept() and the host shuts down cleanly
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up mid-reply shouldn't kill every session
+
+    int listener = openControlSocket(socketPath);
+    if (listener < 0) {
+        return EXIT_FAILURE;
+    }
+    printf("Listening on %s\n", socketPath);
+
+    bool running = true;
+    while (running && !quitRequested) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        // Separate streams for each direction, one stream can't switch between reading and writing on a socket
+        int replyFd = dup(client);
+        FILE *requests = fdopen(client, "r");
+        FILE *replies = replyFd >= 0 ? fdopen(replyFd, "w") : NULL;
+        if (!requests || !replies) {
+            if (requests) fclose(requests); else close(client);
+            if (replies) fclose(replies); else if (replyFd >= 0) close(replyFd);
+            continue;
+        }
+
+        char line[PATH_MAX + 64];
+        while (running && !quitRequested && fgets(line, sizeof(line), requests)) {
+            running = handleCommand(line, replies);
+            fflush(replies);
+        }
+        fclose(requests);
+        fclose(replies);
+    }
+
+    // Tell every session to stop before joining any, so they all wind down in the same frame
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        atomic_store(&sessions[i].running, false);
+    }
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used) {
+            stopSession(&sessions[i]);
+        }
+    }
+    close(listener);
+    unlink(socketPath);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,353 @@
+// chip8_quirks: works out which interpreter quirks a ROM was written for
+//
+// The ROM is loaded once and the machine forked into one copy per quirk combination (see chip8Quirk_t,
+// 32 of them). The copies run in parallel threads with the same scripted input, and every frame's display
+// hash is folded into one hash per run. Runs with the same hash and fault behaved the same, so the
+// combinations fall into a few groups, and a quirk the ROM never exercises makes no difference at all.
+//
+// Picking the group is a heuristic, the tool can't see the screen:
+//   - runs that fault (unknown opcode, stack over/underflow, memory access out of range) are out
+//   - groups holding one of the well known profiles (none, vip, schip, xochip) beat groups that don't
+//   - then the group whose display changed on the most frames, a wrong quirk tends to leave a game stuck
+//   - then profile order: none, vip, schip, xochip
+// The winning profile is recorded in the ROM info file the emulator reads at startup.
+
+#include "chip8.h"
+#include "arena.h"
+#include "memory.h"
+#include "timer.h"
+#include "video.h"
+#include "keyscript.h"
+#include "rominfo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_IPF 15 // When the ROM hasn't been calibrated
+
+// Known profiles in order of preference, "none" is the emulator's own behaviour
+static const struct {
+    const char *name;
+    uint8_t quirks;
+} profiles[] = {
+    { "none", 0 },
+    { "vip", CHIP8_QUIRKS_VIP },
+    { "schip", CHIP8_QUIRKS_SCHIP },
+    { "xochip", CHIP8_QUIRKS_XOCHIP },
+};
+#define PROFILE_COUNT (int)(sizeof(profiles) / sizeof(profiles[0]))
+
+typedef struct {
+    uint64_t outcome;      // Every frame's display hash folded together
+    int changes;           // Frames whose display differed from the one before
+    chip8Fault_t fault;
+    int faultFrame;
+    uint16_t faultPc;
+    uint16_t faultOpcode;
+    int group;             // Lowest combination with the same outcome
+} variant_t;
+
+// Shared by the workers, read only apart from nextVariant and each worker's own variants
+static const chip8_t *loaded;
+static const uint16_t *keys;
+static int frames;
+static int instructionsPerFrame;
+static variant_t variants[CHIP8_QUIRK_COMBINATIONS];
+static atomic_int nextVariant;
+
+// Same stepping as runFrame(), one instruction at a time so out of range accesses are caught before they happen
+static void runVariant(chip8_t *machine, uint8_t quirks, variant_t *variant) {
+    cloneMachine(machine, loaded);
+    machine->quirks = quirks;
+    *variant = (variant_t){ .outcome = 0xCBF29CE484222325ull };
+    uint64_t previous = hashFrame(machine->display);
+
+    for (int frame = 0; frame < frames; frame++) {
+        setKeypadState(machine, keys[frame]);
+        for (int i = 0; i < instructionsPerFrame && !machine->fault; i++) {
+            uint16_t opcode = fetchOpcode(machine);
+            uint16_t address;
+            uint8_t length;
+            bool isWrite;
+            if (machine->PC > machine->memoryMask - 1u ||
+                (getMemoryAccess(machine, opcode, &address, &length, &isWrite) && address + length > machine->memoryMask + 1u)) {
+                raiseFault(machine, CHIP8_FAULT_MEMORY_RANGE);
+                break;
+            }
+            machine->opcode = opcode;
+            decodeAndExecute(machine, opcode);
+        }
+        if (machine->fault) {
+            variant->fault = machine->fault;
+            variant->faultFrame = frame;
+            variant->faultPc = machine->PC;
+            variant->faultOpcode = fetchOpcode(machine);
+            break;
+        }
+        updateTimers(machine);
+
+        uint64_t hash = hashFrame(machine->display);
+        variant->changes += hash != previous;
+        variant->outcome = (variant->outcome ^ hash) * 0x100000001B3ull;
+        previous = hash;
+    }
+}
+
+static void *worker(void *data) {
+    (void)data;
+    chip8_t machine;
+    if (allocateMemoryArena(&machine, loaded->memoryMask + 1u) != 0) {
+        return NULL;
+    }
+    int index;
+    while ((index = atomic_fetch_add(&nextVariant, 1)) < CHIP8_QUIRK_COMBINATIONS) {
+        runVariant(&machine, (uint8_t)index, &variants[index]);
+    }
+    freeMemoryArena(&machine);
+    return NULL;
+}
+
+// Index into profiles[], -1 if the combination isn't a known profile
+static int profileOf(int quirks) {
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        if (profiles[p].quirks == quirks) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Best known profile in a group, PROFILE_COUNT if there is none
+static int bestProfileInGroup(int group) {
+    int best = PROFILE_COUNT;
+    for (int q = 0; q < CHIP8_QUIRK_COMBINATIONS; q++) {
+        int profile = profileOf(q);
+        if (variants[q].group == group && profile >= 0 && profile < best) {
+            best = profile;
+        }
+    }
+    return best;
+}
+
+// Ranking between two groups that ran without faulting, see the top of the file. 0 = as good as each other
+static int compareGroups(int group, int other) {
+    int profile = bestProfileInGroup(group);
+    int otherProfile = bestProfileInGroup(other);
+    if ((profile < PROFILE_COUNT) != (otherProfile < PROFILE_COUNT)) {
+        return profile < PROFILE_COUNT ? 1 : -1;
+    }
+    if (variants[group].changes != variants[other].changes) {
+        return variants[group].changes > variants[other].changes ? 1 : -1;
+    }
+    return 0;
+}
+
+static int countBits(int value) {
+    int count = 0;
+    for (; value; value &= value - 1) {
+        count++;
+    }
+    return count;
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <ROM>\n", program);
+    printf("Options:\n");
+    printf("  --rominfo <file>  ROM info file to update (default %s)\n", ROMINFO_DEFAULT_PATH);
+    printf("  --keys <file>     Keypad script, one hex key mask per frame (default: tap each key in turn)\n");
+    printf("  --frames <n>      Frames to run every combination for (default %d)\n", DEFAULT_FRAMES);
+    printf("  --ipf <n>         Instructions per frame (default: the calibrated rate, else %d)\n", DEFAULT_IPF);
+    printf("  --threads <n>     Worker threads (default: one per CPU)\n");
+    printf("  --dry-run         Print the result, don't write it\n");
+}
+
+int main(int argc, char **argv) {
+    const char *romInfoPath = ROMINFO_DEFAULT_PATH;
+    const char *keysPath = NULL;
+    const char *romPath = NULL;
+    int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool dryRun = false;
+    frames = DEFAULT_FRAMES;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rominfo") == 0 && i + 1 < argc) {
+            romInfoPath = argv[++i];
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            keysPath = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            instructionsPerFrame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threadCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dryRun = true;
+        } else if (argv[i][0] != '-' && !romPath) {
+            romPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!romPath || frames < 1 || instructionsPerFrame < 0) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (threadCount > CHIP8_QUIRK_COMBINATIONS) {
+        threadCount = CHIP8_QUIRK_COMBINATIONS;
+    }
+
+    uint8_t *data;
+    size_t size;
+    if (readROMFile(romPath, &data, &size) != 0) {
+        return EXIT_FAILURE;
+    }
+    romInfo_t info;
+    uint64_t hash = hashROM(data, size);
+    if (!findRomInfo(romInfoPath, hash, &info)) {
+        const char *name = strrchr(romPath, '/');
+        info = (romInfo_t){ .hash = hash };
+        snprintf(info.name, sizeof(info.name), "%s", name ? name + 1 : romPath);
+    }
+    if (instructionsPerFrame == 0) {
+        instructionsPerFrame = info.instructionsPerFrame > 0 ? info.instructionsPerFrame : DEFAULT_IPF;
+    }
+
+    static chip8_t base;
+    if (allocateMemoryArena(&base, CHIP8_MEMORY_SIZE) != 0) {
+        return EXIT_FAILURE;
+    }
+    initializeCPU(&base);
+    base.rngState = 1; // Every combination gets the same random numbers
+    int result = loadROMData(&base, data, size);
+    free(data);
+    uint16_t *script = loadKeyScript(keysPath, frames);
+    if (result != 0 || !script) {
+        if (!script) {
+            fprintf(stderr, "Can't read key script %s\n", keysPath);
+        }
+        return EXIT_FAILURE;
+    }
+    if (!keysPath) {
+        for (int f = 0; f < frames; f++) {
+            script[f] = keyTapMask(f);
+        }
+    }
+    loaded = &base;
+    keys = script;
+
+    pthread_t threads[CHIP8_QUIRK_COMBINATIONS];
+    for (int t = 0; t < threadCount; t++) {
+        if (pthread_create(&threads[t], NULL, worker, NULL) != 0) {
+            threadCount = t; // Whoever did start picks up the rest
+            break;
+        }
+    }
+    if (threadCount == 0) {
+        worker(NULL);
+    }
+    for (int t = 0; t < threadCount; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(script);
+    freeMemoryArena(&base);
+
+    // Group identical outcomes
+    for (int q = 0; q < CHIP8_QUIRK_COMBINATIONS; q++) {
+        variants[q].group = q;
+        for (int other = 0; other < q; other++) {
+            if (variants[other].outcome == variants[q].outcome && variants[other].fault == variants[q].fault &&
+                variants[other].faultFrame == variants[q].faultFrame) {
+                variants[q].group = variants[other].group;
+                break;
+            }
+        }
+    }
+
+    printf("%s: %d combinations, %d frames at %d instructions per frame\n", romPath, CHIP8_QUIRK_COMBINATIONS, frames, instructionsPerFrame);
+    printf("%-5s %-6s %-8s %-44s %s\n", "group", "combos", "changes", "outcome", "profiles");
+    for (int group = 0; group < CHIP8_QUIRK_COMBINATIONS; group++) {
+        if (variants[group].group != group) {
+            continue;
+        }
+        const variant_t *variant = &variants[group];
+        int members = 0;
+        char names[64] = "";
+        for (int q = 0; q < CHIP8_QUIRK_COMBINATIONS; q++) {
+            if (variants[q].group == group) {
+                members++;
+                if (profileOf(q) >= 0) {
+                    size_t length = strlen(names);
+                    snprintf(names + length, sizeof(names) - length, "%s%s", length ? "," : "", profiles[profileOf(q)].name);
+                }
+            }
+        }
+        char outcome[64];
+        if (variant->fault) {
+            snprintf(outcome, sizeof(outcome), "%s at 0x%03X (0x%04X), frame %d", faultName(variant->fault),
+                     variant->faultPc, variant->faultOpcode, variant->faultFrame + 1);
+        } else {
+            snprintf(outcome, sizeof(outcome), "ran, hash %016llx", (unsigned long long)variant->outcome);
+        }
+        printf("%-5d %-6d %-8d %-44s %s\n", group, members, variant->changes, outcome, names[0] ? names : "-");
+    }
+
+    // Pick the winning group, profile order breaks ties
+    int winner = -1;
+    bool ambiguous = false;
+    for (int group = 0; group < CHIP8_QUIRK_COMBINATIONS; group++) {
+        if (variants[group].group != group || variants[group].fault) {
+            continue;
+        }
+        int order = winner < 0 ? 1 : compareGroups(group, winner);
+        if (order > 0 || (order == 0 && bestProfileInGroup(group) < bestProfileInGroup(winner))) {
+            ambiguous = winner >= 0 && order == 0;
+            winner = group;
+        } else if (order == 0) {
+            ambiguous = true;
+        }
+    }
+    if (winner < 0) {
+        fprintf(stderr, "Every combination faults, nothing to record\n");
+        return EXIT_FAILURE;
+    }
+
+    // The group's profile, or the combination in it that changes the fewest quirks
+    int winnerProfile = bestProfileInGroup(winner);
+    int chosen = winnerProfile < PROFILE_COUNT ? profiles[winnerProfile].quirks : -1;
+    for (int q = 0; winnerProfile == PROFILE_COUNT && q < CHIP8_QUIRK_COMBINATIONS; q++) {
+        if (variants[q].group == winner && (chosen < 0 || countBits(q) < countBits(chosen))) {
+            chosen = q;
+        }
+    }
+
+    // The quirks this run actually depends on, flipping any of them lands in another group
+    char chosenNames[128], dependsOn[128] = "";
+    formatQuirks(chosenNames, sizeof(chosenNames), chosen);
+    for (int bit = 0; bit < CHIP8_QUIRK_COUNT; bit++) {
+        if (variants[chosen ^ (1 << bit)].group != winner) {
+            size_t length = strlen(dependsOn);
+            snprintf(dependsOn + length, sizeof(dependsOn) - length, "%s%s", length ? ", " : "", quirkName(1 << bit));
+        }
+    }
+    printf("Inferred: %s (%s), depends on: %s%s\n", winnerProfile < PROFILE_COUNT ? profiles[winnerProfile].name : "custom",
+           chosenNames, dependsOn[0] ? dependsOn : "nothing", ambiguous ? " (ambiguous, other groups did as well)" : "");
+
+    if (dryRun) {
+        return EXIT_SUCCESS;
+    }
+    info.quirksKnown = true;
+    info.quirks = chosen;
+    if (saveRomInfo(romInfoPath, &info) != 0) {
+        fprintf(stderr, "Failed to write %s\n", romInfoPath);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+// chip8_record: runs a ROM headless and records it as 60 fps video
+//
+// No SDL and no real-time pacing, frames are emulated and written as fast as the disk or the pipe takes
+// them. Output is Y4M (playable and encodable as is) or raw RGBA, see video.h. Optional keypad input
+// comes from a script with one hex key mask per frame, the same format chip8_fuzz saves with findings.
+
+#include "chip8.h"
+#include "arena.h"
+#include "memory.h"
+#include "video.h"
+#include "keyscript.h"
+#include "viptiming.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <ROM>\n", program);
+    printf("Options:\n");
+    printf("  -o <file>         Output file, - for stdout (default)\n");
+    printf("  --format <fmt>    y4m (default) or rgba\n");
+    printf("  --frames <n>      Frames to record (default 600, 10 seconds)\n");
+    printf("  --ipf <n>         Instructions per frame (default 8)\n");
+    printf("  --timing vip      COSMAC VIP cycle timing instead of a fixed --ipf\n");
+    printf("  --keys <file>     Keypad script, one hex key mask per frame\n");
+}
+
+int main(int argc, char **argv) {
+    const char *outputPath = "-";
+    const char *keysPath = NULL;
+    const char *romPath = NULL;
+    videoFormat_t format = VIDEO_Y4M;
+    int frames = 600;
+    int instructionsPerFrame = 8;
+    bool vipTiming = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "y4m") == 0) {
+                format = VIDEO_Y4M;
+            } else if (strcmp(argv[i], "rgba") == 0) {
+                format = VIDEO_RGBA;
+            } else {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            instructionsPerFrame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timing") == 0 && i + 1 < argc && strcmp(argv[i + 1], "vip") == 0) {
+            vipTiming = true;
+            i++;
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            keysPath = argv[++i];
+        } else if (argv[i][0] != '-' && !romPath) {
+            romPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!romPath || frames < 1 || instructionsPerFrame < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    chip8_t machine;
+    if (allocateMemoryArena(&machine, CHIP8_MEMORY_SIZE) != 0) {
+        return EXIT_FAILURE;
+    }
+    initializeCPU(&machine);
+    machine.rngState = 1; // Same ROM and keys, same video
+    if (loadROM(&machine, romPath) != 0) {
+        return EXIT_FAILURE;
+    }
+    uint16_t *keys = loadKeyScript(keysPath, frames);
+    if (!keys) {
+        fprintf(stderr, "Can't read key script %s\n", keysPath);
+        return EXIT_FAILURE;
+    }
+
+    videoSink_t sink;
+    if (openVideoSink(&sink, outputPath, format) != 0) {
+        fprintf(stderr, "Can't open %s\n", outputPath);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_SUCCESS;
+    for (int f = 0; f < frames; f++) {
+        setKeypadState(&machine, keys[f]);
+        if (vipTiming) {
+            runVipFrame(&machine);
+        } else {
+            executeCycles(&machine, instructionsPerFrame);
+        }
+        if (writeVideoFrame(&sink, machine.display) != 0) {
+            fprintf(stderr, "Failed to write frame %d\n", f);
+            result = EXIT_FAILURE;
+            break;
+        }
+        if (machine.fault) {
+            // The rest of the video would be a frozen frame, stop here instead
+            fprintf(stderr, "CHIP-8 fault: %s at 0x%03X after %d frames\n", faultName(machine.fault), machine.PC, f + 1);
+            break;
+        }
+    }
+
+    fprintf(stderr, "%llu frames, %llu repeats\n", (unsigned long long)sink.frames, (unsigned long long)sink.repeats);
+    closeVideoSink(&sink);
+    free(keys);
+    freeMemoryArena(&machine);
+    return result;
+}
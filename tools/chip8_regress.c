@@ -0,0 +1,469 @@
+// chip8_regress: golden-hash regression suite for the core
+//
+// Runs every ROM in a manifest headless, with scripted keypad input, for a fixed number of frames.
+// At each checkpoint frame it hashes the display and the machine state (registers, stack, timers
+// and memory) and compares them with the committed golden file. All ROMs run in parallel.
+//
+// Manifest, one ROM per line, paths relative to the manifest:
+//
+//   # name   rom              frames  ipf  keys           checkpoints
+//   alu      roms/alu.hex     10      100  -              1,10
+//
+// ipf is instructions per frame, run through runFrame() like --ipf, or "vip" to schedule the ROM with
+// COSMAC VIP cycle timing (viptiming.h). Every entry runs twice, with superinstruction fusion on and off,
+// and both runs have to end up with the same hashes at every checkpoint. ipf entries also step a fused
+// and an unfused copy of the machine in lockstep: after every fused sequence the unfused copy steps the
+// same number of instructions one by one and both have to be in the same state.
+// A ROM is a .ch8 binary or a .hex text file (hex bytes, # comments). A ROM that isn't there fails its
+// entry, the suite is only a gate if every entry ran; --skip-missing skips them instead for a quick
+// local run without the standard test ROMs. Golden files live in golden/<name>.golden
+// next to the manifest, --update writes them from the current core.
+
+#include "chip8.h"
+#include "arena.h"
+#include "memory.h"
+#include "video.h"
+#include "keyscript.h"
+#include "viptiming.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_ENTRIES 256
+#define MAX_CHECKPOINTS 32
+#define MAX_THREADS 64
+
+typedef enum {
+    RESULT_PASS,
+    RESULT_FAIL,
+    RESULT_SKIP,
+    RESULT_UPDATED
+} result_t;
+
+typedef struct {
+    char name[64];
+    char romPath[PATH_MAX];
+    char keysPath[PATH_MAX];   // Empty for no input
+    char goldenPath[PATH_MAX];
+    int frames;
+    int instructionsPerFrame;  // 0 for VIP timing
+    int checkpoints[MAX_CHECKPOINTS];
+    int checkpointCount;
+
+    // Filled in by the worker, [0] with fusion on, [1] with it off
+    uint64_t displayHash[2][MAX_CHECKPOINTS];
+    uint64_t stateHash[2][MAX_CHECKPOINTS];
+    result_t result;
+    char message[PATH_MAX + 64];
+} regressEntry_t;
+
+static regressEntry_t entries[MAX_ENTRIES];
+
+static int entryCount = 0;
+static atomic_int nextEntry = 0;
+static bool updateGoldens = false;
+static bool skipMissing = false;
+static int pass = 0;  // 0 runs everything fused, 1 unfused, setFusionEnabled() is global so they can't overlap
+
+static void setMessage(regressEntry_t *entry, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->message, sizeof(entry->message), format, args);
+    va_end(args);
+}
+
+// FNV-1a, plenty for a few KB of state per checkpoint
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static uint64_t hashState(const chip8_t *chip8) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint8_t registers[8] = {
+        (uint8_t)chip8->I, (uint8_t)(chip8->I >> 8), (uint8_t)chip8->PC, (uint8_t)(chip8->PC >> 8),
+        chip8->SP, chip8->delay_timer, chip8->sound_timer, chip8->fault
+    };
+    hash = hashBytes(hash, chip8->V, sizeof(chip8->V));
+    hash = hashBytes(hash, registers, sizeof(registers));
+    hash = hashBytes(hash, chip8->stack, sizeof(chip8->stack));
+    return hashBytes(hash, chip8->memory, chip8->memoryMask + 1u);
+}
+
+// Hex text ROM: pairs of hex digits, whitespace anywhere, '#' comments to the end of the line
+static int loadHexROM(chip8_t *chip8, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    uint32_t address = CHIP8_START_ADDRESS;
+    int high = -1;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+        } else if (isxdigit(c)) {
+            int nibble = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+            if (high < 0) {
+                high = nibble;
+            } else if (address > chip8->memoryMask) {
+                fclose(file);
+                return -1; // Doesn't fit
+            } else {
+                writeMemory(chip8, address++, (uint8_t)(high << 4 | nibble));
+                high = -1;
+            }
+        }
+    }
+    fclose(file);
+    return high < 0 ? 0 : -1; // An odd number of digits is a typo
+}
+
+static int readGolden(const regressEntry_t *entry, int *frames, uint64_t *displayHash, uint64_t *stateHash) {
+    FILE *file = fopen(entry->goldenPath, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[256];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) && count < MAX_CHECKPOINTS) {
+        unsigned long long display, state;
+        if (line[0] != '#' && sscanf(line, "%d %llx %llx", &frames[count], &display, &state) == 3) {
+            displayHash[count] = display;
+            stateHash[count] = state;
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static void writeGolden(regressEntry_t *entry) {
+    FILE *file = fopen(entry->goldenPath, "w");
+    if (!file) {
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "can't write %s", entry->goldenPath);
+        return;
+    }
+    fprintf(file, "# frame display-hash state-hash\n");
+    for (int i = 0; i < entry->checkpointCount; i++) {
+        fprintf(file, "%d %016llx %016llx\n", entry->checkpoints[i],
+                (unsigned long long)entry->displayHash[0][i], (unsigned long long)entry->stateHash[0][i]);
+    }
+    fclose(file);
+    entry->result = RESULT_UPDATED;
+}
+
+static void compareGolden(regressEntry_t *entry) {
+    int frames[MAX_CHECKPOINTS];
+    uint64_t displayHash[MAX_CHECKPOINTS], stateHash[MAX_CHECKPOINTS];
+    int count = readGolden(entry, frames, displayHash, stateHash);
+    if (count < 0) {
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "no golden file, run with --update");
+        return;
+    }
+    if (count != entry->checkpointCount) {
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "golden file has %d checkpoints, manifest has %d", count, entry->checkpointCount);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (frames[i] != entry->checkpoints[i]) {
+            entry->result = RESULT_FAIL;
+            setMessage(entry, "golden checkpoint %d is frame %d, manifest says %d", i, frames[i], entry->checkpoints[i]);
+            return;
+        }
+        // Only the first mismatch is reported, everything after it usually follows from it
+        if (displayHash[i] != entry->displayHash[0][i] || stateHash[i] != entry->stateHash[0][i]) {
+            entry->result = RESULT_FAIL;
+            setMessage(entry, "frame %d: %s", frames[i],
+                     displayHash[i] != entry->displayHash[0][i] ? (stateHash[i] != entry->stateHash[0][i] ? "display and state differ" : "display differs") : "state differs");
+            return;
+        }
+    }
+    entry->result = RESULT_PASS;
+}
+
+static void runEntry(regressEntry_t *entry) {
+    if (pass > 0 && entry->result != RESULT_PASS) {
+        return; // Skipped or already failed in the fused pass
+    }
+    if (access(entry->romPath, R_OK) != 0) {
+        entry->result = skipMissing ? RESULT_SKIP : RESULT_FAIL;
+        setMessage(entry, "%s not found", entry->romPath);
+        return;
+    }
+
+    chip8_t machine;
+    if (allocateMemoryArena(&machine, CHIP8_MEMORY_SIZE) != 0) {
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "out of memory");
+        return;
+    }
+    initializeCPU(&machine);
+    machine.rngState = 1; // CXNN has to give the same numbers on every run
+
+    size_t length = strlen(entry->romPath);
+    bool isHex = length > 4 && strcmp(entry->romPath + length - 4, ".hex") == 0;
+    uint16_t *keys = loadKeyScript(entry->keysPath[0] ? entry->keysPath : NULL, entry->frames);
+    if ((isHex ? loadHexROM(&machine, entry->romPath) : loadROM(&machine, entry->romPath)) != 0 || !keys) {
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "can't load %s", keys ? entry->romPath : entry->keysPath);
+        free(keys);
+        freeMemoryArena(&machine);
+        return;
+    }
+
+    // Superinstruction fusion has to be invisible, a fused and an unfused copy stepped side by side catch
+    // a fused form that gets it wrong right where it ran. The hashed machine itself runs whole frames.
+    chip8_t fused, unfused;
+    bool lockstep = entry->instructionsPerFrame > 0 && pass == 0;
+    bool haveFused = lockstep && allocateMemoryArena(&fused, CHIP8_MEMORY_SIZE) == 0;
+    bool haveUnfused = haveFused && allocateMemoryArena(&unfused, CHIP8_MEMORY_SIZE) == 0;
+    if (lockstep && !haveUnfused) {
+        if (haveFused) {
+            freeMemoryArena(&fused);
+        }
+        entry->result = RESULT_FAIL;
+        setMessage(entry, "out of memory");
+        free(keys);
+        freeMemoryArena(&machine);
+        return;
+    }
+    if (lockstep) {
+        cloneMachine(&fused, &machine);
+        cloneMachine(&unfused, &machine);
+    }
+
+    // A fault freezes the machine, the checkpoints after it still get hashed (and the fault is in the state)
+    int checkpoint = 0;
+    uint64_t instructions = 0;
+    bool diverged = false;
+    for (int frame = 1; frame <= entry->frames && !diverged; frame++) {
+        setKeypadState(&machine, keys[frame - 1]);
+        if (entry->instructionsPerFrame == 0) {
+            runVipFrame(&machine);
+        } else {
+            runFrame(&machine, entry->instructionsPerFrame);
+        }
+        if (lockstep) {
+            setKeypadState(&fused, keys[frame - 1]);
+            setKeypadState(&unfused, keys[frame - 1]);
+        }
+        // At most one fused sequence at a time, so each one is checked right after it ran
+        for (int retired = 0; lockstep && retired < entry->instructionsPerFrame && !fused.fault && !diverged; ) {
+            uint16_t pc = fused.PC;
+            int left = entry->instructionsPerFrame - retired;
+            int count = executeCycles(&fused, left < 3 ? left : 3);
+            retired += count;
+            instructions += count;
+            for (int i = 0; i < count && !unfused.fault; i++) {
+                stepInstruction(&unfused);
+            }
+            if (hashState(&fused) != hashState(&unfused) || memcmp(fused.display, unfused.display, CHIP8_DISPLAY_SIZE) != 0) {
+                entry->result = RESULT_FAIL;
+                setMessage(entry, "frame %d: fused and unfused runs differ after the %d instruction(s) at 0x%03X (instruction %llu)",
+                           frame, count, pc, (unsigned long long)instructions);
+                diverged = true;
+            }
+        }
+        while (checkpoint < entry->checkpointCount && entry->checkpoints[checkpoint] == frame) {
+            entry->displayHash[pass][checkpoint] = hashFrame(machine.display);
+            entry->stateHash[pass][checkpoint] = hashState(&machine);
+            checkpoint++;
+        }
+    }
+    free(keys);
+    freeMemoryArena(&machine);
+    if (lockstep) {
+        freeMemoryArena(&fused);
+        freeMemoryArena(&unfused);
+    }
+
+    if (diverged || pass == 0) {
+        return; // Neither the golden nor the run can be trusted, or the unfused run is still to come
+    }
+    for (int i = 0; i < entry->checkpointCount; i++) {
+        if (entry->displayHash[0][i] != entry->displayHash[1][i] || entry->stateHash[0][i] != entry->stateHash[1][i]) {
+            entry->result = RESULT_FAIL;
+            setMessage(entry, "frame %d: fused and unfused runs differ", entry->checkpoints[i]);
+            return;
+        }
+    }
+    if (updateGoldens) {
+        writeGolden(entry);
+    } else {
+        compareGolden(entry);
+    }
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    int index;
+    while ((index = atomic_fetch_add(&nextEntry, 1)) < entryCount) {
+        runEntry(&entries[index]);
+    }
+    return NULL;
+}
+
+// Path relative to the manifest's directory
+static void resolvePath(char *out, size_t size, const char *directory, const char *path) {
+    if (path[0] == '/') {
+        snprintf(out, size, "%s", path);
+    } else {
+        snprintf(out, size, "%s/%s", directory, path);
+    }
+}
+
+static int loadManifest(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open manifest %s\n", path);
+        return -1;
+    }
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash = strrchr(directory, '/');
+    if (slash) {
+        *slash = '\0';
+    } else {
+        strcpy(directory, ".");
+    }
+
+    char line[1024];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char name[64], rom[512], timing[16], keys[512], checkpoints[512];
+        int frames;
+        int fields = sscanf(line, "%63s %511s %d %15s %511s %511s", name, rom, &frames, timing, keys, checkpoints);
+        if (fields <= 0) {
+            continue; // Blank or comment
+        }
+        int ipf = strcmp(timing, "vip") == 0 ? 0 : atoi(timing);
+        if (fields != 6 || frames < 1 || (ipf < 1 && strcmp(timing, "vip") != 0) || entryCount == MAX_ENTRIES) {
+            fprintf(stderr, "%s:%d: bad manifest line\n", path, lineNumber);
+            fclose(file);
+            return -1;
+        }
+
+        regressEntry_t *entry = &entries[entryCount++];
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        resolvePath(entry->romPath, sizeof(entry->romPath), directory, rom);
+        if (strcmp(keys, "-") != 0) {
+            resolvePath(entry->keysPath, sizeof(entry->keysPath), directory, keys);
+        }
+        snprintf(entry->goldenPath, sizeof(entry->goldenPath), "%s/golden/%s.golden", directory, name);
+        entry->frames = frames;
+        entry->instructionsPerFrame = ipf;
+
+        // Checkpoints must be increasing and inside the run
+        for (char *token = strtok(checkpoints, ","); token; token = strtok(NULL, ",")) {
+            int frame = atoi(token);
+            int previous = entry->checkpointCount ? entry->checkpoints[entry->checkpointCount - 1] : 0;
+            if (frame <= previous || frame > frames || entry->checkpointCount == MAX_CHECKPOINTS) {
+                fprintf(stderr, "%s:%d: bad checkpoint %s\n", path, lineNumber, token);
+                fclose(file);
+                return -1;
+            }
+            entry->checkpoints[entry->checkpointCount++] = frame;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [options] <manifest>\n", program);
+    printf("Options:\n");
+    printf("  --update     Write golden files from the current core instead of checking them\n");
+    printf("  --jobs <n>   Worker threads (default: one per CPU)\n");
+    printf("  --skip-missing  Skip entries whose ROM isn't there instead of failing them\n");
+}
+
+int main(int argc, char **argv) {
+    const char *manifestPath = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update") == 0) {
+            updateGoldens = true;
+        } else if (strcmp(argv[i], "--skip-missing") == 0) {
+            skipMissing = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atol(argv[++i]);
+        } else if (argv[i][0] != '-' && !manifestPath) {
+            manifestPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!manifestPath || jobs < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (loadManifest(manifestPath) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (jobs > MAX_THREADS) {
+        jobs = MAX_THREADS;
+    }
+    if (jobs > entryCount) {
+        jobs = entryCount > 0 ? entryCount : 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < 2; pass++) {
+        setFusionEnabled(pass == 0);
+        atomic_store(&nextEntry, 0);
+        pthread_t threads[MAX_THREADS];
+        int started = 0;
+        for (int i = 0; i < jobs; i++) {
+            if (pthread_create(&threads[started], NULL, worker, NULL) == 0) {
+                started++;
+            }
+        }
+        if (started == 0) {
+            worker(NULL); // No threads, run everything here
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    setFusionEnabled(true);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    static const char *resultNames[] = { "PASS", "FAIL", "SKIP", "UPDATED" };
+    int counts[4] = { 0 };
+    for (int i = 0; i < entryCount; i++) {
+        regressEntry_t *entry = &entries[i];
+        counts[entry->result]++;
+        if (entry->message[0]) {
+            printf("%-7s %s: %s\n", resultNames[entry->result], entry->name, entry->message);
+        } else {
+            printf("%-7s %s\n", resultNames[entry->result], entry->name);
+        }
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d passed, %d failed, %d skipped, %d updated in %.3f s\n",
+           counts[RESULT_PASS], counts[RESULT_FAIL], counts[RESULT_SKIP], counts[RESULT_UPDATED], seconds);
+    return counts[RESULT_FAIL] ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+// chip8_trace: offline analysis of instruction traces recorded with `chip8_emulator --trace`
+
+#include "tracefile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define ADDRESS_SPACE 4096
+#define TOP_LOOPS 10
+#define HEATMAP_CELL 16 // Bytes per heatmap cell, 16 x 16 cells per row of 256 bytes
+
+typedef struct {
+    uint16_t from;  // Only records with from <= PC <= to are considered
+    uint16_t to;
+    uint64_t start; // First record index to look at
+    uint64_t count; // How many records to look at (0 = all)
+} traceFilter_t;
+
+static void printUsage(const char *program) {
+    printf("Usage: %s <command> [options] <trace> [trace2]\n", program);
+    printf("Commands:\n");
+    printf("  dump <trace>       Print records\n");
+    printf("  stats <trace>      Instruction counts, hottest loops and memory heatmaps\n");
+    printf("  diff <a> <b>       Find the first record where two traces diverge\n");
+    printf("Options:\n");
+    printf("  --from <addr>      Only records with PC >= addr (hex, dump and stats)\n");
+    printf("  --to <addr>        Only records with PC <= addr (hex, dump and stats)\n");
+    printf("  --start <n>        Start at record n\n");
+    printf("  --count <n>        Look at n records at most\n");
+}
+
+static void printRecord(const traceRecord_t *rec) {
+    printf("%10llu  %03X: %04X", (unsigned long long)rec->index, rec->pc, rec->opcode);
+    for (int r = 0; r < 16; r++) {
+        if (rec->regMask & (1 << r)) {
+            printf("  V%X=%02X", r, rec->V[r]);
+        }
+    }
+    if (rec->iChanged) {
+        printf("  I=%03X", rec->I);
+    }
+    if (rec->memLength) {
+        printf("  mem[%03X..%03X]", rec->memAddr, rec->memAddr + rec->memLength - 1);
+    }
+    printf("\n");
+}
+
+static bool inFilter(const traceFilter_t *filter, const traceRecord_t *rec) {
+    if (rec->index < filter->start) {
+        return false;
+    }
+    if (filter->count && rec->index >= filter->start + filter->count) {
+        return false;
+    }
+    return rec->pc >= filter->from && rec->pc <= filter->to;
+}
+
+// Calls visit() for every record in the filter window, seeking straight to the first relevant block
+static int forEachRecord(const char *path, const traceFilter_t *filter,
+                         void (*visit)(const traceRecord_t *rec, void *context), void *context) {
+    traceReader_t reader;
+    if (openTraceReader(&reader, path) != 0) {
+        fprintf(stderr, "Can't read trace: %s\n", path);
+        return -1;
+    }
+    traceRecord_t *records = malloc(TRACE_BLOCK_RECORDS * sizeof(traceRecord_t));
+    if (!records) {
+        closeTraceReader(&reader);
+        return -1;
+    }
+
+    uint64_t end = filter->count ? filter->start + filter->count : reader.recordCount;
+    for (uint64_t block = findTraceBlock(&reader, filter->start); block < reader.blockCount; block++) {
+        if (reader.blockFirst[block] >= end) {
+            break;
+        }
+        int count = readTraceBlock(&reader, block, records);
+        if (count < 0) {
+            fprintf(stderr, "Corrupt trace block %llu in %s\n", (unsigned long long)block, path);
+            free(records);
+            closeTraceReader(&reader);
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (inFilter(filter, &records[i])) {
+                visit(&records[i], context);
+            }
+        }
+    }
+
+    free(records);
+    closeTraceReader(&reader);
+    return 0;
+}
+
+static void dumpRecord(const traceRecord_t *rec, void *context) {
+    (void)context;
+    printRecord(rec);
+}
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t byClass[16];          // By high nibble of the opcode
+    uint64_t executed[ADDRESS_SPACE];
+    uint64_t written[ADDRESS_SPACE];
+    uint64_t loopHeads[ADDRESS_SPACE]; // Times execution jumped backwards to this address
+    bool havePrevious;
+    uint16_t previousPc;
+} traceStats_t;
+
+static void countRecord(const traceRecord_t *rec, void *context) {
+    traceStats_t *stats = context;
+    stats->instructions++;
+    stats->byClass[rec->opcode >> 12]++;
+    stats->executed[rec->pc & 0xFFF]++;
+    for (int i = 0; i < rec->memLength; i++) {
+        stats->written[(rec->memAddr + i) & 0xFFF]++;
+    }
+    // A backwards (or same address) transfer closes one iteration of the loop starting at the target
+    if (stats->havePrevious && rec->pc <= stats->previousPc) {
+        stats->loopHeads[rec->pc & 0xFFF]++;
+    }
+    stats->havePrevious = true;
+    stats->previousPc = rec->pc;
+}
+
+static void printHeatmap(const char *title, const uint64_t *counts) {
+    static const char shades[] = " .:-=+*#%@";
+    uint64_t cells[ADDRESS_SPACE / HEATMAP_CELL] = { 0 };
+    uint64_t hottest = 0;
+    for (int i = 0; i < ADDRESS_SPACE; i++) {
+        cells[i / HEATMAP_CELL] += counts[i];
+    }
+    for (int i = 0; i < ADDRESS_SPACE / HEATMAP_CELL; i++) {
+        if (cells[i] > hottest) {
+            hottest = cells[i];
+        }
+    }
+
+    printf("\n%s (each column is %d bytes, '@' = %llu)\n", title, HEATMAP_CELL, (unsigned long long)hottest);
+    for (int row = 0; row < ADDRESS_SPACE / (HEATMAP_CELL * 16); row++) {
+        printf("  %03X |", row * HEATMAP_CELL * 16);
+        for (int col = 0; col < 16; col++) {
+            uint64_t value = cells[row * 16 + col];
+            int shade = (value == 0 || hottest == 0) ? 0 : 1 + (int)((value * 8) / hottest);
+            putchar(shades[shade]);
+        }
+        printf("|\n");
+    }
+}
+
+static int printStats(const char *path, const traceFilter_t *filter) {
+    traceStats_t *stats = calloc(1, sizeof(traceStats_t));
+    if (!stats || forEachRecord(path, filter, countRecord, stats) != 0) {
+        free(stats);
+        return -1;
+    }
+
+    printf("Instructions: %llu\n\nBy opcode class:\n", (unsigned long long)stats->instructions);
+    for (int i = 0; i < 16; i++) {
+        if (stats->byClass[i]) {
+            printf("  %XXXX  %12llu  %5.1f%%\n", i, (unsigned long long)stats->byClass[i],
+                   100.0 * stats->byClass[i] / stats->instructions);
+        }
+    }
+
+    printf("\nHottest loops (target address: iterations):\n");
+    for (int n = 0; n < TOP_LOOPS; n++) {
+        int best = -1;
+        for (int i = 0; i < ADDRESS_SPACE; i++) {
+            if (stats->loopHeads[i] && (best < 0 || stats->loopHeads[i] > stats->loopHeads[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        printf("  %03X: %llu\n", best, (unsigned long long)stats->loopHeads[best]);
+        stats->loopHeads[best] = 0;
+    }
+
+    printHeatmap("Execution heatmap", stats->executed);
+    printHeatmap("Memory write heatmap", stats->written);
+    free(stats);
+    return 0;
+}
+
+static bool sameRecord(const traceRecord_t *a, const traceRecord_t *b) {
+    if (a->pc != b->pc || a->opcode != b->opcode || a->regMask != b->regMask ||
+        a->iChanged != b->iChanged || a->memLength != b->memLength) {
+        return false;
+    }
+    for (int r = 0; r < 16; r++) {
+        if ((a->regMask & (1 << r)) && a->V[r] != b->V[r]) {
+            return false;
+        }
+    }
+    return (!a->iChanged || a->I == b->I) && (!a->memLength || a->memAddr == b->memAddr);
+}
+
+// Walks both traces block by block and reports the first record that differs
+static int diffTraces(const char *pathA, const char *pathB, const traceFilter_t *filter) {
+    traceReader_t a, b;
+    if (openTraceReader(&a, pathA) != 0) {
+        fprintf(stderr, "Can't read trace: %s\n", pathA);
+        return -1;
+    }
+    if (openTraceReader(&b, pathB) != 0) {
+        fprintf(stderr, "Can't read trace: %s\n", pathB);
+        closeTraceReader(&a);
+        return -1;
+    }
+    traceRecord_t *recordsA = malloc(TRACE_BLOCK_RECORDS * sizeof(traceRecord_t));
+    traceRecord_t *recordsB = malloc(TRACE_BLOCK_RECORDS * sizeof(traceRecord_t));
+    int result = -1;
+    if (!recordsA || !recordsB) {
+        goto done;
+    }
+
+    uint64_t index = filter->start;
+    uint64_t end = a.recordCount < b.recordCount ? a.recordCount : b.recordCount;
+    if (filter->count && filter->start + filter->count < end) {
+        end = filter->start + filter->count;
+    }
+    while (index < end) {
+        uint64_t blockA = findTraceBlock(&a, index);
+        uint64_t blockB = findTraceBlock(&b, index);
+        int countA = readTraceBlock(&a, blockA, recordsA);
+        int countB = readTraceBlock(&b, blockB, recordsB);
+        if (countA < 0 || countB < 0) {
+            fprintf(stderr, "Corrupt trace block\n");
+            goto done;
+        }
+        uint64_t firstA = a.blockFirst[blockA];
+        uint64_t firstB = b.blockFirst[blockB];
+        while (index < end && index - firstA < (uint64_t)countA && index - firstB < (uint64_t)countB) {
+            const traceRecord_t *recA = &recordsA[index - firstA];
+            const traceRecord_t *recB = &recordsB[index - firstB];
+            if (!sameRecord(recA, recB)) {
+                printf("Traces diverge at record %llu\n", (unsigned long long)index);
+                // A little context from before the divergence, when it is in the same block
+                uint64_t contextStart = index - firstA >= 4 ? index - 4 : firstA;
+                for (uint64_t i = contextStart; i < index; i++) {
+                    printf("    ");
+                    printRecord(&recordsA[i - firstA]);
+                }
+                printf("  A ");
+                printRecord(recA);
+                printf("  B ");
+                printRecord(recB);
+                result = 1;
+                goto done;
+            }
+            index++;
+        }
+    }
+
+    if (a.recordCount != b.recordCount && !filter->count) {
+        printf("Traces match for %llu records, then %s ends (%llu vs %llu records)\n",
+               (unsigned long long)end, a.recordCount < b.recordCount ? pathA : pathB,
+               (unsigned long long)a.recordCount, (unsigned long long)b.recordCount);
+        result = 1;
+    } else {
+        printf("Traces match (%llu records compared)\n", (unsigned long long)(end - filter->start));
+        result = 0;
+    }
+
+done:
+    free(recordsA);
+    free(recordsB);
+    closeTraceReader(&a);
+    closeTraceReader(&b);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *command = argv[1];
+    const char *paths[2] = { NULL, NULL };
+    int pathCount = 0;
+    traceFilter_t filter = { 0x000, 0xFFFF, 0, 0 };
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            filter.from = (uint16_t)strtoul(argv[++i], NULL, 16);
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            filter.to = (uint16_t)strtoul(argv[++i], NULL, 16);
+        } else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+            filter.start = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            filter.count = strtoull(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && pathCount < 2) {
+            paths[pathCount++] = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int result;
+    if (strcmp(command, "dump") == 0 && pathCount == 1) {
+        result = forEachRecord(paths[0], &filter, dumpRecord, NULL);
+    } else if (strcmp(command, "stats") == 0 && pathCount == 1) {
+        result = printStats(paths[0], &filter);
+    } else if (strcmp(command, "diff") == 0 && pathCount == 2) {
+        result = diffTraces(paths[0], paths[1], &filter);
+    } else {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}